@@ -0,0 +1,87 @@
+/*
+ * webapp_arena.cpp
+ *
+ *  Created on: 18 окт. 2026 г.
+ */
+
+#include "webapp_arena.hpp"
+
+#include <cstdlib>
+
+namespace webapp {
+
+// заголовок блока выравнивается так же, как и данные за ним
+static const USize kHeaderSize = (sizeof(void*) + sizeof(USize) +
+                                  alignof(std::max_align_t) - 1) &
+                                 ~(alignof(std::max_align_t) - 1);
+
+Arena::Arena(USize block_size)
+    : _block_size(block_size > 0 ? block_size : kDefBlockSize),
+      _first(0),
+      _current(0),
+      _offset(0),
+      _used(0) {
+}
+
+Arena::~Arena() {
+  while (_first != 0) {
+    Block *next = _first->next;
+    free(_first);
+    _first = next;
+  }
+}
+
+Arena::Block* Arena::AddBlock(USize size) {
+  Block *block = static_cast<Block*>(malloc(kHeaderSize + size));
+  if (block == 0) {
+    throw std::bad_alloc();
+  }
+  block->next = 0;
+  block->size = size;
+  if (_current == 0) {
+    _first = block;
+  } else {
+    _current->next = block;
+    _used         += _offset;
+  }
+  _current = block;
+  _offset  = 0;
+  return block;
+}
+
+void* Arena::Allocate(USize size, USize align) {
+  if (_current != 0) {
+    const USize kStart = (_offset + align - 1) & ~(align - 1);
+    if (kStart + size <= _current->size) {
+      _offset = kStart + size;
+      return reinterpret_cast<uint8_t*>(_current) + kHeaderSize + kStart;
+    }
+  }
+  // крупный запрос получает собственный блок, а не тратит на себя новый
+  // блок обычного размера
+  AddBlock(size > _block_size / 2 ? size : _block_size);
+  _offset = size;
+  return reinterpret_cast<uint8_t*>(_current) + kHeaderSize;
+}
+
+void Arena::Reset() {
+  if (_first == 0) {
+    return;
+  }
+  Block *block = _first->next;
+  while (block != 0) {
+    Block *next = block->next;
+    free(block);
+    block = next;
+  }
+  _first->next = 0;
+  _current     = _first;
+  _offset      = 0;
+  _used        = 0;
+}
+
+USize Arena::Used() const {
+  return _used + _offset;
+}
+
+} // namespace webapp
@@ -0,0 +1,127 @@
+/*
+ * webapp_arena.hpp
+ *
+ *  Created on: 18 окт. 2026 г.
+ */
+
+#ifndef BACK_END_WEBAPP_ARENA_HPP_
+#define BACK_END_WEBAPP_ARENA_HPP_
+
+#include "webapp_proto.hpp"
+
+#include <new>
+#include <map>
+#include <vector>
+#include <string>
+#include <cstddef>
+
+namespace webapp {
+
+/**
+ * Монотонный распределитель памяти ("арена"): память выдаётся из крупных
+ * блоков простым смещением указателя и по отдельности не освобождается, а
+ * освобождается вся сразу при вызове Reset. Используется одним потоком,
+ * по этому обходится без блокировок общего распределителя памяти.
+ */
+class Arena {
+  public:
+    static const USize kDefBlockSize = 8 * 1024;
+
+    Arena(USize block_size = kDefBlockSize);
+    ~Arena();
+    /**
+     * @param align  выравнивание, степень двойки
+     */
+    void* Allocate(USize size, USize align);
+    /**
+     * Освобождение всей выделенной памяти. Первый блок сохраняется для
+     * повторного использования, остальные возвращаются системе.
+     */
+    void  Reset();
+    USize Used() const;
+  private:
+    struct Block {
+      Block *next;
+      USize  size;
+    };
+
+    Arena(const Arena&);
+    void operator= (const Arena&);
+    Block* AddBlock(USize size);
+
+    USize  _block_size;
+    Block *_first;
+    Block *_current;
+    USize  _offset;  // занято в текущем блоке
+    USize  _used;    // занято в предыдущих блоках
+};
+/**
+ * Распределитель для стандартных контейнеров, выдающий память из арены.
+ * Без арены (конструктор по умолчанию) используется обычная куча. Копия
+ * контейнера памяти арены не использует, по этому может пережить её сброс.
+ */
+template <typename Type>
+class ArenaAllocator {
+  public:
+    typedef Type value_type;
+
+    ArenaAllocator(): _arena(0) {}
+    explicit ArenaAllocator(Arena *arena): _arena(arena) {}
+    template <typename Other>
+    ArenaAllocator(const ArenaAllocator<Other> &src): _arena(src.get_arena()) {}
+
+    Type* allocate(std::size_t amount) {
+      if (_arena == 0) {
+        return static_cast<Type*>(::operator new(amount * sizeof(Type)));
+      }
+      return static_cast<Type*>(_arena->Allocate(amount * sizeof(Type),
+                                                 alignof(Type)));
+    }
+
+    void deallocate(Type *ptr, std::size_t) {
+      if (_arena == 0) {
+        ::operator delete(ptr);
+      }
+    }
+
+    ArenaAllocator select_on_container_copy_construction() const {
+      return ArenaAllocator();
+    }
+
+    Arena* get_arena() const {
+      return _arena;
+    }
+  private:
+    Arena *_arena;
+};
+
+template <typename Type, typename Other>
+bool operator== (const ArenaAllocator<Type> &a, const ArenaAllocator<Other> &b) {
+  return (a.get_arena() == b.get_arena());
+}
+
+template <typename Type, typename Other>
+bool operator!= (const ArenaAllocator<Type> &a, const ArenaAllocator<Other> &b) {
+  return (a.get_arena() != b.get_arena());
+}
+
+typedef std::basic_string<char,
+                          std::char_traits<char>,
+                          ArenaAllocator<char> > ArenaString;
+
+template <typename Value>
+struct ArenaVector {
+  typedef std::vector<Value, ArenaAllocator<Value> > Type;
+};
+
+template <typename Key, typename Value>
+struct ArenaMap {
+  typedef std::map<Key,
+                   Value,
+                   std::less<Key>,
+                   ArenaAllocator< std::pair<const Key, Value> > > Type;
+};
+
+} // namespace webapp
+
+#endif /* BACK_END_WEBAPP_ARENA_HPP_ */
@@ -6,11 +6,27 @@
  */
 
 #include "webapp_proto.hpp"
+#include "webapp_proto_uring.hpp"
+#include "webapp_timing_wheel.hpp"
 
 #include <list>
+#include <vector>
 #include <iostream>
+#include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread.hpp>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 
 namespace webapp {
 
@@ -41,32 +57,233 @@ const Server::Address Server::kUndefinedAddress = 0xFFFFFFFF;
 const Server::Address Server::kLoopbackAddress  = 0x7F000001;
 const Server::Address Server::kAllIPv4Addresses = 0x00000000;
 const Server::Port    Server::kUndefinedPort    = 0;
+const USize           Server::kDefWorkersAmount = 1;
+const USize           Server::kDefShardsAmount  = 1;
+const USize           Server::kDefIdleTimeout   = 0;
+const USize           Server::kDefHeaderTimeout = 30;
+const USize           Server::kDefBodyTimeout   = 60;
+const USize           Server::kDefWriteTimeout  = 60;
+const USize           Server::kDefPoolHighWater = 64;
 
 class Server::Resources {
   public:
+    class Session;
     /**
-     * Сессия сетевого подключения
+     * Реестр открытых сессий шарда. Сессия сама удаляет себя из реестра в
+     * момент закрытия, по этому обслуживание реестра стоит O(1) на событие
+     * и не зависит от количества подключений.
      */
-    class Session {
+    class Registry {
+      public:
+        typedef boost::shared_ptr<Session> SessionPtr;
+        typedef std::list<SessionPtr>      ListOfPtr;
+        typedef ListOfPtr::iterator        Position;
+
+        Registry(): _amount(0) {
+        }
+
+        Position Register(const SessionPtr &sess) {
+          boost::mutex::scoped_lock lock(_mutex);
+          _amount++;
+          return _sessions.insert(_sessions.end(), sess);
+        }
+
+        void Unregister(Position pos) {
+          boost::mutex::scoped_lock lock(_mutex);
+          _amount--;
+          _sessions.erase(pos);
+        }
+
+        USize Size() {
+          boost::mutex::scoped_lock lock(_mutex);
+          return _amount;
+        }
+      private:
+        boost::mutex _mutex;
+        ListOfPtr    _sessions;
+        USize        _amount;
+    };
+    /**
+     * Пул буферов ввода/вывода с несколькими классами размеров. Сессия берёт
+     * буфер только на время обмена данными и возвращает его в пул, когда
+     * ожидает очередной запрос, по этому простаивающие соединения памяти под
+     * буферы не занимают. В пуле хранится не более high_water буферов
+     * каждого класса.
+     */
+    class BufferPool {
+      public:
+        struct Buffer {
+          Buffer(): data(0), size(0), size_class(0) {}
+          Protocol::Byte *data;
+          USize           size;
+          USize           size_class;
+        };
+
+        static const USize kClassesAmount = 3;
+
+        static USize GetSize(USize size_class) {
+          static const USize kSizes[kClassesAmount] = {
+            4 * 1024, 16 * 1024, 64 * 1024
+          };
+          return kSizes[size_class < kClassesAmount ? size_class
+                                                    : kClassesAmount - 1];
+        }
+
+        BufferPool(USize high_water): _high_water(high_water), _in_use(0) {
+        }
+
+        ~BufferPool() {
+          for (USize id = 0; id < kClassesAmount; id++) {
+            std::vector<Protocol::Byte*>::iterator it = _idle[id].begin();
+            for (; it != _idle[id].end(); it++) {
+              delete[] *it;
+            }
+          }
+        }
+
+        void Take(USize size_class, Buffer *out) {
+          out->size_class = (size_class < kClassesAmount ? size_class
+                                                         : kClassesAmount - 1);
+          out->size       = GetSize(out->size_class);
+          boost::mutex::scoped_lock lock(_mutex);
+          std::vector<Protocol::Byte*> &idle = _idle[out->size_class];
+          _in_use += out->size;
+          if (idle.size() == 0) {
+            out->data = new Protocol::Byte[out->size];
+            return;
+          }
+          out->data = idle.back();
+          idle.pop_back();
+        }
+
+        void Give(Buffer *buff) {
+          if (buff->data == 0) {
+            return;
+          }
+          {
+            boost::mutex::scoped_lock lock(_mutex);
+            std::vector<Protocol::Byte*> &idle = _idle[buff->size_class];
+            _in_use -= buff->size;
+            if (idle.size() < _high_water) {
+              idle.push_back(buff->data);
+              buff->data = 0;
+            }
+          }
+          delete[] buff->data;
+          *buff = Buffer();
+        }
+        // объём буферов, выданных сессиям
+        USize InUse() {
+          boost::mutex::scoped_lock lock(_mutex);
+          return _in_use;
+        }
+      private:
+        const USize                  _high_water;
+        USize                        _in_use;
+        boost::mutex                 _mutex;
+        std::vector<Protocol::Byte*> _idle[kClassesAmount];
+    };
+    typedef webapp::TimingWheel< boost::weak_ptr<Session> > TimingWheel;
+    /**
+     * Сессия сетевого подключения. Обработчики чтения и записи сессии
+     * выполняются через strand, по этому, даже при нескольких потоках
+     * обслуживающих io_service, они никогда не выполняются одновременно.
+     */
+    class Session : public boost::enable_shared_from_this<Session> {
       public:
         typedef void (*OnConnection)(Server::Resources *srv_res);
-        typedef asio::ip::tcp::socket      Socket;
-        typedef boost::scoped_ptr<Socket>  SocketPtr;
-        typedef asio::ip::tcp::endpoint    EndPoint;
-        typedef boost::shared_ptr<Session> Ptr;
-        typedef std::list<Ptr>             ListOfPtr;
-
-        static const USize kDefBuffSize = 1514; // MTU
-
-        Session(Socket         *socket_ptr,
-                Protocol       *protocol_ptr,
-                Inspector::Ptr  inspector_ptr)
-            : socket(socket_ptr),
-              protocol(protocol_ptr),
+        // сокет любого семейства адресов: IPv4, IPv6 или Unix
+        typedef asio::generic::stream_protocol::socket   Socket;
+        typedef boost::scoped_ptr<Socket>                SocketPtr;
+        typedef asio::generic::stream_protocol::endpoint EndPoint;
+        typedef std::vector<EndPoint>                    EndPoints;
+        typedef boost::shared_ptr<Session>               Ptr;
+        typedef asio::io_service::strand                 Strand;
+        // стадия обслуживания, определяет ограничение времени
+        enum Stage {
+          kIdle,
+          kHeader,
+          kBody,
+          kWrite,
+          kLinger
+        };
+        typedef std::vector<asio::const_buffer> Buffers;
+        typedef asio::detail::socket_option::boolean<IPPROTO_TCP,
+                                                     TCP_CORK> Cork;
+        // после скольких, подряд заполненных целиком, чтений или записей
+        // буфер заменяется буфером следующего класса размеров
+        static const USize kFullTransfersToGrow = 2;
+        // секунд чтения данных клиента после ответа, перед закрытием
+        static const USize kLingerTimeout       = 1;
+
+        Session(asio::io_service &service,
+                BufferPool       *buffers_pool,
+                TimingWheel      *deadlines_wheel,
+                Inspector::Ptr    inspector_ptr,
+                const Timeouts   &session_timeouts)
+            : strand(service),
+              deadlines(deadlines_wheel),
+              timeouts(session_timeouts),
+              stage(kIdle),
+              socket(new Socket(service)),
+              buffers(buffers_pool),
+              next_chunk(0),
+              use_sendfile(true),
+              use_cork(false),
               inspector(inspector_ptr),
               need_to_send(0),
-              was_sended(0) {
-          buff.reset(new Protocol::Byte[kDefBuffSize]);
+              was_sended(0),
+              full_transfers(0),
+              alive(false),
+              registry(0) {
+        }
+
+        ~Session() {
+          deadlines->Cancel(&deadline);
+          ReleaseBuffer();
+        }
+        /**
+         * Подготовка сессии (в том числе взятой из пула) к приёму подключения.
+         * Сокет и реализация протокола сохраняются.
+         */
+        void Reset() {
+          if (socket->is_open()) {
+            Inspector::Error error;
+            socket->close(error);
+          }
+          need_to_send   = 0;
+          was_sended     = 0;
+          full_transfers = 0;
+          next_chunk     = 0;
+          use_sendfile   = true;
+          stage          = kIdle;
+          alive          = true;
+          registry       = 0;
+        }
+
+        void ReleaseBuffer() {
+          buffers->Give(&buff);
+          full_transfers = 0;
+        }
+        /**
+         * Учёт заполненных целиком операций чтения/записи, при устойчивом
+         * потоке больших данных буфер увеличивается. Вызывается только тогда,
+         * когда буфер не содержит неотправленных данных.
+         */
+        void AdaptBuffer(bool was_full) {
+          full_transfers = (was_full ? full_transfers + 1 : 0);
+          if (buff.data == 0) {
+            buffers->Take(0, &buff);
+            return;
+          }
+          if (full_transfers < kFullTransfersToGrow ||
+              buff.size_class + 1 >= BufferPool::kClassesAmount) {
+            return;
+          }
+          const USize kNextClass = buff.size_class + 1;
+          buffers->Give(&buff);
+          buffers->Take(kNextClass, &buff);
+          full_transfers = 0;
         }
 
         void WaitForRequest() {
@@ -75,11 +292,23 @@ class Server::Resources {
           }
           need_to_send = 0;
           was_sended   = 0;
-          socket->async_read_some(boost::asio::buffer(buff.get(), kDefBuffSize),
-            boost::bind(&Session::ReadHandler,
-              this,
+          // без буфера ожидаем только готовности данных к чтению
+          if (buff.data == 0) {
+            socket->async_wait(Socket::wait_read,
+              strand.wrap(boost::bind(&Session::ReadyHandler,
+                shared_from_this(),
+                asio::placeholders::error)));
+            return;
+          }
+          ReadSome();
+        }
+
+        void ReadSome() {
+          socket->async_read_some(boost::asio::buffer(buff.data, buff.size),
+            strand.wrap(boost::bind(&Session::ReadHandler,
+              shared_from_this(),
               boost::asio::placeholders::error,
-              boost::asio::placeholders::bytes_transferred));
+              boost::asio::placeholders::bytes_transferred)));
         }
 
         void SendResponse() {
@@ -88,34 +317,232 @@ class Server::Resources {
                                      Inspector::Error());
             return;
           }
+          // реализация протокола сама предоставляет фрагменты ответа
+          if (need_to_send == 0 && protocol->PrepareResponseChunks(&chunks)) {
+            next_chunk = 0;
+            SendChunks();
+            return;
+          }
           const USize kWasLost = need_to_send - was_sended;
-          need_to_send = kWasLost;
           if (kWasLost == 0) {
-            need_to_send = protocol->PrepareResponse(buff.get(), kDefBuffSize);
+            AdaptBuffer(need_to_send > 0 && need_to_send == buff.size);
+            need_to_send = protocol->PrepareResponse(buff.data, buff.size);
             was_sended   = 0;
           }
           if (need_to_send == 0) {
-            if (protocol->NeedToCloseSession()) {
-              socket->close();
+            CompleteResponse();
+            return;
+          }
+          socket->async_write_some(asio::buffer(buff.data + was_sended,
+                                   need_to_send - was_sended),
+            strand.wrap(boost::bind(&Session::WriteHandler,
+              shared_from_this(),
+              asio::placeholders::error,
+              asio::placeholders::bytes_transferred)));
+        }
+        /**
+         * Отправка фрагментов ответа: идущие подряд участки памяти
+         * отправляются одной операцией записи (writev), участки файлов -
+         * через SendFile.
+         */
+        void SendChunks() {
+          if (chunks.size() == 0) {
+            CompleteResponse();
+            return;
+          }
+          if (next_chunk >= chunks.size()) {
+            SendResponse();
+            return;
+          }
+          if (chunks[next_chunk].data == 0) {
+            SendFile();
+            return;
+          }
+          gather.clear();
+          size_t last = next_chunk;
+          for (; last < chunks.size() && chunks[last].data != 0; last++) {
+            gather.push_back(asio::const_buffer(chunks[last].data,
+                                                chunks[last].size));
+          }
+          asio::async_write(*socket, gather,
+            strand.wrap(boost::bind(&Session::GatherHandler,
+              shared_from_this(),
+              asio::placeholders::error,
+              last)));
+        }
+        /**
+         * Отправка участка файла средствами ядра (sendfile), данные не
+         * копируются в пространство пользователя. Если файловая система этого
+         * не поддерживает, участок читается в буфер сессии и отправляется
+         * обычной записью.
+         */
+        void SendFile() {
+          Protocol::Chunk &chunk = chunks[next_chunk];
+#if defined(__linux__)
+          while (use_sendfile && chunk.size > 0) {
+            Inspector::Error error;
+            socket->native_non_blocking(true, error);
+            off_t         offs  = chunk.offset;
+            const ssize_t kSent = (error ? -1 : ::sendfile(socket->native_handle(),
+                                                          chunk.file,
+                                                          &offs,
+                                                          chunk.size));
+            if (kSent > 0) {
+              chunk.offset += kSent;
+              chunk.size   -= kSent;
+              continue;
+            }
+            if (kSent < 0 && errno == EINTR) {
+              continue;
+            }
+            if (kSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+              socket->async_wait(Socket::wait_write,
+                strand.wrap(boost::bind(&Session::FileHandler,
+                  shared_from_this(),
+                  asio::placeholders::error)));
               return;
             }
-            WaitForRequest();
+            if (kSent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+              use_sendfile = false;
+              break;
+            }
+            inspector->RegisterError("Ошибка отправки файла", Inspector::Error(
+              kSent < 0 ? errno : EIO, boost::system::system_category()));
+            Close();
             return;
           }
-          socket->async_write_some(asio::buffer(buff.get() + was_sended,
-                                   need_to_send),
-            boost::bind(&Session::WriteHandler,
-              this,
-              asio::placeholders::error,
-              asio::placeholders::bytes_transferred));
+#endif
+          if (chunk.size == 0) {
+            next_chunk++;
+            SendChunks();
+            return;
+          }
+          if (buff.data == 0) {
+            AdaptBuffer(false);
+          }
+          const USize   kSize = (chunk.size < buff.size ? chunk.size : buff.size);
+          const ssize_t kRead = ::pread(chunk.file, buff.data, kSize, chunk.offset);
+          if (kRead <= 0) {
+            inspector->RegisterError("Ошибка чтения файла", Inspector::Error(
+              kRead < 0 ? errno : EIO, boost::system::system_category()));
+            Close();
+            return;
+          }
+          chunk.offset += kRead;
+          chunk.size   -= kRead;
+          asio::async_write(*socket, asio::buffer(buff.data, kRead),
+            strand.wrap(boost::bind(&Session::FileHandler,
+              shared_from_this(),
+              asio::placeholders::error)));
+        }
+
+        void CompleteResponse() {
+          if (protocol->NeedToCloseSession()) {
+            Linger();
+            return;
+          }
+          // ответ отправлен, до следующего запроса буфер не нужен
+          ReleaseBuffer();
+          SetCork(false);
+          SetDeadline(kIdle);
+          WaitForRequest();
+        }
+        /**
+         * Закрытие после отправленного ответа. Если закрыть сокет, когда
+         * клиент ещё передаёт данные (например, тело отклонённого запроса),
+         * то ядро ответит на них RST, и клиент может потерять не прочитанный
+         * им ответ. По этому сначала передаётся FIN, а данные клиента
+         * читаются и отбрасываются, пока он не закроет соединение, но не
+         * дольше kLingerTimeout.
+         */
+        void Linger() {
+          Inspector::Error error;
+          socket->shutdown(Socket::shutdown_send, error);
+          if (not error) {
+            socket->non_blocking(true, error);
+          }
+          if (error) {
+            Close();
+            return;
+          }
+          ReleaseBuffer();
+          SetDeadline(kLinger);
+          WaitToDiscard();
+        }
+
+        void WaitToDiscard() {
+          socket->async_wait(Socket::wait_read,
+            strand.wrap(boost::bind(&Session::DiscardHandler,
+              shared_from_this(),
+              asio::placeholders::error)));
+        }
+
+        void DiscardHandler(const Inspector::Error &error) {
+          if (error || not IsAlive()) {
+            Close();
+            return;
+          }
+          char             discard[1024];
+          Inspector::Error read_error;
+          while (socket->read_some(asio::buffer(discard), read_error) > 0) {
+          }
+          if (read_error == asio::error::would_block) {
+            WaitToDiscard();
+            return;
+          }
+          Close();
+        }
+        // снятие TCP_CORK отправляет накопленный неполный сегмент
+        void SetCork(bool enable) {
+          if (not use_cork) {
+            return;
+          }
+          Inspector::Error error;
+          socket->set_option(Cork(enable), error);
+        }
+
+        void SetDeadline(Stage next_stage) {
+          static const USize Timeouts::*kTimeoutOf[] = {
+            &Timeouts::idle, &Timeouts::header, &Timeouts::body, &Timeouts::write
+          };
+          stage = next_stage;
+          deadlines->Arm(&deadline, shared_from_this(),
+                         stage == kLinger ? kLingerTimeout : timeouts.*kTimeoutOf[stage]);
+        }
+
+        void DeadlineHandler(USize generation) {
+          // срок был изменён или отменён после срабатывания
+          if (generation != deadline.generation || not IsAlive()) {
+            return;
+          }
+          static const char *kMessages[] = {
+            "Превышено время ожидания запроса",
+            "Превышено время получения заголовка запроса",
+            "Превышено время получения тела запроса",
+            "Превышено время отправки ответа",
+            "Превышено время закрытия соединения"
+          };
+          inspector->RegisterMessage(kMessages[stage]);
+          Close();
+        }
+
+        void ReadyHandler(const Inspector::Error &error) {
+          if (error) {
+            ReadHandler(error, 0);
+            return;
+          }
+          AdaptBuffer(false);
+          ReadSome();
         }
 
         void ReadHandler(const Inspector::Error &error, size_t amount) {
           if (error) {
             inspector->RegisterError("Ошибка чтения данных", error);
+            Close();
             return;
           }
           if (amount == 0) {
+            Close();
             return;
           }
           if (not protocol) {
@@ -124,106 +551,747 @@ class Server::Resources {
             return;
           }
           // чтение данных до тех пор, пока реализация протокола не скажет хватит
-          if (protocol->HandleRequest(buff.get(), amount)) {
+          if (protocol->HandleRequest(buff.data, amount)) {
+            AdaptBuffer(amount == buff.size);
+            // заголовок должен быть получен целиком за отведённое время
+            // (защита от "slow loris"), а тело - без длительных пауз
+            if (protocol->IsHeaderReceived()) {
+              SetDeadline(kBody);
+            } else if (stage != kHeader) {
+              SetDeadline(kHeader);
+            }
             WaitForRequest();
             return;
           }
+          need_to_send = 0;
+          was_sended   = 0;
+          SetDeadline(kWrite);
+          SetCork(true);
           SendResponse();
         }
 
         void WriteHandler(const Inspector::Error &error, size_t amount) {
           if (error) {
             inspector->RegisterError("Ошибка отправки данных", error);
+            Close();
             return;
           }
-          was_sended = amount;
+          was_sended += amount;
+          SetDeadline(kWrite);
           SendResponse();
         }
 
+        void GatherHandler(const Inspector::Error &error, size_t last) {
+          if (error) {
+            inspector->RegisterError("Ошибка отправки данных", error);
+            Close();
+            return;
+          }
+          next_chunk = last;
+          SetDeadline(kWrite);
+          SendChunks();
+        }
+
+        void FileHandler(const Inspector::Error &error) {
+          if (error) {
+            inspector->RegisterError("Ошибка отправки файла", error);
+            Close();
+            return;
+          }
+          SetDeadline(kWrite);
+          SendFile();
+        }
+
+        void Close() {
+          Inspector::Error error;
+          if (socket != 0) {
+            socket->close(error);
+          }
+          deadlines->Cancel(&deadline);
+          alive = false;
+          if (registry != 0) {
+            registry->Unregister(position);
+            registry = 0;
+            inspector->RegisterMessage("Удаление сессии...");
+          }
+        }
+
+        void Register(Registry *reg) {
+          registry = reg;
+          position = registry->Register(shared_from_this());
+        }
+
         bool IsAlive() const {
-          return (socket != 0 && socket->is_open());
+          return alive;
         }
 
+        Strand                 strand;
+        TimingWheel           *deadlines;
+        TimingWheel::Handle    deadline;
+        const Timeouts         timeouts;
+        Stage                  stage;
         SocketPtr              socket;
-        Protocol::ArrayOfBytes buff;
+        BufferPool            *buffers;
+        BufferPool::Buffer     buff;
         Protocol::Ptr          protocol;
+        Protocol::Chunks       chunks;
+        size_t                 next_chunk;
+        Buffers                gather;
+        bool                   use_sendfile;
+        bool                   use_cork;
         Inspector::Ptr         inspector;
         USize                  need_to_send;
         USize                  was_sended;
+        USize                  full_transfers;
+        bool                   alive;
+        Registry              *registry;
+        Registry::Position     position;
+    };
+    /**
+     * Пул закрытых сессий шарда. Сессия возвращается в пул вместе с сокетом,
+     * буфером и реализацией протокола, и используется для следующего
+     * подключения без обращения к куче. В пуле хранится не более high_water
+     * сессий, лишние удаляются.
+     */
+    class SessionPool {
+      public:
+        SessionPool(USize high_water)
+            : _high_water(high_water),
+              _closed(false) {
+        }
+
+        ~SessionPool() {
+          Close();
+        }
+
+        Session* Take() {
+          boost::mutex::scoped_lock lock(_mutex);
+          if (_idle.size() == 0) {
+            _counters.misses++;
+            return 0;
+          }
+          _counters.hits++;
+          Session *sess = _idle.back();
+          _idle.pop_back();
+          return sess;
+        }
+
+        bool Give(Session *sess) {
+          boost::mutex::scoped_lock lock(_mutex);
+          if (_closed || _idle.size() >= _high_water) {
+            _counters.dropped++;
+            return false;
+          }
+          _idle.push_back(sess);
+          return true;
+        }
+        /**
+         * Удаление всех сессий пула, дальнейший возврат сессий запрещается.
+         * Вызывается до уничтожения io_service, которому принадлежат сокеты.
+         */
+        void Close() {
+          boost::mutex::scoped_lock lock(_mutex);
+          _closed = true;
+          std::vector<Session*>::iterator it = _idle.begin();
+          for (; it != _idle.end(); it++) {
+            delete *it;
+          }
+          _idle.clear();
+        }
+
+        void AddCounters(PoolCounters *out) {
+          boost::mutex::scoped_lock lock(_mutex);
+          out->hits    += _counters.hits;
+          out->misses  += _counters.misses;
+          out->dropped += _counters.dropped;
+          out->idle    += _idle.size();
+        }
+      private:
+        const USize           _high_water;
+        bool                  _closed;
+        boost::mutex          _mutex;
+        std::vector<Session*> _idle;
+        PoolCounters          _counters;
     };
 
-    Resources(Address         addr,
-              Port            port,
-              Server         *server_ptr,
-              Inspector::Ptr  inspector_ptr)
-        : server(server_ptr),
+    /**
+     * Шард сервера: собственный цикл обработки событий (io_service), приёмник
+     * подключений и список сессий. Шарды ничего не разделяют между собой,
+     * а входящие подключения между ними распределяет ядро (SO_REUSEPORT).
+     */
+    class Shard {
+      public:
+        typedef boost::shared_ptr<Shard>                               Ptr;
+        typedef std::vector<Ptr>                                       List;
+        typedef asio::detail::socket_option::boolean<SOL_SOCKET,
+                                                     SO_REUSEPORT>     ReusePort;
+        typedef asio::detail::socket_option::integer<IPPROTO_TCP,
+                                                     TCP_DEFER_ACCEPT> DeferAccept;
+        typedef asio::detail::socket_option::integer<IPPROTO_TCP,
+                                                     TCP_FASTOPEN>     FastOpen;
+        typedef asio::basic_socket_acceptor<
+                  asio::generic::stream_protocol>                      Acceptor;
+        // приёмник подключений по одному из адресов сервера
+        struct Listener {
+          Listener(asio::io_service &service, bool is_tcp)
+              : acceptor(service),
+                accept_timer(service),
+                tcp(is_tcp) {
+          }
+          Acceptor             acceptor;
+          asio::deadline_timer accept_timer;
+          Session::Ptr         next_session;
+          bool                 tcp; // IPv4 или IPv6, применимы настройки TCP
+        };
+        typedef boost::shared_ptr<Listener>                            ListenerPtr;
+        typedef std::vector<ListenerPtr>                               Listeners;
+
+        // пауза в приёме подключений при превышении ограничений
+        static const USize kAcceptPauseMs = 50;
+        /**
+         * @param first  первый шард, с которым разделяются сокеты Unix (ядро
+         *               не распределяет их подключения через SO_REUSEPORT),
+         *               0 - сокеты открывает сам шард
+         */
+        Shard(const Session::EndPoints &endpoints,
+              bool                      reuse_port,
+              const Shard              *first,
+              Resources                *res_ptr)
+            : res(res_ptr),
+              buffers(res_ptr->pool_high_water),
+              pool(res_ptr->pool_high_water),
+              wheel_timer(service),
+              accept_tokens(res_ptr->limits.accept_rate),
+              accept_time(boost::posix_time::microsec_clock::universal_time()) {
+          for (size_t id = 0; id < endpoints.size(); id++) {
+            const Session::EndPoint &kEndPoint = endpoints[id];
+            ListenerPtr listener(new Listener(service,
+                                              kEndPoint.protocol().family() != AF_UNIX));
+            if (first != 0 && not listener->tcp) {
+              listener->acceptor.assign(kEndPoint.protocol(),
+                dup(first->listeners[id]->acceptor.native_handle()));
+            } else {
+              Listen(listener.get(), kEndPoint, reuse_port);
+            }
+            listeners.push_back(listener);
+          }
+          for (size_t id = 0; id < listeners.size(); id++) {
+            WaitForConnection(listeners[id].get());
+          }
+          WaitForTick();
+        }
+
+        ~Shard() {
+          service.stop();
+          pool.Close();
+        }
+
+        void Listen(Listener                *listener,
+                    const Session::EndPoint &endpoint,
+                    bool                     reuse_port) {
+          Acceptor &acceptor = listener->acceptor;
+          acceptor.open(endpoint.protocol());
+          acceptor.set_option(Acceptor::reuse_address(true));
+          if (reuse_port && listener->tcp) {
+            acceptor.set_option(ReusePort(true));
+          }
+          if (endpoint.protocol().family() == AF_INET6) {
+            acceptor.set_option(asio::ip::v6_only(true));
+          }
+          const SocketOptions &kOpts = res->socket_options;
+          Inspector::Error     error;
+          SetBuffersSize(&acceptor);
+          acceptor.bind(endpoint);
+          if (kOpts.defer_accept > 0 && listener->tcp) {
+            acceptor.set_option(DeferAccept(kOpts.defer_accept), error);
+            CheckOption("TCP_DEFER_ACCEPT", error);
+          }
+          if (kOpts.fast_open > 0 && listener->tcp) {
+            acceptor.set_option(FastOpen(kOpts.fast_open), error);
+            CheckOption("TCP_FASTOPEN", error);
+          }
+          acceptor.listen(kOpts.backlog > 0 ? kOpts.backlog :
+                          asio::socket_base::max_connections);
+        }
+
+        void CheckOption(const std::string &name, const Inspector::Error &error) {
+          if (error) {
+            res->inspector->RegisterError("Ошибка настройки сокета " + name, error);
+          }
+        }
+        // размеры буферов приёмника наследуются принятыми сокетами в Linux,
+        // но не во всех системах, по этому задаются и тем и другим
+        template <typename SocketType>
+        void SetBuffersSize(SocketType *socket) {
+          const SocketOptions &kOpts = res->socket_options;
+          Inspector::Error     error;
+          if (kOpts.send_buffer > 0) {
+            socket->set_option(asio::socket_base::send_buffer_size(
+              kOpts.send_buffer), error);
+            CheckOption("SO_SNDBUF", error);
+          }
+          if (kOpts.receive_buffer > 0) {
+            socket->set_option(asio::socket_base::receive_buffer_size(
+              kOpts.receive_buffer), error);
+            CheckOption("SO_RCVBUF", error);
+          }
+        }
+
+        void ConfigureSession(Session *sess, bool tcp) {
+          const SocketOptions &kOpts = res->socket_options;
+          Inspector::Error     error;
+          if (kOpts.no_delay && tcp) {
+            sess->socket->set_option(asio::ip::tcp::no_delay(true), error);
+            CheckOption("TCP_NODELAY", error);
+          }
+          SetBuffersSize(sess->socket.get());
+          sess->use_cork = (kOpts.cork && tcp);
+        }
+
+        Session::Ptr AcquireSession() {
+          Session *sess = pool.Take();
+          if (sess == 0) {
+            sess = new Session(service, &buffers, &deadlines, res->inspector,
+                               res->timeouts);
+          }
+          sess->Reset();
+          return Session::Ptr(sess, boost::bind(&Shard::ReleaseSession, this, _1));
+        }
+
+        void ReleaseSession(Session *sess) {
+          sess->ReleaseBuffer();
+          if (not pool.Give(sess)) {
+            delete sess;
+          }
+        }
+
+        bool IsOverloaded() {
+          const Limits &kLimits = res->limits;
+          return ((kLimits.sessions > 0 &&
+                   sessions.Size() >= kLimits.sessions) ||
+                  (kLimits.buffered_bytes > 0 &&
+                   buffers.InUse() >= kLimits.buffered_bytes));
+        }
+        /**
+         * Ограничение частоты подключений ("ведро с жетонами"): жетоны
+         * пополняются со скоростью accept_rate в секунду, но их не может
+         * накопиться больше, чем на одну секунду. Приёмники шарда
+         * обслуживаются разными потоками, по этому ведро под мьютексом.
+         */
+        bool TakeAcceptToken() {
+          const USize kRate = res->limits.accept_rate;
+          if (kRate == 0) {
+            return true;
+          }
+          boost::mutex::scoped_lock lock(accept_mutex);
+          const PTime kNow = boost::posix_time::microsec_clock::universal_time();
+          const double kElapsed = (kNow - accept_time).total_microseconds() / 1e6;
+          accept_time   = kNow;
+          accept_tokens = std::min<double>(kRate, accept_tokens + kElapsed * kRate);
+          if (accept_tokens < 1) {
+            return false;
+          }
+          accept_tokens -= 1;
+          return true;
+        }
+
+        void WaitForConnection(Listener *listener) {
+          if (not TakeAcceptToken() ||
+              (res->overload_response.size() == 0 && IsOverloaded())) {
+            PauseAccepting(listener);
+            return;
+          }
+          listener->next_session = AcquireSession();
+          listener->acceptor.async_accept(
+            *listener->next_session->socket,
+            boost::bind(&Shard::HandleAccept,
+                        this,
+                        listener,
+                        asio::placeholders::error));
+        }
+        // новые подключения ожидают в очереди ядра (backlog)
+        void PauseAccepting(Listener *listener) {
+          listener->accept_timer.expires_from_now(
+            boost::posix_time::milliseconds(kAcceptPauseMs));
+          listener->accept_timer.async_wait(boost::bind(&Shard::ResumeAccepting,
+                                                        this,
+                                                        listener,
+                                                        asio::placeholders::error));
+        }
+
+        void ResumeAccepting(Listener *listener, const Inspector::Error &error) {
+          if (error == asio::error::operation_aborted) {
+            return;
+          }
+          WaitForConnection(listener);
+        }
+
+        void HandleAccept(Listener *listener, const Inspector::Error &error) {
+          if (error == asio::error::operation_aborted) {
+            return;
+          }
+          if (error) {
+            res->inspector->RegisterError("Ошибка подключения", error);
+            listener->next_session.reset();
+            // например, исчерпаны файловые дескрипторы
+            PauseAccepting(listener);
+            return;
+          }
+          res->inspector->RegisterMessage("Обнаружено подключение! Создание сессии...");
+          Session::Ptr sess;
+          sess.swap(listener->next_session);
+          if (IsOverloaded()) {
+            RejectSession(sess);
+            WaitForConnection(listener);
+            return;
+          }
+          /*
+           * Сессия управляет сокетом и реализацией протокола. Реализация
+           * протокола, оставшаяся от предыдущего подключения, используется
+           * повторно, если она это допускает.
+           */
+          if (not sess->protocol || not sess->protocol->Reset()) {
+            sess->protocol.reset(res->server->InitProtocol());
+          }
+          WaitForConnection(listener);
+          if (not sess->protocol) {
+            sess->Close();
+            return;
+          }
+          ConfigureSession(sess.get(), listener->tcp);
+          sess->Register(&sessions);
+          sess->SetDeadline(Session::kIdle);
+          sess->WaitForRequest();
+        }
+
+        void WaitForTick() {
+          wheel_timer.expires_from_now(
+            boost::posix_time::milliseconds(TimingWheel::kTickMs));
+          wheel_timer.async_wait(boost::bind(&Shard::HandleTick,
+                                             this,
+                                             asio::placeholders::error));
+        }
+
+        void HandleTick(const Inspector::Error &error) {
+          if (error == asio::error::operation_aborted) {
+            return;
+          }
+          expired.clear();
+          deadlines.Tick(&expired);
+          TimingWheel::ListOfExpired::iterator it = expired.begin();
+          for (; it != expired.end(); it++) {
+            Session::Ptr sess = it->session.lock();
+            if (sess) {
+              sess->strand.post(boost::bind(&Session::DeadlineHandler,
+                                            sess,
+                                            it->generation));
+            }
+          }
+          WaitForTick();
+        }
+        /**
+         * Отправка заранее подготовленного ответа о перегрузке, без чтения
+         * запроса и без создания реализации протокола.
+         */
+        void RejectSession(Session::Ptr sess) {
+          res->inspector->RegisterMessage("Сервер перегружен, подключение отклонено");
+          asio::async_write(*sess->socket,
+            asio::buffer(res->overload_response),
+            boost::bind(&Shard::HandleReject,
+                        this,
+                        sess,
+                        asio::placeholders::error));
+        }
+
+        void HandleReject(Session::Ptr sess, const Inspector::Error &error) {
+          if (error) {
+            sess->Close();
+            return;
+          }
+          sess->Linger();
+        }
+
+        void RunWorker() {
+          service.run();
+        }
+
+        Resources                  *res;
+        TimingWheel                 deadlines;
+        BufferPool                  buffers;
+        SessionPool                 pool;
+        boost::asio::io_service     service;
+        Registry                    sessions;
+        Listeners                   listeners;
+        asio::deadline_timer        wheel_timer;
+        TimingWheel::ListOfExpired  expired;
+        boost::mutex                accept_mutex;
+        double                      accept_tokens;
+        PTime                       accept_time;
+    };
+
+    Resources(const Endpoints          &endpoints_list,
+              const Session::EndPoints &resolved,
+              USize                     shards_amount,
+              USize                     workers_amount,
+              const Timeouts           &session_timeouts,
+              USize                     pool_high_water_mark,
+              const Limits             &server_limits,
+              Backend                   backend,
+              const SocketOptions      &options,
+              Server                   *server_ptr,
+              Inspector::Ptr            inspector_ptr)
+        : endpoints(endpoints_list),
+          server(server_ptr),
           inspector(inspector_ptr),
-          acceptor(service, asio::ip::tcp::endpoint(asio::ip::address_v4(addr),
-                                                    port)),
-          sess_socket(0) {
-      eth_addr = addr;
-      eth_port = port;
+          workers(workers_amount > 0 ? workers_amount : 1),
+          timeouts(session_timeouts),
+          pool_high_water(pool_high_water_mark),
+          overload_response(server_ptr->InitOverloadResponse()),
+          socket_options(options),
+          uring_loops(0) {
       if (not inspector) {
         inspector.reset(new Inspector());
       }
-      WaitForConnection();
+      RemoveStaleSocketFiles();
+      const USize kShards = (shards_amount > 0 ? shards_amount : 1);
+      if (backend == kBackendIoUring &&
+          StartUring(kShards * workers, server_limits)) {
+        RegisterSocketFiles();
+        return;
+      }
+      if (backend == kBackendIoUring) {
+        inspector->RegisterMessage("io_uring недоступен, используется asio");
+      }
+      limits.sessions       = ShareOf(server_limits.sessions, kShards);
+      limits.buffered_bytes = ShareOf(server_limits.buffered_bytes, kShards);
+      limits.accept_rate    = ShareOf(server_limits.accept_rate, kShards);
+      for (USize id = 0; id < kShards; id++) {
+        const Shard *kFirst = (id == 0 ? 0 : shards.front().get());
+        shards.push_back(Shard::Ptr(new Shard(resolved, kShards > 1, kFirst,
+                                              this)));
+      }
+      RegisterSocketFiles();
     }
 
-    void CloseBrokenSessions() {
-      Session::ListOfPtr::iterator it = sessions.begin();
-      for (; it != sessions.end();) {
-        Session::Ptr sess = *it;
-        if (not sess || not sess->IsAlive()) {
-          it = sessions.erase(it);
-          inspector->RegisterMessage("Удаление сессии...");
+    ~Resources() {
+      uring.reset();
+      shards.clear();
+      RemoveSocketFiles();
+    }
+    /**
+     * Преобразование адресов сервера в адреса asio. Возвращает false, если
+     * хотя бы один из адресов не распознан.
+     */
+    static bool ResolveEndPoints(const Endpoints    &src,
+                                 Session::EndPoints *dst,
+                                 Inspector::Ptr      inspector) {
+      Endpoints::const_iterator it = src.begin();
+      for (; it != src.end(); it++) {
+        Inspector::Error error;
+        if (it->family == Endpoint::kLocal) {
+          if (it->address.size() == 0 ||
+              it->address.size() >= sizeof(sockaddr_un().sun_path)) {
+            inspector->RegisterError("Недопустимый путь к сокету: " +
+                                     it->address, error);
+            return false;
+          }
+          dst->push_back(asio::local::stream_protocol::endpoint(it->address));
           continue;
         }
-        it++;
+        const asio::ip::address kAddr =
+          asio::ip::address::from_string(it->address, error);
+        if (error || kAddr.is_v6() != (it->family == Endpoint::kIPv6)) {
+          inspector->RegisterError("Недопустимый адрес: " + it->address, error);
+          return false;
+        }
+        dst->push_back(asio::ip::tcp::endpoint(kAddr, it->port));
+      }
+      return (dst->size() > 0);
+    }
+    // файл сокета Unix, созданный при открытии сокета этим сервером
+    struct SocketFile {
+      std::string path;
+      dev_t       device;
+      ino_t       inode;
+    };
+    typedef std::vector<SocketFile> ListOfSocketFiles;
+    /**
+     * Файл сокета Unix остаётся после закрытия сокета и мешает повторному
+     * открытию. Удаляется только файл, к которому никто не подключён
+     * (процесс завершился, не удалив его); файл работающего сервера
+     * остаётся, и открытие сокета завершается ошибкой.
+     */
+    void RemoveStaleSocketFiles() {
+      Endpoints::const_iterator it = endpoints.begin();
+      for (; it != endpoints.end(); it++) {
+        struct stat file_stat;
+        if (it->family != Endpoint::kLocal ||
+            lstat(it->address.c_str(), &file_stat) != 0 ||
+            not S_ISSOCK(file_stat.st_mode)) {
+          continue;
+        }
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, it->address.c_str(), sizeof(addr.sun_path) - 1);
+        const int kFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (kFd < 0) {
+          continue;
+        }
+        if (connect(kFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 &&
+            errno == ECONNREFUSED) {
+          inspector->RegisterMessage("Удаление оставшегося файла сокета: " +
+                                     it->address);
+          unlink(it->address.c_str());
+        }
+        close(kFd);
+      }
+    }
+    // запоминаются файлы открытых сокетов, чтобы при закрытии удалить их
+    void RegisterSocketFiles() {
+      Endpoints::const_iterator it = endpoints.begin();
+      for (; it != endpoints.end(); it++) {
+        struct stat file_stat;
+        if (it->family == Endpoint::kLocal &&
+            lstat(it->address.c_str(), &file_stat) == 0 &&
+            S_ISSOCK(file_stat.st_mode)) {
+          SocketFile file;
+          file.path   = it->address;
+          file.device = file_stat.st_dev;
+          file.inode  = file_stat.st_ino;
+          socket_files.push_back(file);
+        }
+      }
+    }
+    // удаляются только собственные файлы, а не созданные позже другим сервером
+    void RemoveSocketFiles() {
+      ListOfSocketFiles::const_iterator it = socket_files.begin();
+      for (; it != socket_files.end(); it++) {
+        struct stat file_stat;
+        if (lstat(it->path.c_str(), &file_stat) == 0 &&
+            file_stat.st_dev == it->device && file_stat.st_ino == it->inode) {
+          unlink(it->path.c_str());
+        }
+      }
+      socket_files.clear();
+    }
+
+    bool StartUring(USize loops, const Limits &server_limits) {
+      if (not UringService::IsSupported()) {
+        return false;
+      }
+      UringService::Settings settings;
+      settings.endpoints         = endpoints;
+      settings.loops             = loops;
+      settings.timeouts          = timeouts;
+      settings.limits            = server_limits;
+      settings.overload_response = overload_response;
+      settings.socket_options    = socket_options;
+      settings.factory           = boost::bind(&Server::InitProtocol, server);
+      settings.inspector         = inspector;
+      uring.reset(new UringService(settings));
+      if (not uring->Start()) {
+        uring.reset();
+        return false;
       }
+      uring_loops = loops;
+      return true;
     }
 
-    void WaitForConnection() {
-      sess_socket = new Session::Socket(service);
-      acceptor.async_accept(
-        *sess_socket,
-        boost::bind(&Resources::HandleAccept,
-                    this,
-                    asio::placeholders::error));
+    // доля ограничения, приходящаяся на один шард
+    static USize ShareOf(USize limit, USize shards_amount) {
+      return (limit + shards_amount - 1) / shards_amount;
     }
 
-    void HandleAccept(const Inspector::Error &error) {
-      if (error) {
-        inspector->RegisterError("Ошибка подключения", error);
+    bool IsMultiThreaded() const {
+      if (uring) {
+        return (uring_loops > 1);
+      }
+      return (shards.size() > 1 || workers > 1);
+    }
+
+    void RunOne() {
+      if (uring) {
+        uring->RunOne();
         return;
       }
-      inspector->RegisterMessage("Обнаружено подключение! Создание сессии...");
-      Protocol *protocol = server->InitProtocol();
-      if (sess_socket == 0 || protocol == 0) {
+      shards.front()->service.run_one();
+    }
+
+    void RunWorkers() {
+      if (uring) {
+        uring->RunWorkers();
         return;
       }
-      /*
-       * [19 авг. 2016 г.] denis: в сессию передаются 2 указателя,
-       * на сокет (sess_socket) и на реализацию протокола (protocol). Отныне,
-       * именно сессия управляет этими объектами!
-       */
-      Session::Ptr sess(new Session(sess_socket, protocol, inspector));
-      sessions.push_back(sess);
-      sess_socket = 0;
-      WaitForConnection();
-      sess->WaitForRequest();
+      boost::thread_group pool;
+      Shard::List::iterator shard_it = shards.begin();
+      for (; shard_it != shards.end(); shard_it++) {
+        for (USize id = 0; id < workers; id++) {
+          pool.create_thread(boost::bind(&Shard::RunWorker, shard_it->get()));
+        }
+      }
+      pool.join_all();
     }
 
-    Address                  eth_addr;
-    Port                     eth_port;
-    Server                  *server;
-    Inspector::Ptr           inspector;
-    Session::ListOfPtr       sessions;
-    boost::asio::io_service  service;
-    asio::ip::tcp::acceptor  acceptor;
-    Session::Socket         *sess_socket;
+    void Stop() {
+      if (uring) {
+        uring->Stop();
+        return;
+      }
+      Shard::List::iterator shard_it = shards.begin();
+      for (; shard_it != shards.end(); shard_it++) {
+        (*shard_it)->service.stop();
+      }
+    }
+
+    const Endpoints                 endpoints;
+    Server                         *server;
+    Inspector::Ptr                  inspector;
+    const USize                     workers;
+    const Timeouts                  timeouts;
+    const USize                     pool_high_water;
+    const std::string               overload_response;
+    const SocketOptions             socket_options;
+    Limits                          limits; // на один шард
+    boost::scoped_ptr<UringService> uring;
+    USize                           uring_loops;
+    Shard::List                     shards;
+    ListOfSocketFiles               socket_files;
 };
 
-Server::Server(): _res(0) {
+const USize Server::Resources::Session::kLingerTimeout;
+const USize Server::Resources::Shard::kAcceptPauseMs;
+
+Server::Endpoint Server::Endpoint::IPv4(Address addr, Port port) {
+  Endpoint res;
+  res.family  = kIPv4;
+  res.address = asio::ip::address_v4(addr).to_string();
+  res.port    = port;
+  return res;
+}
+
+Server::Endpoint Server::Endpoint::IPv6(const std::string &addr, Port port) {
+  Endpoint res;
+  res.family  = kIPv6;
+  res.address = addr;
+  res.port    = port;
+  return res;
+}
+
+Server::Endpoint Server::Endpoint::Local(const std::string &path) {
+  Endpoint res;
+  res.family  = kLocal;
+  res.address = path;
+  return res;
+}
+
+Server::Server()
+    : _res(0),
+      _workers(kDefWorkersAmount),
+      _shards(kDefShardsAmount),
+      _timeouts(),
+      _pool_high_water(kDefPoolHighWater),
+      _backend(kBackendAsio) {
 }
 
 Server::~Server() {
@@ -234,10 +1302,23 @@ bool Server::BindTo(Address addr, Port port, Inspector::Ptr inspector) {
   if (addr == kUndefinedAddress || port == kUndefinedPort) {
     return false;
   }
+  return BindTo(Endpoints(1, Endpoint::IPv4(addr, port)), inspector);
+}
+
+bool Server::BindTo(const Endpoints &endpoints, Inspector::Ptr inspector) {
+  if (not inspector) {
+    inspector.reset(new Inspector());
+  }
+  Resources::Session::EndPoints resolved;
+  if (not Resources::ResolveEndPoints(endpoints, &resolved, inspector)) {
+    return false;
+  }
   if (_res != 0) {
     Unbind();
   }
-  _res = new Resources(addr, port, this, inspector);
+  _res = new Resources(endpoints, resolved, _shards, _workers, _timeouts,
+                       _pool_high_water, _limits, _backend, _socket_options,
+                       this, inspector);
   return true;
 }
 
@@ -247,9 +1328,70 @@ bool Server::Unbind() {
   return true;
 }
 
+void Server::SetWorkersAmount(USize amount) {
+  _workers = (amount > 0 ? amount : kDefWorkersAmount);
+}
+
+void Server::SetShardsAmount(USize amount) {
+  _shards = (amount > 0 ? amount : kDefShardsAmount);
+}
+
+void Server::SetIdleTimeout(USize seconds) {
+  _timeouts.idle = seconds;
+}
+
+void Server::SetTimeouts(const Timeouts &timeouts) {
+  _timeouts = timeouts;
+}
+
+void Server::SetPoolHighWater(USize amount) {
+  _pool_high_water = amount;
+}
+
+void Server::SetLimits(const Limits &limits) {
+  _limits = limits;
+}
+
+void Server::SetBackend(Backend backend) {
+  _backend = backend;
+}
+
+void Server::SetSocketOptions(const SocketOptions &options) {
+  _socket_options = options;
+}
+
+std::string Server::InitOverloadResponse() {
+  return std::string();
+}
+
+Server::PoolCounters Server::GetPoolCounters() const {
+  PoolCounters res;
+  if (_res == 0) {
+    return res;
+  }
+  Resources::Shard::List::iterator shard_it = _res->shards.begin();
+  for (; shard_it != _res->shards.end(); shard_it++) {
+    (*shard_it)->pool.AddCounters(&res);
+  }
+  return res;
+}
+
 void Server::Run() {
-  _res->service.run_one();
-  _res->CloseBrokenSessions();
+  if (_res == 0) {
+    return;
+  }
+  if (_res->IsMultiThreaded()) {
+    // управление будет возвращено только после Stop
+    _res->RunWorkers();
+    return;
+  }
+  _res->RunOne();
+}
+
+void Server::Stop() {
+  if (_res != 0) {
+    _res->Stop();
+  }
 }
 
 } // namespace webapp
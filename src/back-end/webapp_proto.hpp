@@ -9,6 +9,8 @@
 #define BACK_END_WEBAPP_PROTO_HPP_
 
 #include <stdint.h>
+#include <vector>
+#include <string>
 #include "boost/system/error_code.hpp"
 #include "boost/scoped_ptr.hpp"
 #include "boost/shared_ptr.hpp"
@@ -40,6 +42,21 @@ class Protocol {
     typedef boost::shared_ptr<Protocol> Ptr;
     typedef uint8_t                     Byte;
     typedef boost::scoped_array<Byte>   ArrayOfBytes;
+    /**
+     * Фрагмент ответа, который отправляется без копирования в буфер сессии:
+     * участок памяти, либо (если data == 0) участок открытого файла.
+     */
+    struct Chunk {
+      Chunk(): data(0), size(0), file(-1), offset(0) {}
+      Chunk(const Byte *d, USize s): data(d), size(s), file(-1), offset(0) {}
+      Chunk(int f, USize offs, USize s)
+          : data(0), size(s), file(f), offset(offs) {}
+      const Byte *data;
+      USize       size;
+      int         file;   // дескриптор файла
+      USize       offset; // смещение участка в файле
+    };
+    typedef std::vector<Chunk> Chunks;
 
     Protocol();
     virtual ~Protocol();
@@ -47,33 +64,221 @@ class Protocol {
     virtual bool  HandleRequest(Byte *data, USize size) = 0;
     virtual USize PrepareResponse(Byte *data, USize size) = 0;
     virtual bool  NeedToCloseSession() const = 0;
+    /**
+     * Подготовка очередной части ответа в виде списка фрагментов (заголовок,
+     * части тела), которые сессия отправляет одной операцией записи (writev).
+     * Фрагменты должны оставаться доступными до следующего вызова. Пустой
+     * список - ответ отправлен полностью. Если не поддерживается (по
+     * умолчанию), то возвращается false и используется PrepareResponse.
+     */
+    virtual bool  PrepareResponseChunks(Chunks *out);
+    /**
+     * Заголовок текущего запроса получен целиком, и ожидается его тело.
+     * Определяет, какое ограничение времени применяется к сессии.
+     */
+    virtual bool  IsHeaderReceived() const;
+    /**
+     * Подготовка реализации протокола к обслуживанию нового подключения, для
+     * повторного использования объекта. По умолчанию не поддерживается.
+     */
+    virtual bool  Reset();
 };
 
 class Server {
   public:
     typedef uint16_t Port;
     typedef USize    Address;
+    // Адрес приёма подключений
+    struct Endpoint {
+      enum Family {
+        kIPv4,
+        kIPv6,
+        kLocal // сокет Unix (AF_UNIX), без обращения к стеку TCP
+      };
+      Endpoint(): family(kIPv4), port(0) {}
+      static Endpoint IPv4(Address addr, Port port);
+      // addr в текстовом виде, "::" - все адреса IPv6
+      static Endpoint IPv6(const std::string &addr, Port port);
+      static Endpoint Local(const std::string &path);
+      Family      family;
+      std::string address; // IP адрес в текстовом виде, либо путь к сокету
+      Port        port;    // не используется для kLocal
+    };
+    typedef std::vector<Endpoint> Endpoints;
+    // Механизм ввода/вывода
+    enum Backend {
+      kBackendAsio,   // boost::asio (epoll)
+      kBackendIoUring // io_uring, только Linux
+    };
+    // Счётчики пула повторно используемых сессий
+    struct PoolCounters {
+      PoolCounters(): hits(0), misses(0), dropped(0), idle(0) {}
+      USize hits;    // сессия взята из пула
+      USize misses;  // пул был пуст, создана новая сессия
+      USize dropped; // пул переполнен, закрытая сессия удалена
+      USize idle;    // сессий в пуле в данный момент
+    };
+    // Ограничения времени (в секундах) для стадий обслуживания сессии,
+    // 0 - без ограничений
+    struct Timeouts {
+      Timeouts()
+          : idle(kDefIdleTimeout),
+            header(kDefHeaderTimeout),
+            body(kDefBodyTimeout),
+            write(kDefWriteTimeout) {
+      }
+      USize idle;   // ожидание очередного запроса
+      USize header; // получение заголовка целиком, с момента первого байта
+      USize body;   // пауза при получении тела запроса
+      USize write;  // пауза при отправке ответа
+    };
+    // Настройки сокетов приёмника и принятых подключений
+    struct SocketOptions {
+      SocketOptions()
+          : no_delay(false),
+            cork(false),
+            defer_accept(0),
+            fast_open(0),
+            backlog(0),
+            send_buffer(0),
+            receive_buffer(0) {
+      }
+      bool  no_delay;       // TCP_NODELAY, отключение алгоритма Нейгла
+      bool  cork;           // TCP_CORK на время отправки ответа
+      USize defer_accept;   // TCP_DEFER_ACCEPT, секунд ожидания данных, 0 - нет
+      USize fast_open;      // TCP_FASTOPEN, длина очереди, 0 - нет
+      USize backlog;        // очередь подключений, 0 - SOMAXCONN
+      USize send_buffer;    // SO_SNDBUF, байт, 0 - по умолчанию
+      USize receive_buffer; // SO_RCVBUF, байт, 0 - по умолчанию
+    };
+    // Ограничения приёма подключений, 0 - без ограничений
+    struct Limits {
+      Limits(): sessions(0), buffered_bytes(0), accept_rate(0) {}
+      USize sessions;       // одновременно открытых сессий
+      USize buffered_bytes; // байт в буферах ввода/вывода открытых сессий
+      USize accept_rate;    // новых подключений в секунду
+    };
 
     static const Address kUndefinedAddress;
     static const Address kLoopbackAddress;
     static const Address kAllIPv4Addresses;
     static const Port    kUndefinedPort;
+    static const USize   kDefWorkersAmount;
+    static const USize   kDefShardsAmount;
+    static const USize   kDefIdleTimeout;
+    static const USize   kDefHeaderTimeout;
+    static const USize   kDefBodyTimeout;
+    static const USize   kDefWriteTimeout;
+    static const USize   kDefPoolHighWater;
 
     Server();
     virtual ~Server();
 
     bool BindTo(Address addr, Port port, Inspector::Ptr inspector);
+    /**
+     * Приём подключений сразу по нескольким адресам, которые обслуживаются
+     * общими циклами обработки событий и реализацией протокола. Сокет Unix
+     * открывается первым шардом (или циклом io_uring), остальные используют
+     * его копию. Оставшийся от прошлого запуска файл сокета удаляется перед
+     * открытием, а при Unbind удаляется файл открытого сокета. Сокеты IPv6
+     * принимают только IPv6 (IPV6_V6ONLY), по этому "::" и 0.0.0.0 можно
+     * указать вместе. Возвращает false, если адрес не распознан.
+     */
+    bool BindTo(const Endpoints &endpoints, Inspector::Ptr inspector);
     bool Unbind();
+    /**
+     * Количество потоков, обслуживающих сетевые сессии. Применяется при
+     * следующем вызове BindTo. Если потоков больше одного, то разные сессии
+     * обрабатываются параллельно, и реализация протокола (а также общие для
+     * сессий обработчики запросов) должна быть потокобезопасной.
+     */
+    void SetWorkersAmount(USize amount);
+    /**
+     * Количество шардов, применяется при следующем вызове BindTo. Каждый шард
+     * имеет собственный приёмник подключений (SO_REUSEPORT), цикл обработки
+     * событий и список сессий, обслуживаемые SetWorkersAmount потоками.
+     * При нескольких шардах InitProtocol вызывается из разных потоков.
+     */
+    void SetShardsAmount(USize amount);
+    /**
+     * Время (в секундах), в течении которого сессия может ожидать очередной
+     * запрос, после чего соединение закрывается. 0 - без ограничений.
+     * Применяется при следующем вызове BindTo.
+     */
+    void SetIdleTimeout(USize seconds);
+    /**
+     * Ограничения времени для всех стадий, применяются при следующем вызове
+     * BindTo. Сроки отслеживаются "колесом таймеров" шарда с шагом
+     * 250 мс, по этому фактическое время может быть больше на один шаг.
+     */
+    void SetTimeouts(const Timeouts &timeouts);
+    /**
+     * Максимальное количество закрытых сессий (вместе с сокетом, буфером и
+     * реализацией протокола), которое хранится каждым шардом для повторного
+     * использования. 0 - пул не используется. Применяется при следующем
+     * вызове BindTo.
+     */
+    void         SetPoolHighWater(USize amount);
+    PoolCounters GetPoolCounters() const;
+    /**
+     * Ограничения делятся поровну между шардами и применяются при следующем
+     * вызове BindTo. При превышении числа сессий или объёма буферов новое
+     * подключение получает ответ InitOverloadResponse и закрывается, а если
+     * ответ не задан, то приём подключений приостанавливается (клиенты
+     * ожидают в очереди ядра). При превышении частоты подключений приём
+     * приостанавливается всегда.
+     */
+    void SetLimits(const Limits &limits);
+    /**
+     * Механизм ввода/вывода, применяется при следующем вызове BindTo. Если
+     * io_uring недоступен (ядро старше 5.7, запрет в контейнере, сборка не
+     * под Linux), то используется asio. При io_uring каждый из
+     * SetShardsAmount x SetWorkersAmount потоков имеет собственное кольцо и
+     * приёмник подключений, а из ограничений SetLimits действует только
+     * количество сессий.
+     */
+    void SetBackend(Backend backend);
+    /**
+     * Настройки сокетов, применяются при следующем вызове BindTo. TCP_CORK
+     * включается перед отправкой ответа и выключается после неё, по этому
+     * заголовок и начало тела уходят полными сегментами.
+     */
+    void SetSocketOptions(const SocketOptions &options);
+    /**
+     * Обработка событий. Если потоков (шардов или циклов io_uring) больше
+     * одного, то управление возвращается только после вызова Stop из другого
+     * потока или обработчика запроса, иначе обрабатывается одно событие.
+     * Unbind, повторный BindTo и уничтожение сервера допустимы только после
+     * возврата из Run.
+     */
     void Run();
+    /**
+     * Остановка всех циклов обработки событий, может вызываться из любого
+     * потока. Последующие вызовы Run сразу возвращают управление, пока
+     * сервер не будет заново привязан BindTo.
+     */
+    void Stop();
   protected:
     virtual Protocol* InitProtocol() = 0;
+    /**
+     * Ответ, отправляемый подключению, которое отклонено из-за перегрузки.
+     * Формируется один раз при вызове BindTo. По умолчанию пустой.
+     */
+    virtual std::string InitOverloadResponse();
   private:
     class Resources;
 
     Server(const Server&);
     void operator= (const Server&);
 
-    Resources *_res;
+    Resources    *_res;
+    USize         _workers;
+    USize         _shards;
+    Timeouts      _timeouts;
+    USize         _pool_high_water;
+    Limits        _limits;
+    Backend       _backend;
+    SocketOptions _socket_options;
 }; // class Server
 
 } // namespace webapp
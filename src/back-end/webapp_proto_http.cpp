@@ -6,11 +6,21 @@
  */
 
 #include "webapp_proto_http.hpp"
+#include "webapp_arena.hpp"
+#include "webapp_scan.hpp"
 #include "enum_serializer.hpp"
 
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cctype>
 #include <boost/date_time.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/regex.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 namespace webapp {
 
@@ -62,95 +72,140 @@ static CollectionOfFileTypes file_types([](CollectionOfFileTypes &list) {
   list.Add("svg",   FileType(MimeType::kImage, "svg+xml"));
 });
 
-class Validator {
-  public:
-    typedef bool (*Handler)(Validator&);
-
-    Validator(const std::string &str, Handler handler): _is_valid(false) {
-      if (handler == 0) {
-        return;
-      }
-      _sym_it = str.begin();
-      for (; _sym_it != str.end(); _sym_it++) {
-        if (not handler(*this)) {
-          // DEBUG --------------------
-//          std::cout << "DEBUG: " << __FUNCTION__ << ": " << __LINE__ << ": "
-//                    << "sym: " << (*_sym_it) << " in " << str
-//                    << std::endl;
-          // --------------------------
-          return;
-        }
-      }
-      _is_valid = true;
-    };
-
-    bool Result() const {
-      return _is_valid;
-    }
-
-    bool Sym(unsigned char sym) const {
-      return (*_sym_it) == sym;
-    }
-    // Описание шаблонов:
-    // http://www.ietf.org/rfc/rfc2396.txt -> "A. Collected BNF for URI"
-    bool LowAlpha() const {
-      return (*_sym_it) >= 'a' && (*_sym_it) <= 'z';
-    }
-
-    bool UpAlpha() const {
-      return (*_sym_it) >= 'A' && (*_sym_it) <= 'Z';
-    }
-
-    bool Digit() const {
-      return (*_sym_it) >= '0' && (*_sym_it) <= '9';
-    }
-
-    bool Alpha() const {
-      return LowAlpha() || UpAlpha();
-    }
-
-    bool AlphaNum() const {
-      return Alpha() || Digit();
-    }
-
-    bool Mark() const {
-      const char kSym = *_sym_it;
-      return kSym == '-' || kSym == '_' || kSym == '.'  || kSym == '!' ||
-             kSym == '~' || kSym == '*' || kSym == 0x27 || kSym == '(' ||
-             kSym == ')';
-    }
-
-    bool Reserved() const {
-      const char kSym = *_sym_it;
-      return kSym == ';' || kSym == '/' || kSym == '?' || kSym == ':' ||
-             kSym == '@' || kSym == '&' || kSym == '=' || kSym == '+' ||
-             kSym == '$' || kSym == ',';
-    }
-
-    bool Unreserved() const {
-      return AlphaNum() || Mark();
-    }
-
-    bool Escaped() const {
-      const char kSym = *_sym_it;
-      return (kSym >= 'a' && kSym <= 'f') || kSym == '%' ||
-             (kSym >= 'A' && kSym <= 'F') || Digit();
-    }
-
-    bool PChar() const {
-      const char kSym = *_sym_it;
-      return Unreserved() || Escaped() ||
-             kSym == ':' || kSym == '@' || kSym == '&' || kSym == '=' ||
-             kSym == '+' || kSym == '$' || kSym == ',';
-    }
+// Классы символов URI: http://www.ietf.org/rfc/rfc2396.txt -> "A. Collected BNF for URI"
+enum UriClass {
+  kUriScheme   = 1 << 0, // alphanum | "+" | "-" | "."
+  kUriUserInfo = 1 << 1, // unreserved | escaped | ";" | ":" | "&" | "=" | "+" | "$" | ","
+  kUriHost     = 1 << 2, // alphanum | "." | "-"
+  kUriDigit    = 1 << 3,
+  kUriSegment  = 1 << 4, // pchar | ";"
+  kUriQuery    = 1 << 5, // pchar | "/" | "?"
+  kUriFragment = 1 << 6, // reserved | unreserved | escaped
+  kUriEscape   = 1 << 7, // "%", участок требует декодирования
+  kUriPairText = 1 << 8, // kUriQuery, кроме разделителей пар "&" и "="
+  kUriPlus     = 1 << 9  // "+", в строке запроса кодирует пробел
+};
 
-    bool PathSegments() const {
-      return PChar() || Sym(';') || Sym('/');
+static constexpr bool IsUriDigit(unsigned sym) {
+  return sym >= '0' && sym <= '9';
+}
+
+static constexpr bool IsUriAlphaNum(unsigned sym) {
+  return (sym >= 'a' && sym <= 'z') || (sym >= 'A' && sym <= 'Z') || IsUriDigit(sym);
+}
+
+static constexpr bool IsUriMark(unsigned sym) {
+  return sym == '-' || sym == '_' || sym == '.'  || sym == '!' ||
+         sym == '~' || sym == '*' || sym == 0x27 || sym == '(' ||
+         sym == ')';
+}
+
+static constexpr bool IsUriReserved(unsigned sym) {
+  return sym == ';' || sym == '/' || sym == '?' || sym == ':' ||
+         sym == '@' || sym == '&' || sym == '=' || sym == '+' ||
+         sym == '$' || sym == ',';
+}
+
+static constexpr bool IsUriUnreserved(unsigned sym) {
+  return IsUriAlphaNum(sym) || IsUriMark(sym);
+}
+
+static constexpr bool IsUriEscaped(unsigned sym) {
+  return (sym >= 'a' && sym <= 'f') || sym == '%' ||
+         (sym >= 'A' && sym <= 'F') || IsUriDigit(sym);
+}
+
+static constexpr bool IsUriPChar(unsigned sym) {
+  return IsUriUnreserved(sym) || IsUriEscaped(sym) ||
+         sym == ':' || sym == '@' || sym == '&' || sym == '=' ||
+         sym == '+' || sym == '$' || sym == ',';
+}
+
+static constexpr uint16_t UriClassOf(unsigned sym) {
+  return static_cast<uint16_t>(
+    ((IsUriAlphaNum(sym) || sym == '+' || sym == '-' || sym == '.') ? kUriScheme : 0) |
+    ((IsUriUnreserved(sym) || IsUriEscaped(sym) ||
+      sym == ';' || sym == ':' || sym == '&' || sym == '=' ||
+      sym == '+' || sym == '$' || sym == ',') ? kUriUserInfo : 0) |
+    ((IsUriAlphaNum(sym) || sym == '.' || sym == '-') ? kUriHost : 0) |
+    (IsUriDigit(sym) ? kUriDigit : 0) |
+    ((IsUriPChar(sym) || sym == ';') ? kUriSegment : 0) |
+    ((IsUriPChar(sym) || sym == '/' || sym == '?') ? kUriQuery : 0) |
+    ((IsUriReserved(sym) || IsUriUnreserved(sym) || IsUriEscaped(sym)) ? kUriFragment : 0) |
+    (sym == '%' ? kUriEscape : 0) |
+    (sym == '+' ? kUriPlus : 0) |
+    ((IsUriPChar(sym) || sym == '/' || sym == '?') && sym != '&' && sym != '=' ?
+     kUriPairText : 0));
+}
+// значение шестнадцатеричной цифры, kNotHex - для прочих символов
+static const uint8_t kNotHex = 0x10;
+
+static constexpr uint8_t HexValueOf(unsigned sym) {
+  return static_cast<uint8_t>(
+    IsUriDigit(sym)              ? sym - '0'      :
+    (sym >= 'a' && sym <= 'f')   ? sym - 'a' + 10 :
+    (sym >= 'A' && sym <= 'F')   ? sym - 'A' + 10 : kNotHex);
+}
+// таблицы строятся при компиляции, проверка символа - одно обращение
+#define CHAR_TABLE_4(f, n)  f(n),                  f(n + 1), \
+                            f(n + 2),              f(n + 3)
+#define CHAR_TABLE_16(f, n) CHAR_TABLE_4(f, n),    CHAR_TABLE_4(f, n + 4), \
+                            CHAR_TABLE_4(f, n + 8), CHAR_TABLE_4(f, n + 12)
+#define CHAR_TABLE_64(f, n) CHAR_TABLE_16(f, n),      CHAR_TABLE_16(f, n + 16), \
+                            CHAR_TABLE_16(f, n + 32), CHAR_TABLE_16(f, n + 48)
+#define CHAR_TABLE(f) CHAR_TABLE_64(f, 0),   CHAR_TABLE_64(f, 64), \
+                      CHAR_TABLE_64(f, 128), CHAR_TABLE_64(f, 192)
+static constexpr uint16_t kUriClass[256] = { CHAR_TABLE(UriClassOf) };
+static constexpr uint8_t  kHexValue[256] = { CHAR_TABLE(HexValueOf) };
+#undef CHAR_TABLE
+#undef CHAR_TABLE_64
+#undef CHAR_TABLE_16
+#undef CHAR_TABLE_4
+
+static inline uint16_t GetUriClass(char sym) {
+  return kUriClass[static_cast<uint8_t>(sym)];
+}
+// все символы участка [from, to) принадлежат классу, без ветвлений в цикле
+static bool IsUriRange(boost::string_ref str, size_t from, size_t to, uint16_t cls) {
+  uint16_t res = cls;
+  for (; from < to; from++) {
+    res &= GetUriClass(str[from]);
+  }
+  return (res != 0);
+}
+// позиция первого символа sym, начиная с from, либо npos
+static size_t FindUriSym(boost::string_ref str, size_t from, char sym) {
+  if (from >= str.size()) {
+    return std::string::npos;
+  }
+  const void *kPos = memchr(str.data() + from, sym, str.size() - from);
+  return (kPos == 0 ? std::string::npos : static_cast<const char*>(kPos) - str.data());
+}
+// позиция первого из символов set, начиная с from, либо npos
+static size_t FindUriSym(boost::string_ref str, size_t from, const char *set) {
+  for (; from < str.size(); from++) {
+    if (str[from] != 0 && strchr(set, str[from]) != 0) {
+      return from;
     }
-  private:
-    std::string::const_iterator _sym_it;
-    bool                        _is_valid;
-}; // namespace webapp::validator
+  }
+  return std::string::npos;
+}
+// декодирование выполняется только для участков, содержащих '%' (или '+'
+// при form), сразу из исходной строки в результат
+static void DecodeUriRange(boost::string_ref  str,
+                           size_t             from,
+                           size_t             to,
+                           bool               escaped,
+                           bool               form,
+                           std::string       *out) {
+  if (not escaped) {
+    out->assign(str.data() + from, to - from);
+    return;
+  }
+  out->resize(to - from);
+  out->resize(ProtocolHTTP::DecodeString(str.data() + from, to - from, '%', form,
+                                         &(*out)[0]));
+}
 
 static
 void UpperSymbolsToLower(std::string *in_out) {
@@ -181,6 +236,10 @@ AbsoluteUri::~AbsoluteUri() {
 }
 
 bool AbsoluteUri::ParseVal(const std::string &val) {
+  return ParseScheme(val);
+}
+
+bool AbsoluteUri::ParseScheme(boost::string_ref val) {
 // The URI syntax is dependent upon the scheme.  In general, absolute
 // URI are written as follows:
 //    <scheme>:<scheme-specific-part>
@@ -190,14 +249,11 @@ bool AbsoluteUri::ParseVal(const std::string &val) {
 // полный вариант:
 //   http://node0/node1/node2
 // В случае когда scheme не указана, мы не можем считать URI некорректным!
-  const std::size_t kDelimOff = val.find_first_of(":/");
-  _scheme = val.substr(0, kDelimOff);
+  const std::size_t kDelimOff = FindUriSym(val, 0, ":/");
+  _scheme.assign(val.data(), std::min(kDelimOff, val.size()));
   set_offset(kDelimOff);
   UpperSymbolsToLower(&_scheme);
-  // scheme = alpha | digit | "+" | "-" | "."
-  if (not Validator(_scheme, [](Validator &v) -> bool {
-      return v.AlphaNum() || v.Sym('+') || v.Sym('-') || v.Sym('.');
-    }).Result()) {
+  if (not IsUriRange(_scheme, 0, _scheme.size(), kUriScheme)) {
     _scheme.clear();
     return false;
   }
@@ -214,157 +270,167 @@ ProtocolHTTP::Uri::Uri(): AbsoluteUri() {
 ProtocolHTTP::Uri::~Uri() {
 }
 
-bool ProtocolHTTP::Uri::CheckAuthority(const std::string &val) {
+bool ProtocolHTTP::Uri::CheckAuthority(boost::string_ref val) {
 // The authority component is preceded by a double slash "//" and is
 // terminated by the next slash "/", question-mark "?", or by the end of
 // the URI.
 // Общий вид для HTTP схемы: <scheme>://<userinfo>@<host>:<port>/<path>?<query>
   _authority = Authority();
-  const size_t      kSchemeOff = get_scheme().size() > 0 ? 1 : 0;
-  const std::string kPathPref(val.substr(get_offset() + kSchemeOff, 2));
-  if (kPathPref != "//") {
-    // если указан относительный путь
-    if (kPathPref.at(0) == '/') {
-      return true;
-    }
+  if (get_offset() == std::string::npos) {
     return false;
   }
+  const size_t kPrefOff = get_offset() + (get_scheme().size() > 0 ? 1 : 0);
+  if (val.substr(kPrefOff, 2) != "//") {
+    // если указан относительный путь
+    return (kPrefOff < val.size() && val[kPrefOff] == '/');
+  }
+  size_t       off  = kPrefOff + 2;
+  const size_t kEnd = std::min(FindUriSym(val, off, "/?#"), val.size());
   // ищем признак авторизации пользователя
-  set_offset(get_offset() + 2 + kSchemeOff);
-  const size_t kUInfoEndOff = val.find_first_of('@', get_offset());
-  if (kUInfoEndOff != std::string::npos) {
-    _authority.userinfo = val.substr(get_offset(), kUInfoEndOff - get_offset());
-    // userinfo = unreserved | escaped | ";" | ":" | "&" | "=" | "+" | "$" | ","
-    if (not Validator(_authority.userinfo, [](Validator &v) -> bool {
-        return v.Unreserved() || v.Escaped() ||
-               v.Sym(';') || v.Sym(':') || v.Sym('&') || v.Sym('=') ||
-               v.Sym('+') || v.Sym('$') || v.Sym(',');
-      }).Result()) {
-      return false;
-    }
-    set_offset(kUInfoEndOff + 1);
-  }
-  // ищем адрес/имя хоста и номер его порта
-  const size_t kEndOff  = val.find_first_of("/?", get_offset());
-  if (kEndOff != std::string::npos) {
-    const std::string kHostPort(val.substr(get_offset(), kEndOff - get_offset()));
-    const size_t      kPortOff = kHostPort.find_first_of(':');
-    _authority.host = kHostPort.substr(0, kPortOff);
-    _authority.port = kPortOff != std::string::npos ? kHostPort.substr(kPortOff)
-                                                    : "80";
-    if (not Validator(_authority.port, [](Validator &v) -> bool {
-        return v.Digit();
-      }).Result()) {
+  const size_t kUInfoEndOff = FindUriSym(val, off, '@');
+  if (kUInfoEndOff < kEnd) {
+    if (not IsUriRange(val, off, kUInfoEndOff, kUriUserInfo)) {
       return false;
     }
+    _authority.userinfo.assign(val.data() + off, kUInfoEndOff - off);
+    off = kUInfoEndOff + 1;
+  }
+  // адрес/имя хоста и номер его порта
+  const size_t kPortOff = std::min(FindUriSym(val, off, ':'), kEnd);
+  if (not IsUriRange(val, off, kPortOff, kUriHost) ||
+      not IsUriRange(val, kPortOff + 1, kEnd, kUriDigit)) {
+    return false;
+  }
+  _authority.host.assign(val.data() + off, kPortOff - off);
+  if (kPortOff + 1 < kEnd) {
+    _authority.port.assign(val.data() + kPortOff + 1, kEnd - kPortOff - 1);
   } else {
-    _authority.host = val.substr(get_offset(), kEndOff - get_offset());
+    _authority.port = "80";
   }
-  set_offset(kEndOff);
-  // проверяем адрес/имя хоста
-  return Validator(_authority.host, [](Validator &v) -> bool {
-    return v.AlphaNum() || v.Sym('.') || v.Sym('-');
-  }).Result();
+  set_offset(kEnd < val.size() ? kEnd : std::string::npos);
+  return true;
 }
 
-bool ProtocolHTTP::Uri::CheckPath(const std::string &val) {
+bool ProtocolHTTP::Uri::CheckPath(boost::string_ref val) {
 // The path may consist of a sequence of path segments separated by a
 // single slash "/" character.  Within a path segment, the characters
 // "/", ";", "=", and "?" are reserved.
   _path.clear();
-  _path.reserve(10);
   if (get_offset() == std::string::npos || val.at(get_offset()) != '/') {
     return true;
   }
-  size_t off = get_offset();
-// Ищем разделитель '#', на нём заканчивается URI и начинается Fragment:
+// Путь заканчивается на '?' (начало Query) или на '#' (начало Fragment):
 // URI-reference = [ absoluteURI | relativeURI ] [ "#" fragment ]
-  const size_t kQuestionMark = val.find_first_of('?', off + 1);
-  const size_t kCrosshatch   = val.find_first_of('#', off + 1);
-  // чтение пути и разбиение его на сегменты
-  std::string decoded_str;
-  std::string encoded_str;
-  while (off != kCrosshatch && off != kQuestionMark) {
-    off = val.find_first_of("/", off + 1);
-    if (kQuestionMark != std::string::npos && off > kQuestionMark) {
-      off = kQuestionMark;
-    }
-    if (kCrosshatch != std::string::npos && off > kCrosshatch) {
-      off = kCrosshatch;
-    }
-    encoded_str = val.substr(get_offset() + 1, off - get_offset() - 1);
-    if (encoded_str.size() == 0) {
-      set_offset(off);
+// Первый проход проверяет символы и считает сегменты, по этому вектор
+// выделяется один раз, а второй создаёт сегменты сразу из исходной строки.
+  size_t end     = get_offset() + 1;
+  size_t amount  = 0;
+  bool   segment = false; // текущий сегмент не пуст
+  for (; end < val.size(); end++) {
+    const char kSym = val[end];
+    if (kSym == '/') {
+      segment = false;
       continue;
     }
-    if (not Validator(encoded_str, [](Validator &v) -> bool {
-        return v.PathSegments();
-      }).Result()) {
+    if (kSym == '?' || kSym == '#') {
+      break;
+    }
+    if ((GetUriClass(kSym) & kUriSegment) == 0) {
       return false;
     }
-    ProtocolHTTP::DecodeString(encoded_str, '%', &decoded_str);
-    _path.push_back(decoded_str);
-    set_offset(off);
+    amount += (segment ? 0 : 1);
+    segment = true;
+  }
+  _path.reserve(amount);
+  size_t   from    = get_offset() + 1;
+  uint16_t classes = 0;
+  for (size_t off = from; off <= end; off++) {
+    if (off < end && val[off] != '/') {
+      classes |= GetUriClass(val[off]);
+      continue;
+    }
+    if (off > from) {
+      _path.emplace_back();
+      DecodeUriRange(val, from, off, (classes & kUriEscape) != 0, false,
+                     &_path.back());
+    }
+    from    = off + 1;
+    classes = 0;
   }
+  set_offset(end < val.size() ? end : std::string::npos);
   return true;
 }
 
-bool ProtocolHTTP::Uri::CheckQuery(const std::string &val) {
+bool ProtocolHTTP::Uri::CheckQuery(boost::string_ref val, Arena *arena) {
 // The query component is indicated by the first question
 // mark ("?") character and terminated by a number sign ("#") character
 // or by the end of the URI.
-  _query.clear();
   if (get_offset() == std::string::npos || val.at(get_offset()) != '?') {
+    _query.Reset(val.data(), 0, arena);
     return true;
   }
-  size_t off = get_offset();
-  const size_t kCrosshatchOff = val.find_first_of('#', off + 1);
-  std::string encoded_str;
-  std::string decoded_key;
-  std::string decoded_val;
-  while (off != kCrosshatchOff) {
-    off = val.find_first_of("&", off + 1);
-    if (kCrosshatchOff != std::string::npos && off > kCrosshatchOff) {
-      off = kCrosshatchOff;
-    }
-    encoded_str = val.substr(get_offset() + 1, off - get_offset() - 1);
-    if (not Validator(encoded_str, [](Validator &v) -> bool {
-        return v.PChar() || v.Sym('/') || v.Sym('?');
-      }).Result()) {
+  const size_t kFrom = get_offset() + 1;
+  const size_t kTo   = std::min(FindUriSym(val, kFrom, '#'), val.size());
+  _query.Reset(val.data() + kFrom, kTo - kFrom, arena);
+  // пары разделяются и проверяются за один проход, а декодируются только
+  // при обращении к ним
+  const boost::string_ref kRaw(_query._data, _query._length);
+  size_t                  from    = 0;
+  size_t                  equal   = std::string::npos;
+  uint16_t                classes = 0;
+  for (size_t off = 0;; off++) {
+    const bool     kEnd   = (off == kRaw.size());
+    const uint16_t kClass = (kEnd ? 0 : GetUriClass(kRaw[off]));
+    if ((kClass & kUriPairText) != 0) {
+      classes |= kClass;
+      continue;
+    }
+    if (not kEnd && kRaw[off] == '=') {
+      equal = std::min(equal, off);
+      continue;
+    }
+    // разделитель пар, конец запроса, либо недопустимый символ
+    if (not kEnd && kRaw[off] != '&') {
       return false;
     }
-    const size_t kEqualSignOff = encoded_str.find_first_of('=');
-    ProtocolHTTP::DecodeString(encoded_str.substr(0, kEqualSignOff), '%',
-                                                  &decoded_key);
-    ProtocolHTTP::DecodeString(encoded_str.substr(kEqualSignOff + 1), '%',
-                                                  &decoded_val);
-    _query.insert(QueryParam(decoded_key, decoded_val));
-    set_offset(off);
+    if (off > from) {
+      _query.Add(from, std::min(equal, off), off,
+                 (classes & (kUriEscape | kUriPlus)) != 0);
+    }
+    if (kEnd) {
+      break;
+    }
+    from    = off + 1;
+    equal   = std::string::npos;
+    classes = 0;
   }
+  set_offset(kTo < val.size() ? kTo : std::string::npos);
   return true;
 }
 
-bool ProtocolHTTP::Uri::CheckFragment(const std::string &val) {
-  _fragment = "";
+bool ProtocolHTTP::Uri::CheckFragment(boost::string_ref val) {
+  _fragment.clear();
   if (get_offset() == std::string::npos || val.at(get_offset()) != '#') {
     return true;
   }
-  const std::string kEncodedStr = val.substr(get_offset() + 1);
-  // fragment = reserved | unreserved | escaped
-  if (not Validator(kEncodedStr, [](Validator &v) -> bool {
-      return v.Reserved() || v.Unreserved() || v.Escaped();
-    }).Result()) {
+  const size_t kFrom = get_offset() + 1;
+  if (not IsUriRange(val, kFrom, val.size(), kUriFragment)) {
     return false;
   }
-  DecodeString(kEncodedStr, '%', &_fragment);
+  DecodeUriRange(val, kFrom, val.size(),
+                 FindUriSym(val, kFrom, '%') != std::string::npos, false, &_fragment);
   return true;
 }
 
 bool ProtocolHTTP::Uri::ParseVal(const std::string &val) {
-  return AbsoluteUri::ParseVal(val) &&
+  return Parse(val, 0);
+}
+
+bool ProtocolHTTP::Uri::Parse(boost::string_ref val, Arena *arena) {
+  return ParseScheme(val) &&
          CheckAuthority(val) &&
          CheckPath(val) &&
-         CheckQuery(val) &&
+         CheckQuery(val, arena) &&
          CheckFragment(val);
 }
 
@@ -383,6 +449,229 @@ const ProtocolHTTP::Uri::Query& ProtocolHTTP::Uri::get_query() const {
 const std::string& ProtocolHTTP::Uri::get_fragment() const {
   return _fragment;
 }
+// ProtocolHTTP::Uri::Query ----------------------------------------------------
+// целое со знаком без пробелов и прочих символов, как std::from_chars
+static bool ParseQueryInteger(const char *data, size_t size, int64_t *out) {
+  const bool   kNegative = (size > 0 && data[0] == '-');
+  const size_t kFrom     = (size > 0 && (data[0] == '-' || data[0] == '+') ? 1 : 0);
+  if (size == kFrom) {
+    return false;
+  }
+  // модуль минимального значения на единицу больше максимального
+  const uint64_t kLimit = static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) +
+                          (kNegative ? 1 : 0);
+  uint64_t res = 0;
+  for (size_t off = kFrom; off < size; off++) {
+    if (data[off] < '0' || data[off] > '9') {
+      return false;
+    }
+    const unsigned kDigit = data[off] - '0';
+    if (res > (kLimit - kDigit) / 10) {
+      return false;
+    }
+    res = res * 10 + kDigit;
+  }
+  *out = (kNegative ? static_cast<int64_t>(0 - res) : static_cast<int64_t>(res));
+  return true;
+}
+
+ProtocolHTTP::Uri::Query::Query(): _data(""), _length(0), _size(0) {
+}
+
+ProtocolHTTP::Uri::Query::Query(const Query &src)
+    : _own(src._data, src._length),
+      _size(src._size),
+      _more(src._more) {
+  _data   = _own.data();
+  _length = _own.size();
+  std::copy(src._inline, src._inline + kInlineParams, _inline);
+}
+
+ProtocolHTTP::Uri::Query& ProtocolHTTP::Uri::Query::operator= (const Query &src) {
+  if (this != &src) {
+    _own.assign(src._data, src._length);
+    _data   = _own.data();
+    _length = _own.size();
+    _size   = src._size;
+    _more   = src._more;
+    std::copy(src._inline, src._inline + kInlineParams, _inline);
+  }
+  return *this;
+}
+
+void ProtocolHTTP::Uri::Query::Reset(const char *data, size_t size, Arena *arena) {
+  if (arena != 0 && size > 0) {
+    char *copy = static_cast<char*>(arena->Allocate(size, 1));
+    memcpy(copy, data, size);
+    _data = copy;
+    _own.clear();
+  } else {
+    _own.assign(data, size);
+    _data = _own.data();
+  }
+  _length = size;
+  _size   = 0;
+  _more.clear();
+}
+
+void ProtocolHTTP::Uri::Query::Add(size_t from, size_t equal, size_t to, bool escaped) {
+  const Param kParam = {static_cast<uint32_t>(from),
+                        static_cast<uint32_t>(equal),
+                        static_cast<uint32_t>(to),
+                        escaped};
+  if (_size < kInlineParams) {
+    _inline[_size] = kParam;
+  } else {
+    _more.push_back(kParam);
+  }
+  _size++;
+}
+
+const ProtocolHTTP::Uri::Query::Param& ProtocolHTTP::Uri::Query::At(size_t id) const {
+  return (id < kInlineParams ? _inline[id] : _more[id - kInlineParams]);
+}
+
+void ProtocolHTTP::Uri::Query::Decode(size_t       from,
+                                      size_t       to,
+                                      bool         escaped,
+                                      std::string *out) const {
+  DecodeUriRange(boost::string_ref(_data, _length), from, to, escaped, true, out);
+}
+
+bool ProtocolHTTP::Uri::Query::FindParam(const std::string &key, size_t *id) const {
+  std::string decoded;
+  for (; *id < _size; (*id)++) {
+    const Param &kParam = At(*id);
+    const size_t kSize  = kParam.equal - kParam.from;
+    if (not kParam.escaped) {
+      if (kSize == key.size() && key.compare(0, kSize, _data + kParam.from, kSize) == 0) {
+        return true;
+      }
+      continue;
+    }
+    // декодированный ключ не длиннее исходного
+    if (kSize < key.size()) {
+      continue;
+    }
+    Decode(kParam.from, kParam.equal, true, &decoded);
+    if (decoded == key) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ProtocolHTTP::Uri::Query::FindValue(const std::string &key,
+                                         const char       **data,
+                                         size_t            *size,
+                                         std::string       *buff) const {
+  size_t id = 0;
+  if (not FindParam(key, &id)) {
+    return false;
+  }
+  const Param &kParam = At(id);
+  const size_t kFrom  = std::min<size_t>(kParam.equal + 1, kParam.to);
+  if (kParam.escaped) {
+    Decode(kFrom, kParam.to, true, buff);
+    *data = buff->data();
+    *size = buff->size();
+  } else {
+    *data = _data + kFrom;
+    *size = kParam.to - kFrom;
+  }
+  return true;
+}
+
+size_t ProtocolHTTP::Uri::Query::size() const {
+  return _size;
+}
+
+void ProtocolHTTP::Uri::Query::GetParam(size_t       id,
+                                        std::string *key,
+                                        std::string *value) const {
+  const Param &kParam = At(id);
+  if (key != 0) {
+    Decode(kParam.from, kParam.equal, kParam.escaped, key);
+  }
+  if (value != 0) {
+    Decode(std::min<size_t>(kParam.equal + 1, kParam.to), kParam.to,
+           kParam.escaped, value);
+  }
+}
+
+bool ProtocolHTTP::Uri::Query::Find(const std::string &key, std::string *value) const {
+  size_t id = 0;
+  if (not FindParam(key, &id)) {
+    return false;
+  }
+  GetParam(id, 0, value);
+  return true;
+}
+
+size_t ProtocolHTTP::Uri::Query::FindAll(const std::string &key,
+                                         ListOfString      *values) const {
+  size_t amount = 0;
+  for (size_t id = 0; FindParam(key, &id); id++, amount++) {
+    if (values != 0) {
+      values->push_back(std::string());
+      GetParam(id, 0, &values->back());
+    }
+  }
+  return amount;
+}
+
+std::string ProtocolHTTP::Uri::Query::Get(const std::string &key) const {
+  std::string value;
+  Find(key, &value);
+  return value;
+}
+
+bool ProtocolHTTP::Uri::Query::Get(const std::string &key, int64_t *value) const {
+  std::string buff;
+  const char *data;
+  size_t      size;
+  return FindValue(key, &data, &size, &buff) &&
+         ParseQueryInteger(data, size, value);
+}
+
+bool ProtocolHTTP::Uri::Query::Get(const std::string &key, double *value) const {
+  std::string buff;
+  const char *data;
+  size_t      size;
+  if (not FindValue(key, &data, &size, &buff) || size == 0 ||
+      std::isspace(static_cast<uint8_t>(data[0]))) {
+    return false;
+  }
+  // strtod требует завершающего нуля
+  if (data != buff.data()) {
+    buff.assign(data, size);
+  }
+  char *end = 0;
+  const double kRes = strtod(buff.c_str(), &end);
+  if (end != buff.c_str() + buff.size()) {
+    return false;
+  }
+  *value = kRes;
+  return true;
+}
+
+bool ProtocolHTTP::Uri::Query::Get(const std::string &key, bool *value) const {
+  std::string buff;
+  const char *data;
+  size_t      size;
+  if (not FindValue(key, &data, &size, &buff)) {
+    return false;
+  }
+  const boost::string_ref kVal(data, size);
+  if (kVal == "true" || kVal == "1") {
+    *value = true;
+  } else if (kVal == "false" || kVal == "0") {
+    *value = false;
+  } else {
+    return false;
+  }
+  return true;
+}
 // ProtocolHTTP::Expires -------------------------------------------------------
 ProtocolHTTP::Expires::Expires() {
   Now();
@@ -505,6 +794,18 @@ Protocol::Protocol() {
 
 Protocol::~Protocol() {
 }
+
+bool Protocol::Reset() {
+  return false;
+}
+
+bool Protocol::PrepareResponseChunks(Chunks*) {
+  return false;
+}
+
+bool Protocol::IsHeaderReceived() const {
+  return false;
+}
 // ProtocolHTTP::Request::Field ------------------------------------------------
 struct ProtocolHTTP::Request::Field::Data {
   Content::Type type;
@@ -566,8 +867,7 @@ bool ProtocolHTTP::Request::Field::get_value(int64_t *out) const {
 
 static
 bool ParseBoolValue(const std::string &val) {
-  using namespace boost;
-  return regex_match(val.begin(), val.end(), regex("true")) ? true : false;
+  return (val == "true");
 }
 
 template <>
@@ -584,6 +884,10 @@ const ProtocolHTTP::Content::Type& ProtocolHTTP::Request::Field::get_type() cons
   return _data->type;
 }
 
+void ProtocolHTTP::Request::Field::set_type(const Content::Type &type) {
+  _data->type = type;
+}
+
 bool ProtocolHTTP::Request::Field::IsNull() const {
   return not _data->value;
 }
@@ -760,35 +1064,129 @@ bool ProtocolHTTP::Request::Field::StorageInMem::operator()(
 }
 // ProtocolHTTP::Request -------------------------------------------------------
 struct ProtocolHTTP::Request::State {
-  State(): complete_body(false),
-           boundary_was_found(false),
-           body_size(0),
-           body_last_match(0),
-           storage_generator(0) {
-  }
+  typedef ArenaMap<std::string, Field>::Type MapOfFields;
+  // поле заголовка в исходном виде: участки fields_data
+  struct RawField {
+    USize name_off;
+    USize name_size;
+    USize value_off;
+    USize value_size;
+  };
+  typedef ArenaVector<RawField>::Type ArrayOfRawFields;
+  // поля, которые разбираются при первом обращении
+  enum LazyField {
+    kLazyAccept      = 1 << 0,
+    kLazyLocation    = 1 << 1,
+    kLazyCookies     = 1 << 2,
+    kLazyIfNoneMatch = 1 << 3,
+    kLazyRanges      = 1 << 4
+  };
+  // способ разбора тела, выбирается по Content-Type
+  enum BodyKind {
+    kBodyRaw,      // данные целиком в хранилище body
+    kBodyForm,     // application/x-www-form-urlencoded, поля в fields_post
+    kBodyMultipart // multipart/*, поля в fields_post
+  };
+  // разбор составного тела: https://tools.ietf.org/html/rfc2046#section-5.1.1
+  enum PartStage {
+    kPartPreamble,  // данные до первого разделителя
+    kPartDelimiter, // окончание строки разделителя
+    kPartHeader,    // поля заголовка части
+    kPartData,      // данные части до следующего разделителя
+    kPartEpilogue   // данные после последнего разделителя
+  };
+  // этап разбора, на котором остановилась предыдущая порция данных
+  enum Stage {
+    kStartLine,   // строка запроса: https://tools.ietf.org/html/rfc7230#section-3.1.1
+    kHeaderLines, // поля заголовка
+    kBody,        // тело длиной Content-Length
+    kChunkSize,   // строка размера части: https://tools.ietf.org/html/rfc7230#section-4.1
+    kChunkData,   // данные части
+    kChunkEnd,    // CRLF после данных части
+    kTrailer,     // поля после последней части
+    kComplete,
+    kError
+  };
 
+  State(Arena *arena)
+      : stage(kStartLine),
+        error(k200),
+        has_length(false),
+        length(0),
+        body_left(0),
+        header_size(0),
+        complete_body(false),
+        body_size(0),
+        header_last_line(ArenaAllocator<char>(arena)),
+        part_stage(kPartPreamble),
+        part_delim(ArenaAllocator<char>(arena)),
+        part_matched(0),
+        part_line(ArenaAllocator<char>(arena)),
+        body_kind(kBodyRaw),
+        in_memory(0),
+        form_value(false),
+        form_field(0),
+        form_key(ArenaAllocator<char>(arena)),
+        form_buff(ArenaAllocator<char>(arena)),
+        fields_get(std::less<std::string>(), MapOfFields::allocator_type(arena)),
+        fields_post(std::less<std::string>(), MapOfFields::allocator_type(arena)),
+        fields_data(ArenaAllocator<char>(arena)),
+        fields(ArrayOfRawFields::allocator_type(arena)),
+        lazy_parsed(0),
+        storage_generator(0) {
+  }
+  // арена запроса, из которой выделена память состояния
+  Arena* GetArena() const {
+    return fields_data.get_allocator().get_arena();
+  }
+
+  Stage                     stage;
+  Code                      error;
+  bool                      has_length;  // получено поле Content-Length
+  uint64_t                  length;      // значение Content-Length
+  uint64_t                  body_left;   // осталось байт тела или части
+  USize                     header_size; // получено байт заголовка
   bool                      complete_body;
-  bool                      boundary_was_found;
   USize                     body_size;
-  std::string               header_last_line;
-  uint8_t                   body_last_match;
-  Field::Map                fields_get;
-  Field::Map                fields_post;
+  ArenaString               header_last_line;
+  PartStage                 part_stage;
+  ArenaString               part_delim;     // CRLF "--" boundary
+  uint8_t                   part_skip[256]; // сдвиги поиска part_delim
+  USize                     part_matched;   // окончание прошлой порции, совпавшее с началом part_delim
+  ArenaString               part_line;      // начало строки заголовка части
+  Content                   part;           // Content-Type и Content-Disposition части
+  BodyKind                  body_kind;
+  USize                     in_memory;      // байт тела в памяти, см. RequestLimits::memory
+  bool                      form_value;     // разбирается значение пары, а не ключ
+  Field                    *form_field;     // поле значения пары, 0 - повтор ключа
+  ArenaString               form_key;       // ключ текущей пары формы
+  ArenaString               form_buff;      // значение для декодирования, с началом %XX из прошлой порции
+  boost::shared_ptr<Field>  body;           // тело kBodyRaw
+  MapOfFields               fields_get;
+  MapOfFields               fields_post;
+  ArenaString               fields_data; // имена (в нижнем регистре) и значения подряд
+  ArrayOfRawFields          fields;
+  unsigned                  lazy_parsed; // LazyField
+  Accept                    accept;
+  Uri                       content_location;
+  Cookies                   cookies;
+  ListOfString              if_none_match;
+  ByteRanges                ranges;
   Field::Storage::Generator storage_generator;
   Header                    header;
-  Header                    post_header;
 };
 
-ProtocolHTTP::Request::Request() {
-  _state = new State();
+ProtocolHTTP::Request::Request(): _arena(new Arena()) {
+  InitState();
 }
 
 ProtocolHTTP::Request::~Request() {
-  delete _state;
+  _state->~State();
+  delete _arena;
 }
 
-ProtocolHTTP::Request::Request(const Request &src) {
-  _state = new State();
+ProtocolHTTP::Request::Request(const Request &src): _arena(new Arena()) {
+  InitState();
   *_state = *src._state;
 }
 
@@ -809,83 +1207,93 @@ bool ProtocolHTTP::Request::Completed() const {
   return _state->header.complete && _state->complete_body;
 }
 
-const std::string& ProtocolHTTP::Request::Get(const std::string &name) const {
-  const Uri::Query &kQuery = _state->header.line.target.get_query();
-  Uri::Query::const_iterator q_it = kQuery.find(name);
-  if (q_it == kQuery.end()) {
-    static const std::string kEmptyStr;
-    return kEmptyStr;
-  }
-  return q_it->second;
+ProtocolHTTP::Code ProtocolHTTP::Request::GetError() const {
+  return _state->error;
+}
+
+std::string ProtocolHTTP::Request::Get(const std::string &name) const {
+  return _state->header.line.target.get_query().Get(name);
 }
 
 template <>
 std::string ProtocolHTTP::Request::Get(const std::string &name,
                                        const std::string &def_val) const {
-  const std::string &kVal = Get(name);
-  if (kVal.size() == 0) {
+  std::string val;
+  if (not _state->header.line.target.get_query().Find(name, &val) ||
+      val.size() == 0) {
     return def_val;
   }
-  return kVal;
+  return val;
 }
 
 template <>
 int ProtocolHTTP::Request::Get(const std::string &name,
                                const int         &def_val) const {
-  const std::string &kVal = Get(name);
-  if (kVal.size() == 0) {
+  int64_t val = def_val;
+  _state->header.line.target.get_query().Get(name, &val);
+  // значение за пределами int не усекается, а считается ошибочным
+  if (val < std::numeric_limits<int>::min() || val > std::numeric_limits<int>::max()) {
     return def_val;
   }
-  return atol(kVal.c_str());
+  return static_cast<int>(val);
 }
 
 template <>
 int64_t ProtocolHTTP::Request::Get(const std::string &name,
                                    const int64_t     &def_val) const {
-  const std::string &kVal = Get(name);
-  if (kVal.size() == 0) {
-    return def_val;
-  }
-  return atoll(kVal.c_str());
+  int64_t val = def_val;
+  _state->header.line.target.get_query().Get(name, &val);
+  return val;
 }
 
 template <>
 double ProtocolHTTP::Request::Get(const std::string &name,
                                   const double      &def_val) const {
-  const std::string &kVal = Get(name);
-  if (kVal.size() == 0) {
-    return def_val;
-  }
-  return atof(kVal.c_str());
+  double val = def_val;
+  _state->header.line.target.get_query().Get(name, &val);
+  return val;
 }
 
 template <>
 bool ProtocolHTTP::Request::Get(const std::string &name,
                                 const bool        &def_val) const {
-  const std::string &kVal = Get(name);
-  if (kVal.size() == 0) {
-    return def_val;
-  }
-  return ParseBoolValue(kVal);
+  bool val = def_val;
+  _state->header.line.target.get_query().Get(name, &val);
+  return val;
+}
+
+const ProtocolHTTP::Request::Field* ProtocolHTTP::Request::GetBody() const {
+  return _state->body.get();
 }
 
 const ProtocolHTTP::Request::Field* ProtocolHTTP::Request::Post(
     const std::string &name) const {
-  Field::Map::const_iterator f_it = _state->fields_post.find(name);
+  State::MapOfFields::const_iterator f_it = _state->fields_post.find(name);
   if (f_it == _state->fields_post.end()) {
     return 0;
   }
   return &f_it->second;
 }
 
+void ProtocolHTTP::Request::InitState() {
+  _state = new (_arena->Allocate(sizeof(State), alignof(State))) State(_arena);
+}
+
 void ProtocolHTTP::Request::ResetState() {
-  delete _state;
-  _state = new State();
+  _state->~State();
+  _arena->Reset();
+  InitState();
 }
 
-static HttpMethod GetMethodFromStr(const std::string &name) {
-  HttpMethod res;
-  return http_methods.Find(name, &res) ? res : ProtocolHTTP::kUnknown;
+// методов немного, по этому перебор без создания строки из участка
+static HttpMethod GetMethodFromSpan(boost::string_ref name) {
+  CollectionOfHttpMethods::Map::const_iterator it = http_methods.map.begin();
+  for (; it != http_methods.map.end(); it++) {
+    if (name == it->first) {
+      return it->second;
+    }
+  }
+  return ProtocolHTTP::kUnknown;
 }
 
 static MimeType GetContentTypeFromStr(const std::string &name) {
@@ -893,89 +1301,159 @@ static MimeType GetContentTypeFromStr(const std::string &name) {
   return mime_types.Find(name, &res) ? res : MimeType::kApplication;
 }
 
-static bool TruncateString(const std::string &in, std::string *out) {
-  if (out == 0) {
+/**
+ * Участок строки заголовка, без копирования: ссылается на буфер приёма, либо
+ * на сохранённое начало строки, разорванной между пакетами. Строки
+ * создаются только для значений, которые сохраняются в Header.
+ */
+typedef boost::string_ref Span;
+
+static Span TrimSpan(Span in) {
+  static const Span kSpaceAndQuote(" \"");
+  const size_t kFrom = in.find_first_not_of(kSpaceAndQuote);
+  if (kFrom == Span::npos) {
+    return Span();
+  }
+  const size_t kTo = in.find_last_not_of(kSpaceAndQuote);
+  return in.substr(kFrom, kTo + 1 - kFrom);
+}
+// без пробелов и табуляций по краям (OWS), кавычки сохраняются
+static Span TrimSpaces(Span in) {
+  while (in.size() > 0 && (in[0] == ' ' || in[0] == '\t')) {
+    in.remove_prefix(1);
+  }
+  while (in.size() > 0 && (in[in.size() - 1] == ' ' || in[in.size() - 1] == '\t')) {
+    in.remove_suffix(1);
+  }
+  return in;
+}
+// часть участка до разделителя (либо весь участок), участок сдвигается
+// за разделитель; false - разделителя больше нет
+static bool NextToken(Span *in, char div, Span *out) {
+  const size_t kOff = in->find(div);
+  *out = in->substr(0, kOff);
+  in->remove_prefix(kOff == Span::npos ? in->size() : kOff + 1);
+  return (kOff != Span::npos);
+}
+
+// false - участок пуст, содержит не только цифры, либо слишком длинный
+static bool SpanToLength(Span in, uint64_t *out) {
+  static const size_t kMaxDigits = 18;
+  if (in.size() == 0 || in.size() > kMaxDigits) {
     return false;
   }
-  const size_t kFrom   = in.find_first_not_of(" \"");
-  const size_t kAmount = in.find_last_not_of(" \"") + 1 - kFrom;
-  // +1 необходим для учёта символа на котором остановился поиск, см. документацию:
-  // ... The position of the first character that does not match. ...
-  out->assign(in.substr(kFrom, kAmount));
+  uint64_t res = 0;
+  for (size_t off = 0; off < in.size(); off++) {
+    if (in[off] < '0' || in[off] > '9') {
+      return false;
+    }
+    res = res * 10 + (in[off] - '0');
+  }
+  *out = res;
+  return true;
+}
+// https://tools.ietf.org/html/rfc7230#section-4.1, расширения части
+// (chunk-ext) не используются
+static bool ParseChunkSize(Span line, uint64_t *out) {
+  static const size_t kMaxDigits = 15;
+  Span size;
+  NextToken(&line, ';', &size);
+  size = TrimSpaces(size);
+  if (size.size() == 0 || size.size() > kMaxDigits) {
+    return false;
+  }
+  uint64_t res = 0;
+  for (size_t off = 0; off < size.size(); off++) {
+    const char kSym = size[off];
+    unsigned digit = 0;
+    if (kSym >= '0' && kSym <= '9') {
+      digit = kSym - '0';
+    } else if (kSym >= 'a' && kSym <= 'f') {
+      digit = kSym - 'a' + 10;
+    } else if (kSym >= 'A' && kSym <= 'F') {
+      digit = kSym - 'A' + 10;
+    } else {
+      return false;
+    }
+    res = (res << 4) | digit;
+  }
+  *out = res;
   return true;
 }
 
-static std::string TruncateString(const std::string &in) {
-  std::string res;
-  TruncateString(in, &res);
+static std::string SpanToLower(Span in) {
+  std::string res(in.data(), in.size());
+  UpperSymbolsToLower(&res);
   return res;
 }
 
-static bool SplitStringToList(const std::string          &str,
-                              const std::string          &div,
+static bool SplitStringToList(Span                        str,
+                              char                        div,
                               ProtocolHTTP::ListOfString *out) {
   if (out == 0) {
     return false;
   }
   out->clear();
-  size_t off = 0;
-  std::string truncated_str;
-  while (off != std::string::npos) {
-    const size_t kPrevOff = (off == 0 ? 0 : off + 1);
-    off = str.find_first_of(div, off + 1);
-    TruncateString(str.substr(kPrevOff, off - kPrevOff), &truncated_str);
-    out->push_back(truncated_str);
+  Span item;
+  bool has_next = true;
+  while (has_next) {
+    has_next = NextToken(&str, div, &item);
+    item     = TrimSpan(item);
+    out->push_back(std::string(item.data(), item.size()));
   }
   return true;
 }
 
-typedef void (*ParameterHandler)(const std::string &name,
-                                 const std::string &value,
-                                 void              *out);
-
-static void DetectParametersForHeaderField(const std::string &field,
-                                           size_t             off,
-                                           void              *out,
-                                           ParameterHandler   handler) {
+typedef void (*ParameterHandler)(const Span &name,
+                                 const Span &value,
+                                 void       *out);
+/**
+ * @param params  часть поля после первого символа ';'
+ */
+static void DetectParametersForHeaderField(Span              params,
+                                           void             *out,
+                                           ParameterHandler  handler) {
   if (out == 0 || handler == 0) {
     return;
   }
-  while (off != std::string::npos) {
-    const size_t kPrevOff = off + 1;
-    off = field.find_first_of(';', kPrevOff);
-    const std::string kParam     = field.substr(kPrevOff, off - kPrevOff);
-    const size_t      kEqualSign = kParam.find_first_of('=');
-    const std::string kParamName = TruncateString(kParam.substr(0, kEqualSign));
-    const std::string kParamVal  = TruncateString(kParam.substr(kEqualSign + 1));
-    handler(kParamName, kParamVal, out);
+  Span param;
+  while (params.size() > 0) {
+    NextToken(&params, ';', &param);
+    Span name;
+    if (NextToken(&param, '=', &name)) {
+      handler(TrimSpan(name), TrimSpan(param), out);
+    } else {
+      handler(TrimSpan(name), Span(), out);
+    }
   }
 }
 
-static bool DetectContentType(const std::string           &in,
-                              ProtocolHTTP::Content::Type *out) {
+static bool DetectContentType(Span in, ProtocolHTTP::Content::Type *out) {
   typedef ProtocolHTTP::Content::Type Type;
   if (out == 0) {
     return false;
   }
-  const size_t kTypeSubNameOff = in.find_first_of('/');
-  const size_t kSemicolonOff   = in.find_first_of(';', kTypeSubNameOff);
-  std::string type_name = in.substr(0, kTypeSubNameOff);
-  out->sub_type         = in.substr(kTypeSubNameOff + 1,
-                                    kSemicolonOff - kTypeSubNameOff - 1);
-  UpperSymbolsToLower(&type_name);
-  UpperSymbolsToLower(&out->sub_type);
-  out->name = GetContentTypeFromStr(type_name);
-  DetectParametersForHeaderField(in, kSemicolonOff, out, [](
-      const std::string &name,
-      const std::string &value,
-      void              *out) {
+  Span type_name;
+  Span sub_type;
+  Span params;
+  NextToken(&in, '/', &type_name);
+  const bool kHasParams = NextToken(&in, ';', &sub_type);
+  out->sub_type = SpanToLower(sub_type);
+  out->name     = GetContentTypeFromStr(SpanToLower(type_name));
+  if (not kHasParams) {
+    return true;
+  }
+  DetectParametersForHeaderField(in, out, [](
+      const Span &name,
+      const Span &value,
+      void       *out) {
     Type *type = static_cast<Type*>(out);
     if (name == "boundary") {
-      type->boundary = value;
+      type->boundary.assign(value.data(), value.size());
       return;
     }
     if (name == "charset") {
-      type->charset = value;
+      type->charset.assign(value.data(), value.size());
       return;
     }
   });
@@ -983,121 +1461,421 @@ static bool DetectContentType(const std::string           &in,
 }
 
 static bool DetectContentDisposition(
-    const std::string                  &in,
+    Span                                in,
     ProtocolHTTP::Content::Disposition *out) {
   typedef ProtocolHTTP::Content::Disposition Disposition;
   if (out == 0) {
     return false;
   }
-  const size_t kSemicolonOff = in.find_first_of(';');
-  out->type = in.substr(0, kSemicolonOff);
-  DetectParametersForHeaderField(in, kSemicolonOff, out, [](
-      const std::string &name,
-      const std::string &value,
-      void              *out) {
+  Span type;
+  const bool kHasParams = NextToken(&in, ';', &type);
+  out->type.assign(type.data(), type.size());
+  if (not kHasParams) {
+    return true;
+  }
+  DetectParametersForHeaderField(in, out, [](
+      const Span &name,
+      const Span &value,
+      void       *out) {
     Disposition *disp = static_cast<Disposition*>(out);
     if (name == "name") {
-      disp->name = value;
+      disp->name.assign(value.data(), value.size());
       return;
     }
     if (name == "filename") {
-      disp->filename = value;
+      disp->filename.assign(value.data(), value.size());
       return;
     }
   });
   return true;
 }
 
-static bool ParseHeaderField(const std::string    &line,
-                             ProtocolHTTP::Header *out) {
-  if (out == 0) {
-    return false;
-  }
-  if (line.size() < 2) {
-    return true;
-  }
-  // https://tools.ietf.org/html/rfc7230#section-3.2
-  const size_t      kSpaceOff = line.find_first_of(' ');
-  const std::string kField    = line.substr(0, kSpaceOff);
-  const size_t      kColonOff = kField.find_first_of(':');
-  // если не найден разделитель ':', тогда перед нами start-line
-  if (kColonOff == std::string::npos) {
-    out->line.method = GetMethodFromStr(kField);
-    if (out->line.method == ProtocolHTTP::kUnknown) {
-      return false;
-    }
-    const size_t kVerOff = line.find_first_of(' ', kSpaceOff + 1);
-    if (not out->line.target.ParseVal(line.substr(kSpaceOff + 1,
-                                                  kVerOff - kSpaceOff - 1))) {
+/**
+ * https://tools.ietf.org/html/rfc7230#section-3.1.1
+ * @return  k200, либо код ответа на ошибочную строку запроса
+ */
+static ProtocolHTTP::Code ParseStartLine(Span                  line,
+                                         Arena                *arena,
+                                         ProtocolHTTP::Header *out) {
+  Span method;
+  Span target;
+  if (not NextToken(&line, ' ', &method) || not NextToken(&line, ' ', &target)) {
+    return ProtocolHTTP::k400;
+  }
+  // https://tools.ietf.org/html/rfc7230#section-2.6
+  if (line.size() != 8 || not line.starts_with("HTTP/") || line[6] != '.' ||
+      line[5] < '0' || line[5] > '9' || line[7] < '0' || line[7] > '9') {
+    return ProtocolHTTP::k400;
+  }
+  if (line[5] != '1') {
+    return ProtocolHTTP::k505;
+  }
+  out->line.version.assign(line.data(), line.size());
+  out->line.method = GetMethodFromSpan(method);
+  if (out->line.method == ProtocolHTTP::kUnknown) {
+    return ProtocolHTTP::k501;
+  }
+  if (not out->line.target.Parse(target, arena)) {
+    return ProtocolHTTP::k400;
+  }
+  return ProtocolHTTP::k200;
+}
+// поля заголовка, которые разбираются в Header сразу
+enum FieldId {
+  kFieldUnknown,
+  kFieldHost,
+  kFieldUserAgent,
+  kFieldConnection,
+  kFieldContentType,
+  kFieldContentLength,
+  kFieldContentEncoding,
+  kFieldContentLanguage,
+  kFieldTransferEncoding,
+  kFieldContentDisposition
+};
+
+static inline char SymToLower(char sym) {
+  return (sym >= 'A' && sym <= 'Z' ? sym + ('a' - 'A') : sym);
+}
+// сравнение без учёта регистра, lower - в нижнем регистре и той же длины
+static bool EqualsLower(Span name, const char *lower) {
+  for (size_t off = 0; off < name.size(); off++) {
+    if (SymToLower(name[off]) != lower[off]) {
       return false;
     }
-    out->line.version = line.substr(kVerOff + 1);
   }
-  // разбор полей
-  const size_t      kNameOff   = line.find_first_not_of(' ');
-  const std::string kFieldName = line.substr(kNameOff, kColonOff - kNameOff);
-  const std::string kFieldVal  = TruncateString(line.substr(kColonOff + 1));
-  if (kFieldName == "User-Agent") {
-    out->user_agent = kFieldVal;
-    return true;
+  return true;
+}
+
+static inline FieldId MatchField(Span name, const char *lower, FieldId id) {
+  return (EqualsLower(name, lower) ? id : kFieldUnknown);
+}
+
+static constexpr unsigned FieldKey(size_t size, char first) {
+  return (static_cast<unsigned>(size) << 8) | static_cast<unsigned char>(first);
+}
+/**
+ * Имена полей сравниваются без учёта регистра:
+ * https://tools.ietf.org/html/rfc7230#section-3.2
+ * Длина и первая буква имени выбирают единственного кандидата (для имён
+ * длиной 16 байт - ещё и десятая буква), с которым имя сравнивается один раз.
+ */
+static FieldId GetFieldId(Span name) {
+  if (name.size() == 0) {
+    return kFieldUnknown;
+  }
+  switch (FieldKey(name.size(), SymToLower(name[0]))) {
+    case FieldKey(4, 'h'):
+      return MatchField(name, "host", kFieldHost);
+    case FieldKey(10, 'u'):
+      return MatchField(name, "user-agent", kFieldUserAgent);
+    case FieldKey(10, 'c'):
+      return MatchField(name, "connection", kFieldConnection);
+    case FieldKey(12, 'c'):
+      return MatchField(name, "content-type", kFieldContentType);
+    case FieldKey(14, 'c'):
+      return MatchField(name, "content-length", kFieldContentLength);
+    case FieldKey(16, 'c'):
+      return (SymToLower(name[9]) == 'n' ?
+              MatchField(name, "content-encoding", kFieldContentEncoding) :
+              MatchField(name, "content-language", kFieldContentLanguage));
+    case FieldKey(17, 't'):
+      return MatchField(name, "transfer-encoding", kFieldTransferEncoding);
+    case FieldKey(19, 'c'):
+      return MatchField(name, "content-disposition", kFieldContentDisposition);
+    default:
+      return kFieldUnknown;
+  };
+}
+// https://tools.ietf.org/html/rfc7230#section-3.3.2
+static bool ParseContentLength(Span                          value,
+                               ProtocolHTTP::Request::State *state) {
+  uint64_t length = 0;
+  if (not SpanToLength(value, &length)) {
+    return false;
   }
-  if (kFieldName == "Host") {
-    out->host = kFieldVal;
-    return true;
+  // повтор поля с другим значением делает границы тела неоднозначными
+  if (state->has_length && state->length != length) {
+    return false;
   }
-  if (kFieldName == "Accept-Language") {
-    return SplitStringToList(kFieldVal, ",", &out->accept.language);
+  state->has_length = true;
+  state->length     = length;
+  state->header.content.length = static_cast<USize>(
+      std::min<uint64_t>(length, std::numeric_limits<USize>::max()));
+  return true;
+}
+static void AddRawField(Span name, Span value, ProtocolHTTP::Request::State *state) {
+  ArenaString &data = state->fields_data;
+  ProtocolHTTP::Request::State::RawField field;
+  if (data.capacity() == 0) {
+    data.reserve(512);
   }
-  if (kFieldName == "Accept-Charset") {
-    return SplitStringToList(kFieldVal, ",", &out->accept.charset);
+  field.name_off   = data.size();
+  field.name_size  = name.size();
+  field.value_off  = field.name_off + name.size();
+  field.value_size = value.size();
+  for (size_t off = 0; off < name.size(); off++) {
+    data.push_back(SymToLower(name[off]));
   }
-  if (kFieldName == "Accept-Encoding") {
-    return SplitStringToList(kFieldVal, ",", &out->accept.encoding);
+  data.append(value.data(), value.size());
+  state->fields.push_back(field);
+}
+/**
+ * Значения всех полей с именем lower_name (в нижнем регистре), через div.
+ * @return  false - поля нет
+ */
+static bool JoinRawFields(const ProtocolHTTP::Request::State &state,
+                          const Span                         &lower_name,
+                          const char                         *div,
+                          std::string                        *out) {
+  typedef ProtocolHTTP::Request::State::ArrayOfRawFields::const_iterator FieldIt;
+  const char *kData = state.fields_data.data();
+  bool found = false;
+  out->clear();
+  for (FieldIt f_it = state.fields.begin(); f_it != state.fields.end(); f_it++) {
+    if (Span(kData + f_it->name_off, f_it->name_size) != lower_name) {
+      continue;
+    }
+    if (found) {
+      out->append(div);
+    }
+    out->append(kData + f_it->value_off, f_it->value_size);
+    found = true;
   }
-  if (kFieldName == "Content-Type") {
-    return DetectContentType(kFieldVal, &out->content.type);
+  return found;
+}
+/**
+ * Поле заголовка записывается в state->header: это заголовок запроса, либо
+ * заголовок части составного тела. Все поля заголовка запроса, кроме того,
+ * сохраняются в исходном виде.
+ * @return  false - строка не является полем заголовка, либо поле нарушает
+ *          границы тела запроса
+ */
+static bool ParseHeaderField(Span line, ProtocolHTTP::Request::State *state) {
+  if (state == 0) {
+    return false;
   }
-  if (kFieldName == "Content-Disposition") {
-    return DetectContentDisposition(kFieldVal, &out->content.disposition);
+  ProtocolHTTP::Header *out = &state->header;
+  // https://tools.ietf.org/html/rfc7230#section-3.2, пробел перед ':' и
+  // продолжение поля на следующей строке (obs-fold) не допускаются
+  const size_t kColonOff = ByteScan::FindEither(
+    reinterpret_cast<const uint8_t*>(line.data()), line.size(), ':', ' ');
+  if (kColonOff == 0 || kColonOff == line.size() || line[kColonOff] != ':') {
+    return false;
   }
-  if (kFieldName == "Content-Length") {
-    out->content.length = strtoul(kFieldVal.c_str(), 0, 0);
-    return true;
+  const Span kFieldName = line.substr(0, kColonOff);
+  const Span kRawVal    = TrimSpaces(line.substr(kColonOff + 1));
+  const Span kFieldVal  = TrimSpan(kRawVal);
+  if (state->stage == ProtocolHTTP::Request::State::kHeaderLines) {
+    AddRawField(kFieldName, kRawVal, state);
   }
-  if (kFieldName == "Content-Encoding") {
-    return SplitStringToList(kFieldVal, ",", &out->content.encoding);
-  }
-  if (kFieldName == "Content-Language") {
-    return SplitStringToList(kFieldVal, ",", &out->content.language);
+  switch (GetFieldId(kFieldName)) {
+    case kFieldHost:
+      out->host.assign(kFieldVal.data(), kFieldVal.size());
+      break;
+    case kFieldUserAgent:
+      out->user_agent.assign(kFieldVal.data(), kFieldVal.size());
+      break;
+    case kFieldConnection:
+      out->connection = SpanToLower(kFieldVal);
+      break;
+    case kFieldContentType:
+      DetectContentType(kFieldVal, &out->content.type);
+      break;
+    case kFieldContentLength:
+      return ParseContentLength(kFieldVal, state);
+    case kFieldContentEncoding:
+      SplitStringToList(kFieldVal, ',', &out->content.encoding);
+      break;
+    case kFieldContentLanguage:
+      SplitStringToList(kFieldVal, ',', &out->content.language);
+      break;
+    case kFieldTransferEncoding: {
+      // кодировки из повторных полей дополняют список:
+      // https://tools.ietf.org/html/rfc7230#section-3.2.2
+      ProtocolHTTP::ListOfString codings;
+      SplitStringToList(SpanToLower(kFieldVal), ',', &codings);
+      out->transfer_encoding.splice(out->transfer_encoding.end(), codings);
+      break;
+    }
+    case kFieldContentDisposition:
+      DetectContentDisposition(kFieldVal, &out->content.disposition);
+      break;
+    default:
+      break;
+  };
+  return true;
+}
+// ProtocolHTTP::Request: поля заголовка, разбираемые по запросу ---------------
+bool ProtocolHTTP::Request::GetField(const std::string &name,
+                                     std::string       *value) const {
+  std::string key(name);
+  std::string joined;
+  UpperSymbolsToLower(&key);
+  if (not JoinRawFields(*_state, key, ", ", &joined)) {
+    return false;
   }
-  if (kFieldName == "Content-Location") {
-    return out->content.location.ParseVal(kFieldVal);
+  if (value != 0) {
+    value->swap(joined);
   }
   return true;
 }
+
+const ProtocolHTTP::Accept& ProtocolHTTP::Request::GetAccept() const {
+  Accept &accept = _state->accept;
+  if ((_state->lazy_parsed & State::kLazyAccept) == 0) {
+    _state->lazy_parsed |= State::kLazyAccept;
+    std::string value;
+    if (JoinRawFields(*_state, "accept-language", ",", &value)) {
+      SplitStringToList(value, ',', &accept.language);
+    }
+    if (JoinRawFields(*_state, "accept-charset", ",", &value)) {
+      SplitStringToList(value, ',', &accept.charset);
+    }
+    if (JoinRawFields(*_state, "accept-encoding", ",", &value)) {
+      SplitStringToList(value, ',', &accept.encoding);
+    }
+  }
+  return accept;
+}
+
+const ProtocolHTTP::Uri& ProtocolHTTP::Request::GetContentLocation() const {
+  Uri &location = _state->content_location;
+  if ((_state->lazy_parsed & State::kLazyLocation) == 0) {
+    _state->lazy_parsed |= State::kLazyLocation;
+    std::string value;
+    if (JoinRawFields(*_state, "content-location", ",", &value)) {
+      location.ParseVal(value);
+    }
+  }
+  return location;
+}
+
+const ProtocolHTTP::Cookies& ProtocolHTTP::Request::GetCookies() const {
+  if ((_state->lazy_parsed & State::kLazyCookies) == 0) {
+    _state->lazy_parsed |= State::kLazyCookies;
+    std::string value;
+    JoinRawFields(*_state, "cookie", ";", &value);
+    Span list(value);
+    Span pair;
+    while (list.size() > 0) {
+      NextToken(&list, ';', &pair);
+      Span name;
+      if (not NextToken(&pair, '=', &name)) {
+        continue;
+      }
+      name = TrimSpan(name);
+      if (name.size() == 0) {
+        continue;
+      }
+      // при повторе имени используется первое значение:
+      // https://tools.ietf.org/html/rfc6265#section-5.4
+      const Span kValue = TrimSpan(pair);
+      _state->cookies.insert(std::make_pair(name.to_string(), kValue.to_string()));
+    }
+  }
+  return _state->cookies;
+}
+
+const ProtocolHTTP::ListOfString& ProtocolHTTP::Request::GetIfNoneMatch() const {
+  if ((_state->lazy_parsed & State::kLazyIfNoneMatch) == 0) {
+    _state->lazy_parsed |= State::kLazyIfNoneMatch;
+    std::string value;
+    JoinRawFields(*_state, "if-none-match", ",", &value);
+    Span list(value);
+    Span tag;
+    while (list.size() > 0) {
+      NextToken(&list, ',', &tag);
+      tag = TrimSpaces(tag);
+      if (tag.size() > 0) {
+        _state->if_none_match.push_back(tag.to_string());
+      }
+    }
+  }
+  return _state->if_none_match;
+}
+// https://tools.ietf.org/html/rfc7233#section-2.1, ошибочное поле игнорируется
+static void ParseRanges(Span value, ProtocolHTTP::ByteRanges *out) {
+  static const int64_t kNone = -1;
+  Span unit;
+  if (not NextToken(&value, '=', &unit) ||
+      TrimSpaces(unit).size() != 5 || not EqualsLower(TrimSpaces(unit), "bytes")) {
+    return;
+  }
+  Span spec;
+  while (value.size() > 0) {
+    NextToken(&value, ',', &spec);
+    spec = TrimSpaces(spec);
+    if (spec.size() == 0) {
+      continue;
+    }
+    Span first;
+    if (not NextToken(&spec, '-', &first)) {
+      out->clear();
+      return;
+    }
+    first = TrimSpaces(first);
+    spec  = TrimSpaces(spec);
+    const bool kHasFirst = (first.size() > 0);
+    const bool kHasLast  = (spec.size() > 0);
+    uint64_t first_pos = 0;
+    uint64_t last_pos  = 0;
+    if ((not kHasFirst && not kHasLast) ||
+        (kHasFirst && not SpanToLength(first, &first_pos)) ||
+        (kHasLast  && not SpanToLength(spec, &last_pos)) ||
+        (kHasFirst && kHasLast && last_pos < first_pos)) {
+      out->clear();
+      return;
+    }
+    out->push_back(ProtocolHTTP::ByteRange(kHasFirst ? first_pos : kNone,
+                                           kHasLast  ? last_pos  : kNone));
+  }
+}
+
+const ProtocolHTTP::ByteRanges& ProtocolHTTP::Request::GetRanges() const {
+  if ((_state->lazy_parsed & State::kLazyRanges) == 0) {
+    _state->lazy_parsed |= State::kLazyRanges;
+    std::string value;
+    if (JoinRawFields(*_state, "range", ",", &value)) {
+      ParseRanges(value, &_state->ranges);
+    }
+  }
+  return _state->ranges;
+}
 // ProtocolHTTP::Response::Source ----------------------------------------------
 ProtocolHTTP::Response::Source::~Source() {
 }
 
+bool ProtocolHTTP::Response::Source::ReadChunk(Chunk*, USize) {
+  return false;
+}
+
 ProtocolHTTP::Response::SourceFromFile::SourceFromFile(
     const std::string &file_name)
-    : _file(file_name.c_str(), std::fstream::in),
-      _file_size(0) {
-  if (not IsAvailable()) {
+    : _file(::open(file_name.c_str(), O_RDONLY | O_CLOEXEC)),
+      _file_size(0),
+      _offset(0),
+      _finished(false) {
+  struct stat info;
+  if (_file < 0) {
     return;
   }
-  _file.seekg(0, std::ios_base::end);
-  _file_size = _file.tellg();
-  _file.seekg(0, std::ios_base::beg);
-  _file.clear();
+  if (::fstat(_file, &info) != 0 || not S_ISREG(info.st_mode)) {
+    ::close(_file);
+    _file = -1;
+    return;
+  }
+  _file_size = info.st_size;
 }
 
 ProtocolHTTP::Response::SourceFromFile::~SourceFromFile() {
-  _file.close();
+  if (_file >= 0) {
+    ::close(_file);
+  }
 }
 
 bool ProtocolHTTP::Response::SourceFromFile::IsAvailable() const {
-  return _file.is_open() && _file.good();
+  return (_file >= 0 && not _finished);
 }
 
 USize ProtocolHTTP::Response::SourceFromFile::Size() const {
@@ -1107,58 +1885,74 @@ USize ProtocolHTTP::Response::SourceFromFile::Size() const {
 USize ProtocolHTTP::Response::SourceFromFile::ReadSome(
     Byte  *out,
     USize  max_size) {
-  if (not IsAvailable()) {
+  if (out == 0 || not IsAvailable()) {
     return 0;
   }
-  const USize kRealSize = _file.readsome(reinterpret_cast<char*>(out), max_size);
-  if (_file.tellg() == Size()) {
-    _file.setstate(std::ios::eofbit);
+  const USize   kAvailableSz = _file_size - _offset;
+  const USize   kSize        = kAvailableSz > max_size ? max_size : kAvailableSz;
+  const ssize_t kRealSize    = ::pread(_file, out, kSize, _offset);
+  if (kRealSize <= 0) {
+    _finished = true;
+    return 0;
   }
+  _offset  += kRealSize;
+  _finished = (_offset >= _file_size);
   return kRealSize;
 }
+
+bool ProtocolHTTP::Response::SourceFromFile::ReadChunk(Chunk *out, USize) {
+  if (out == 0 || _file < 0) {
+    return false;
+  }
+  *out      = Chunk(_file, _offset, _file_size - _offset);
+  _offset   = _file_size;
+  _finished = true;
+  return true;
+}
 // SourceFromStream
 ProtocolHTTP::Response::SourceFromStream::SourceFromStream(const std::string &src)
-    : _buff_size(0) {
-  _buff.str(src);
-  _buff_size = src.size();
+    : _buff(src), _offset(0) {
 }
 
 ProtocolHTTP::Response::SourceFromStream::SourceFromStream(std::stringstream *src)
-    : _buff_size(0) {
+    : _offset(0) {
   if (src == 0) {
     return;
   }
-  // TODO: gcc-4.9 не поддерживает это
-  //_buff.swap(*src);
-  //_buff = *src;
-  _buff.str(src->str());
-  _buff.seekg(0, std::ios_base::end);
-  _buff_size = _buff.tellg();
-  _buff.seekg(0, std::ios_base::beg);
-  _buff.clear();
+  _buff = src->str();
 }
 
 ProtocolHTTP::Response::SourceFromStream::~SourceFromStream() {
 }
 
 bool ProtocolHTTP::Response::SourceFromStream::IsAvailable() const {
-  return _buff.good() && (Size() > 0);
+  return (_offset < _buff.size());
 }
 
 USize ProtocolHTTP::Response::SourceFromStream::Size() const {
-  return _buff_size;
+  return _buff.size();
 }
 
 USize ProtocolHTTP::Response::SourceFromStream::ReadSome(Byte  *out,
                                                          USize  max_size) {
-  if (not IsAvailable()) {
+  if (out == 0 || not IsAvailable()) {
     return 0;
   }
-  const USize kRealSize = _buff.readsome(reinterpret_cast<char*>(out), max_size);
-  if (_buff.tellg() == Size()) {
-    _buff.setstate(std::ios::eofbit);
+  const USize kAvailableSz = _buff.size() - _offset;
+  const USize kSize        = kAvailableSz > max_size ? max_size : kAvailableSz;
+  memcpy(out, &_buff[_offset], kSize);
+  _offset += kSize;
+  return kSize;
+}
+
+bool ProtocolHTTP::Response::SourceFromStream::ReadChunk(Chunk *out, USize) {
+  if (out == 0) {
+    return false;
   }
-  return kRealSize;
+  *out = Chunk(reinterpret_cast<const Byte*>(_buff.data()) + _offset,
+               _buff.size() - _offset);
+  _offset = _buff.size();
+  return true;
 }
 // SourceFromArray
 ProtocolHTTP::Response::SourceFromArray::SourceFromArray(const Byte *data,
@@ -1187,12 +1981,22 @@ USize ProtocolHTTP::Response::SourceFromArray::ReadSome(Byte *out, USize max_siz
   _offset += kSize;
   return kSize;
 }
+
+bool ProtocolHTTP::Response::SourceFromArray::ReadChunk(Chunk *out, USize) {
+  if (out == 0 || _data == 0) {
+    return false;
+  }
+  *out    = Chunk(&_data[_offset], _size - _offset);
+  _offset = _size;
+  return true;
+}
 // ProtocolHTTP::Response ------------------------------------------------------
 struct ProtocolHTTP::Response::State {
   State(): status_id(k404) {}
 
   Code        status_id;
   Header      header;
+  std::string connection; // заполняется ProtocolHTTP, а не обработчиком запроса
   Source::Ptr src_header;
   Source::Ptr src_body;
 };
@@ -1274,10 +2078,22 @@ static std::string GetResponseStatus(ProtocolHTTP::Code status_id) {
     case ProtocolHTTP::k404:
       res << "Not Found";
       break;
+    case ProtocolHTTP::k413:
+      res << "Payload Too Large";
+      break;
+    case ProtocolHTTP::k414:
+      res << "URI Too Long";
+      break;
+    case ProtocolHTTP::k431:
+      res << "Request Header Fields Too Large";
+      break;
     // 500
     case ProtocolHTTP::k500:
       res << "Internal Server Error";
       break;
+    case ProtocolHTTP::k503:
+      res << "Service Unavailable";
+      break;
     case ProtocolHTTP::k505:
       res << "HTTP Version Not Supported";
       break;
@@ -1315,6 +2131,9 @@ static bool SetupHeader(ProtocolHTTP::Response::State *state) {
     str_h << "ETag: " << kETag
           << kCrLf;
   }
+  if (state->connection.size() != 0) {
+    str_h << state->connection;
+  }
   str_h << kCrLf;
   state->src_header.reset(new ProtocolHTTP::Response::SourceFromStream(str_h.str()));
   return true;
@@ -1395,8 +2214,11 @@ bool ProtocolHTTP::Response::UseFile(const Content::Type &type,
 }
 
 void ProtocolHTTP::Response::ResetState() {
-  delete _state;
-  _state = new State();
+  _state->status_id = k404;
+  _state->header    = Header();
+  _state->connection.clear();
+  _state->src_header.reset();
+  _state->src_body.reset();
 }
 // ProtocolHTTP::Router --------------------------------------------------------
 ProtocolHTTP::Router::Functor::Functor(Callback cb)
@@ -1557,12 +2379,18 @@ ProtocolHTTP::Router::Ptr ProtocolHTTP::Router::Create() {
 }
 // ProtocolHTTP ----------------------------------------------------------------
 struct ProtocolHTTP::State {
-  State(): need_to_close(false) {}
-
-  Router::Ptr router;
-  Request     request;
-  Response    response;
-  bool        need_to_close;
+  State(): need_to_close(false), keep_connection(false), requests_amount(0) {}
+
+  Router::Ptr   router;
+  Request       request;
+  Response      response;
+  KeepAlive     keep_alive;
+  RequestLimits limits;
+  bool          need_to_close;
+  bool          keep_connection;
+  USize         requests_amount;
+  ArrayOfData   pending; // начало следующего запроса, полученное вместе с текущим
+  ArrayOfData   stage;   // тело ответа, которое источник не отдаёт без копирования
 };
 
 ProtocolHTTP::ProtocolHTTP(Router::Ptr router): Protocol() {
@@ -1570,6 +2398,16 @@ ProtocolHTTP::ProtocolHTTP(Router::Ptr router): Protocol() {
   _state->router = router;
 }
 
+ProtocolHTTP::ProtocolHTTP(Router::Ptr          router,
+                           const KeepAlive     &keep_alive,
+                           const RequestLimits &limits)
+    : Protocol() {
+  _state = new State();
+  _state->router     = router;
+  _state->keep_alive = keep_alive;
+  _state->limits     = limits;
+}
+
 ProtocolHTTP::~ProtocolHTTP() {
   delete _state;
 }
@@ -1580,216 +2418,677 @@ void ProtocolHTTP::DecodeString(const std::string &in,
   if (out == 0) {
     return;
   }
-  out->clear();
-  bool in_hex = false;
-  std::string hex;
-  std::string::const_iterator sym_it = in.begin();
-  for (; sym_it != in.end(); sym_it++) {
-    const char kSym = *sym_it;
-    if (kSym == label) {
-      in_hex = true;
-      hex.clear();
+  out->resize(in.size());
+  out->resize(DecodeString(in.data(), in.size(), label, false, &(*out)[0]));
+}
+
+size_t ProtocolHTTP::DecodeString(const char *in,
+                                  size_t      size,
+                                  char        label,
+                                  bool        form,
+                                  char       *out) {
+  const uint8_t *kData = reinterpret_cast<const uint8_t*>(in);
+  const uint8_t  kPlus = (form ? '+' : label);
+  size_t from = 0;
+  size_t to   = 0;
+  while (from < size) {
+    // участки без кодированных символов пропускаются векторным поиском и
+    // при декодировании на месте до первой замены не копируются
+    const size_t kPlain = ByteScan::FindEither(kData + from, size - from,
+                                               label, kPlus);
+    if (out + to != in + from) {
+      memmove(out + to, in + from, kPlain);
+    }
+    from += kPlain;
+    to   += kPlain;
+    if (from == size) {
+      break;
+    }
+    if (in[from] != label) {
+      out[to++] = ' ';
+      from++;
       continue;
     }
-    if (in_hex) {
-      hex.push_back(kSym);
-      if (hex.size() == 2) {
-        in_hex = false;
-        out->push_back((char)strtol(hex.c_str(), 0, 16));
-      }
+    const uint8_t kHigh = (from + 2 < size ? kHexValue[kData[from + 1]] : kNotHex);
+    const uint8_t kLow  = (from + 2 < size ? kHexValue[kData[from + 2]] : kNotHex);
+    if ((kHigh | kLow) >= kNotHex) {
+      // ошибочная последовательность копируется как есть
+      out[to++] = in[from++];
       continue;
     }
-    out->push_back(kSym);
+    out[to++] = static_cast<char>((kHigh << 4) | kLow);
+    from     += 3;
   }
+  return to;
 }
 
-static USize ParseRequestHeader(ProtocolHTTP::Byte           *req_bytes,
-                                const size_t                  size,
-                                ProtocolHTTP::Request::State *out_state) {
-  static const size_t kLineMaxLen  = 512;
-  static const size_t kLineAverLen = 256;
-  std::string line(out_state->header_last_line);
-  line.reserve(kLineAverLen);
-  out_state->header.complete = false;
+typedef ProtocolHTTP::Request::State RequestState;
+
+enum LineStatus {
+  kLineIncomplete, // окончание строки придёт со следующей порцией данных
+  kLineReady,
+  kLineTooLong
+};
+
+static size_t LimitOf(USize limit) {
+  return (limit > 0 ? limit : std::numeric_limits<size_t>::max() / 2);
+}
+/**
+ * Очередная строка, начиная с *offs, без завершающих CRLF (LF). Из строки,
+ * разорванной между порциями данных, в tail сохраняется не больше max_len
+ * байт и CR, по этому слишком длинная строка обнаруживается не дожидаясь её
+ * окончания. После разбора готовой строки tail очищает вызывающий.
+ */
+static LineStatus ReadLine(const ProtocolHTTP::Byte *bytes,
+                           const size_t              size,
+                           size_t                   *offs,
+                           ArenaString              *tail,
+                           const size_t              max_len,
+                           Span                     *line) {
+  const char  *kChars     = reinterpret_cast<const char*>(bytes) + *offs;
+  const size_t kLeft      = size - *offs;
+  const size_t kLineSize  = ByteScan::Find(bytes + *offs, kLeft, '\n');
+  const bool   kLineEnded = (kLineSize < kLeft);
+  if (tail->size() > 0 || not kLineEnded) {
+    const size_t kRoom = (tail->size() >= max_len + 2 ? 0 :
+                          max_len + 2 - tail->size());
+    tail->append(kChars, std::min(kLineSize, kRoom));
+  }
+  *offs += kLineSize + (kLineEnded ? 1 : 0);
+  if (not kLineEnded) {
+    return (tail->size() > max_len + 1 ? kLineTooLong : kLineIncomplete);
+  }
+  *line = (tail->size() > 0 ? Span(tail->data(), tail->size()) :
+                              Span(kChars, kLineSize));
+  if (line->size() > 0 && (*line)[line->size() - 1] == '\r') {
+    line->remove_suffix(1);
+  }
+  return (line->size() > max_len ? kLineTooLong : kLineReady);
+}
+
+static void FailRequest(RequestState *state, ProtocolHTTP::Code code) {
+  state->stage = RequestState::kError;
+  state->error = code;
+}
+
+static bool IsStoredInMemory(const ProtocolHTTP::Request::Field &field) {
+  return (field.GetNameOfStorage() ==
+          ProtocolHTTP::Request::Field::StorageInMem::GetStaticName());
+}
+// данные поля тела; хранимые в памяти учитываются для RequestLimits::memory
+static void AppendBodyData(RequestState                 *state,
+                           ProtocolHTTP::Request::Field *field,
+                           const ProtocolHTTP::Byte     *data,
+                           const size_t                  size) {
+  if (IsStoredInMemory(*field)) {
+    state->in_memory += size;
+  }
+  field->Append(data, size);
+}
+
+/**
+ * Поле формы для завершённого ключа текущей пары. Если ключ уже встречался,
+ * то возвращается 0: как и для строки запроса, значением поля остаётся
+ * первое, а последующие отбрасываются.
+ */
+static ProtocolHTTP::Request::Field* StartFormField(RequestState *state) {
+  ArenaString &key = state->form_key;
+  key.resize(ProtocolHTTP::DecodeString(key.data(), key.size(), '%', true, &key[0]));
+  const std::string kKey(key.data(), key.size());
+  if (state->fields_post.count(kKey) > 0) {
+    return 0;
+  }
+  ProtocolHTTP::Request::Field *field = &state->fields_post[kKey];
+  const ProtocolHTTP::Content::Type kType(ProtocolHTTP::Content::Type::kText, "plain");
+  field->set_type(kType);
+  if (state->storage_generator != 0) {
+    field->UseStorage(state->storage_generator(kType));
+  }
+  if (field->IsNull()) {
+    field->UseStorage(new ProtocolHTTP::Request::Field::StorageInMem());
+  }
+  return field;
+}
+/**
+ * Декодирование и передача в поле очередной части значения. Незавершённая
+ * последовательность %XX в конце порции остаётся в form_buff до следующей.
+ */
+static void AppendFormValue(RequestState             *state,
+                            const ProtocolHTTP::Byte *data,
+                            const size_t              size,
+                            const bool                last) {
+  ArenaString &buff = state->form_buff;
+  if (state->form_field == 0) {
+    buff.clear();
+    return;
+  }
+  if (size > 0) {
+    buff.append(reinterpret_cast<const char*>(data), size);
+  }
+  size_t keep = 0;
+  if (not last && buff.size() > 0 && buff[buff.size() - 1] == '%') {
+    keep = 1;
+  } else if (not last && buff.size() > 1 && buff[buff.size() - 2] == '%') {
+    keep = 2;
+  }
+  const size_t kRaw = buff.size() - keep;
+  const size_t kDecoded = ProtocolHTTP::DecodeString(buff.data(), kRaw, '%', true,
+                                                     &buff[0]);
+  AppendBodyData(state, state->form_field,
+                 reinterpret_cast<const ProtocolHTTP::Byte*>(buff.data()), kDecoded);
+  memmove(&buff[0], &buff[kRaw], keep);
+  buff.resize(keep);
+}
+// пара "ключ=значение" или ключ без значения завершены
+static void FinishFormPair(RequestState *state) {
+  if (state->form_value) {
+    AppendFormValue(state, 0, 0, true);
+  } else if (state->form_key.size() > 0) {
+    StartFormField(state);
+  }
+  state->form_value = false;
+  state->form_field = 0;
+  state->form_key.clear();
+}
+// https://url.spec.whatwg.org/#application/x-www-form-urlencoded
+static void ParseFormBody(const ProtocolHTTP::Byte *bytes,
+                          const size_t              size,
+                          RequestState             *state) {
   size_t offs = 0;
-  for (; offs < size; offs++) {
-    const ProtocolHTTP::Byte kByte = req_bytes[offs];
-    // пропускаем символ CR
-    if (kByte == 0x0D) {
-      continue;
-    }
-    // учитываем символ LF, и принимаем его как признак конца строки
-    if (kByte == 0x0A) {
-      // Пустая строка, признак окончания заголовка
-      if (line.size() < 2) {
-        out_state->header_last_line.clear();
-        // Условие offs > 2, для того что бы алгоритм не находил признак окончания
-        // заголовка в начале массива. Иначе мы получим пустой заголовок!
-        if (offs > 2) {
-          out_state->header.complete = true;
-        }
-        // +1 нужен для смещения на символ следующий, после обнаруженной пустой
-        // строки. Если убрать +1 то смещение будет указывать на пустую строку.
-        offs++;
+  while (offs < size) {
+    if (not state->form_value) {
+      const size_t kEnd = offs + ByteScan::FindEither(&bytes[offs], size - offs,
+                                                      '=', '&');
+      state->form_key.append(reinterpret_cast<const char*>(&bytes[offs]), kEnd - offs);
+      state->in_memory += kEnd - offs;
+      if (kEnd == size) {
         break;
       }
-      if (not ParseHeaderField(line, &out_state->header)) {
-        // TODO: регистрация ошибок
+      if (bytes[kEnd] == '&') {
+        FinishFormPair(state);
+      } else {
+        state->form_field = StartFormField(state);
+        state->form_value = true;
       }
-      line.clear();
+      offs = kEnd + 1;
       continue;
     }
-    line.push_back((char)kByte);
-    if (line.size() > kLineMaxLen) {
-      // TODO: регистрация ошибок
+    const size_t kEnd = offs + ByteScan::Find(&bytes[offs], size - offs, '&');
+    AppendFormValue(state, &bytes[offs], kEnd - offs, false);
+    if (kEnd == size) {
       break;
     }
+    FinishFormPair(state);
+    offs = kEnd + 1;
   }
-  if (not out_state->header.complete) {
-    out_state->header_last_line = line;
+}
+
+static void CompleteRequest(RequestState *state) {
+  if (state->body_kind == RequestState::kBodyForm) {
+    FinishFormPair(state);
   }
-  return offs;
+  state->stage         = RequestState::kComplete;
+  state->complete_body = true;
+}
+// https://tools.ietf.org/html/rfc2046#section-5.1.1: boundary := 0*69<bchars> bcharsnospace
+static const size_t kBoundaryMaxLen  = 70;
+static const size_t kPartDelimMaxLen = 4 + kBoundaryMaxLen;
+static const size_t kPartLineMaxLen  = 512;
+/**
+ * Разделитель частей (CRLF "--" boundary) и таблица сдвигов для его поиска
+ * алгоритмом Бойера-Мура-Хорспула. Первому разделителю CRLF может не
+ * предшествовать, по этому он считается уже совпавшим.
+ */
+static bool StartMultipartBody(RequestState *state) {
+  const std::string &kBoundary = state->header.content.type.boundary;
+  if (kBoundary.size() == 0 || kBoundary.size() > kBoundaryMaxLen) {
+    return false;
+  }
+  ArenaString &delim = state->part_delim;
+  delim.assign("\r\n--");
+  delim.append(kBoundary.data(), kBoundary.size());
+  const size_t kLast = delim.size() - 1;
+  memset(state->part_skip, static_cast<int>(delim.size()), sizeof(state->part_skip));
+  for (size_t off = 0; off < kLast; off++) {
+    state->part_skip[static_cast<uint8_t>(delim[off])] = static_cast<uint8_t>(kLast - off);
+  }
+  state->part_matched = 2;
+  state->part_stage   = RequestState::kPartPreamble;
+  return true;
+}
+// разбор тела выбирается по Content-Type, false - тело не может быть разобрано
+static bool StartBodyParser(RequestState *state) {
+  const ProtocolHTTP::Content::Type &kType = state->header.content.type;
+  static const char kFormType[] = "x-www-form-urlencoded";
+  if (kType.name == ProtocolHTTP::Content::Type::kMultipart) {
+    state->body_kind = RequestState::kBodyMultipart;
+    return StartMultipartBody(state);
+  }
+  if (kType.name == ProtocolHTTP::Content::Type::kApplication &&
+      kType.sub_type.size() == sizeof(kFormType) - 1 &&
+      EqualsLower(kType.sub_type, kFormType)) {
+    state->body_kind = RequestState::kBodyForm;
+    return true;
+  }
+  state->body_kind = RequestState::kBodyRaw;
+  state->body.reset(new ProtocolHTTP::Request::Field());
+  state->body->set_type(kType);
+  if (state->storage_generator != 0) {
+    state->body->UseStorage(state->storage_generator(kType));
+  }
+  if (state->body->IsNull()) {
+    state->body->UseStorage(new ProtocolHTTP::Request::Field::StorageInMem());
+  }
+  return true;
+}
+/**
+ * Выбор способа чтения тела по полям заголовка:
+ * https://tools.ietf.org/html/rfc7230#section-3.3.3
+ */
+static void StartRequestBody(RequestState                        *state,
+                             const ProtocolHTTP::RequestLimits   &limits) {
+  const ProtocolHTTP::ListOfString &kCodings = state->header.transfer_encoding;
+  state->header.complete = true;
+  if ((kCodings.size() > 0 || state->length > 0) && not StartBodyParser(state)) {
+    FailRequest(state, ProtocolHTTP::k400);
+    return;
+  }
+  if (kCodings.size() > 0) {
+    // оба поля сразу - признак попытки подмены запроса (request smuggling)
+    if (state->has_length || kCodings.back() != "chunked") {
+      FailRequest(state, ProtocolHTTP::k400);
+      return;
+    }
+    // прочие кодировки (gzip, deflate) не поддерживаются
+    if (kCodings.size() > 1) {
+      FailRequest(state, ProtocolHTTP::k501);
+      return;
+    }
+    state->stage = RequestState::kChunkSize;
+    return;
+  }
+  // тело в памяти известной длины отклоняется до чтения
+  const bool kInMemory = (state->body_kind == RequestState::kBodyRaw && state->body &&
+                          IsStoredInMemory(*state->body));
+  if (state->length > std::numeric_limits<USize>::max() ||
+      (limits.body > 0 && state->length > limits.body) ||
+      (limits.memory > 0 && kInMemory && state->length > limits.memory)) {
+    FailRequest(state, ProtocolHTTP::k413);
+    return;
+  }
+  if (state->length == 0) {
+    CompleteRequest(state);
+    return;
+  }
+  state->body_left = state->length;
+  state->stage     = RequestState::kBody;
 }
 
-static size_t FindMultipartBoundary(const std::string            &boundary,
-                                    ProtocolHTTP::Byte           *req_bytes,
-                                    const size_t                  size,
-                                    ProtocolHTTP::Request::State *out_state) {
-  if (req_bytes == 0 || boundary.size() == 0) {
-    return 0;
+static size_t ParseRequestHeader(ProtocolHTTP::Byte                *req_bytes,
+                                 const size_t                       size,
+                                 RequestState                      *state,
+                                 const ProtocolHTTP::RequestLimits &limits) {
+  size_t offs = 0;
+  while (offs < size && (state->stage == RequestState::kStartLine ||
+                         state->stage == RequestState::kHeaderLines)) {
+    const size_t kFrom = offs;
+    Span line;
+    const LineStatus kStatus = ReadLine(req_bytes, size, &offs,
+                                        &state->header_last_line,
+                                        LimitOf(limits.line), &line);
+    state->header_size += offs - kFrom;
+    if (kStatus == kLineTooLong) {
+      FailRequest(state, state->stage == RequestState::kStartLine ?
+                         ProtocolHTTP::k414 : ProtocolHTTP::k431);
+      break;
+    }
+    if (limits.header > 0 && state->header_size > limits.header) {
+      FailRequest(state, ProtocolHTTP::k431);
+      break;
+    }
+    if (kStatus == kLineIncomplete) {
+      break;
+    }
+    if (state->stage == RequestState::kStartLine) {
+      // пустые строки перед строкой запроса пропускаются:
+      // https://tools.ietf.org/html/rfc7230#section-3.5
+      if (line.size() > 0) {
+        const ProtocolHTTP::Code kCode = ParseStartLine(line, state->GetArena(),
+                                                        &state->header);
+        if (kCode == ProtocolHTTP::k200) {
+          state->stage = RequestState::kHeaderLines;
+        } else {
+          FailRequest(state, kCode);
+        }
+      }
+    } else if (line.size() == 0) {
+      // пустая строка - признак окончания заголовка
+      StartRequestBody(state, limits);
+    } else if (not ParseHeaderField(line, state)) {
+      FailRequest(state, ProtocolHTTP::k400);
+    }
+    state->header_last_line.clear();
   }
-  const std::string &kFieldName = out_state->post_header.content.disposition.name;
-  ProtocolHTTP::Request::Field *field = 0;
-  if (kFieldName.size() > 0) {
-    field = &out_state->fields_post[kFieldName];
-    if (field && field->IsNull()) {
-      if (out_state->storage_generator != 0) {
-        field->UseStorage(out_state->storage_generator(out_state->post_header.content.type));
+  return offs;
+}
+/**
+ * Строки, обрамляющие данные в кодировке chunked: размер части, CRLF после
+ * её данных и поля после последней части (trailer).
+ */
+static size_t ParseChunkedLines(ProtocolHTTP::Byte                *req_bytes,
+                                const size_t                       size,
+                                RequestState                      *state,
+                                const ProtocolHTTP::RequestLimits &limits) {
+  size_t offs = 0;
+  while (offs < size && (state->stage == RequestState::kChunkSize ||
+                         state->stage == RequestState::kChunkEnd  ||
+                         state->stage == RequestState::kTrailer)) {
+    const size_t kFrom = offs;
+    Span line;
+    const LineStatus kStatus = ReadLine(req_bytes, size, &offs,
+                                        &state->header_last_line,
+                                        LimitOf(limits.line), &line);
+    if (state->stage == RequestState::kTrailer) {
+      state->header_size += offs - kFrom;
+      if (kStatus == kLineTooLong ||
+          (limits.header > 0 && state->header_size > limits.header)) {
+        FailRequest(state, ProtocolHTTP::k431);
+        break;
+      }
+    }
+    if (kStatus == kLineTooLong) {
+      FailRequest(state, ProtocolHTTP::k400);
+      break;
+    }
+    if (kStatus == kLineIncomplete) {
+      break;
+    }
+    if (state->stage == RequestState::kChunkSize) {
+      uint64_t chunk = 0;
+      if (not ParseChunkSize(line, &chunk)) {
+        FailRequest(state, ProtocolHTTP::k400);
+      } else if (chunk == 0) {
+        state->stage = RequestState::kTrailer;
+      } else if (chunk > std::numeric_limits<USize>::max() - state->body_size ||
+                 (limits.body > 0 && state->body_size + chunk > limits.body)) {
+        FailRequest(state, ProtocolHTTP::k413);
+      } else {
+        state->body_left = chunk;
+        state->stage     = RequestState::kChunkData;
       }
-      if (field->IsNull()) {
-        field->UseStorage(new ProtocolHTTP::Request::Field::StorageInMem());
+    } else if (state->stage == RequestState::kChunkEnd) {
+      if (line.size() == 0) {
+        state->stage = RequestState::kChunkSize;
+      } else {
+        FailRequest(state, ProtocolHTTP::k400);
       }
+    } else if (line.size() == 0) {
+      // поля trailer не используются, длина тела становится известна только
+      // теперь: https://tools.ietf.org/html/rfc7230#section-4.1.3
+      state->header.content.length = state->body_size;
+      CompleteRequest(state);
     }
+    state->header_last_line.clear();
   }
-  const std::string kBoundary("--" + boundary + "\r\n");
-  uint8_t match = out_state->body_last_match;
-  size_t  off   = 0;
-  out_state->boundary_was_found = false;
-  for (; off < size; off++) {
-    const ProtocolHTTP::Byte kByte = req_bytes[off];
-    if (match < kBoundary.size() && kByte == kBoundary.at(match)) {
-      match++;
-    } else {
-      match = 0;
+  return offs;
+}
+/**
+ * Поиск разделителя частей алгоритмом Бойера-Мура-Хорспула.
+ * @param partial  длина окончания data, совпавшего с началом разделителя,
+ *                 если он не найден
+ * @return  смещение начала разделителя, либо size
+ */
+static size_t FindPartDelimiter(const uint8_t      *data,
+                                const size_t        size,
+                                const RequestState &state,
+                                size_t             *partial) {
+  const uint8_t *kDelim = reinterpret_cast<const uint8_t*>(state.part_delim.data());
+  const size_t   kSize  = state.part_delim.size();
+  const size_t   kLast  = kSize - 1;
+  size_t off = 0;
+  *partial = 0;
+  while (off + kSize <= size) {
+    const uint8_t kByte = data[off + kLast];
+    if (kByte == kDelim[kLast] && memcmp(&data[off], kDelim, kLast) == 0) {
+      return off;
     }
-    // признак начала, части составного сообщения, найден
-    if (match == kBoundary.size()) {
-      if (field != 0 && not field->IsNull() && off > match) {
-        field->Append(req_bytes, off - (match + 1));
-      }
-      out_state->body_last_match    = 0;
-      out_state->boundary_was_found = true;
-      // +1 нужен для последующего поиска, что бы он не начинался с последнего
-      // символа последовательности "boundary"
-      off++;
+    off += state.part_skip[kByte];
+  }
+  // начиная с off разделитель целиком не помещается в data
+  for (; off < size; off++) {
+    if (memcmp(&data[off], kDelim, size - off) == 0) {
+      *partial = size - off;
       break;
     }
   }
-  out_state->body_last_match = match;
-  if (not out_state->boundary_was_found && field != 0 && not field->IsNull()) {
-    field->Append(req_bytes, size);
+  return size;
+}
+// поле, получающее данные текущей части, либо 0 для части без имени
+static ProtocolHTTP::Request::Field* GetPartField(RequestState *state) {
+  const std::string &kName = state->part.disposition.name;
+  if (kName.size() == 0) {
+    return 0;
+  }
+  ProtocolHTTP::Request::Field *field = &state->fields_post[kName];
+  if (field->IsNull()) {
+    field->set_type(state->part.type);
+  }
+  if (field->IsNull() && state->storage_generator != 0) {
+    field->UseStorage(state->storage_generator(state->part.type));
+  }
+  if (field->IsNull()) {
+    field->UseStorage(new ProtocolHTTP::Request::Field::StorageInMem());
+  }
+  return field;
+}
+
+static void AppendPartData(RequestState                 *state,
+                           ProtocolHTTP::Request::Field *field,
+                           const void                   *data,
+                           const size_t                  size) {
+  if (field != 0 && size > 0) {
+    AppendBodyData(state, field, static_cast<const ProtocolHTTP::Byte*>(data), size);
   }
-  return off;
+}
+
+static size_t FinishPartData(RequestState *state, size_t used) {
+  state->part_matched = 0;
+  state->part_stage   = RequestState::kPartDelimiter;
+  state->part_line.clear();
+  return used;
 }
 /**
- * Функция для разбора пакета состоящего из нескольких частей, содержащих
- * данные различных типов.
- * @param content   Этот аргумент должен передаваться через копирование, нельзя
- *                  использовать ссылки и указатели, это нарушит работу алгоритма!
- * @param req_bytes
- * @param size
- * @param out_state
- * @return
+ * Данные преамбулы (отбрасываются) либо части (передаются в хранилище поля)
+ * до разделителя. Окончание порции, совпавшее с началом разделителя,
+ * откладывается (part_matched) и проверяется вместе со следующей порцией.
+ * @return  использовано байт
  */
-static bool ParseMultipartRequestBody(const ProtocolHTTP::Content   content,
-                                      ProtocolHTTP::Byte           *req_bytes,
-                                      const size_t                  size,
-                                      ProtocolHTTP::Request::State *out_state) {
-  if (req_bytes == 0 || out_state == 0) {
-    return false;
+static size_t ParsePartData(const ProtocolHTTP::Byte *bytes,
+                            const size_t              size,
+                            RequestState             *state) {
+  const uint8_t *kDelim = reinterpret_cast<const uint8_t*>(state->part_delim.data());
+  const size_t   kSize  = state->part_delim.size();
+  ProtocolHTTP::Request::Field *field = (
+      state->part_stage == RequestState::kPartData ? GetPartField(state) : 0);
+  size_t partial = 0;
+  if (state->part_matched > 0) {
+    // отложенные байты совпадают с началом разделителя, по этому вместе с
+    // началом новой порции они проверяются в небольшом буфере
+    uint8_t      window[2 * kPartDelimMaxLen];
+    const size_t kHeld = state->part_matched;
+    const size_t kTake = std::min(size, kSize);
+    memcpy(window, kDelim, kHeld);
+    memcpy(&window[kHeld], bytes, kTake);
+    const size_t kFound = FindPartDelimiter(window, kHeld + kTake, *state, &partial);
+    if (kFound < kHeld) {
+      AppendPartData(state, field, kDelim, kFound);
+      return FinishPartData(state, kFound + kSize - kHeld);
+    }
+    if (partial > 0 && kHeld + kTake - partial < kHeld) {
+      // новая порция целиком продолжает начало разделителя
+      AppendPartData(state, field, kDelim, kHeld + kTake - partial);
+      state->part_matched = partial;
+      return size;
+    }
+    AppendPartData(state, field, kDelim, kHeld);
+    state->part_matched = 0;
+  }
+  const size_t kFound = FindPartDelimiter(bytes, size, *state, &partial);
+  if (kFound < size) {
+    AppendPartData(state, field, bytes, kFound);
+    return FinishPartData(state, kFound + kSize);
+  }
+  AppendPartData(state, field, bytes, size - partial);
+  state->part_matched = partial;
+  return size;
+}
+// Content-Type и Content-Disposition части, прочие поля пропускаются
+static void ParsePartField(Span line, ProtocolHTTP::Content *part) {
+  const size_t kColonOff = line.find(':');
+  if (kColonOff == Span::npos) {
+    return;
   }
-  const ProtocolHTTP::Header kOutStateHeader = out_state->header;
-  size_t off = 0;
-  while (off < size) {
-    if (out_state->post_header.complete || not out_state->boundary_was_found) {
-      const size_t kPartOff = FindMultipartBoundary(content.type.boundary,
-                                                    &req_bytes[off],
-                                                    size - off,
-                                                    out_state);
-      // Необходимо сбросить последний найденый заголовок, потому что он уже был
-      // использован, внутри FindMultipartBoundary, и последующее его использование
-      // является некорректным. Делать это можно только в случае когда был обнаружен
-      // полный boundary
-      if (out_state->boundary_was_found) {
-        out_state->post_header = ProtocolHTTP::Header();
-      }
-      off += kPartOff;
-      if (off >= size || kPartOff == 0) {
-        break;
-      }
+  const Span kValue = TrimSpan(TrimSpaces(line.substr(kColonOff + 1)));
+  switch (GetFieldId(line.substr(0, kColonOff))) {
+    case kFieldContentType:
+      DetectContentType(kValue, &part->type);
+      break;
+    case kFieldContentDisposition:
+      DetectContentDisposition(kValue, &part->disposition);
+      break;
+    default:
+      break;
+  };
+}
+/**
+ * Окончание строки разделителя ("--" у последнего) и строки заголовка части.
+ * Ошибочные и слишком длинные строки пропускаются.
+ */
+static size_t ParsePartLines(const ProtocolHTTP::Byte *bytes,
+                             const size_t              size,
+                             RequestState             *state) {
+  size_t offs = 0;
+  while (offs < size && (state->part_stage == RequestState::kPartDelimiter ||
+                         state->part_stage == RequestState::kPartHeader)) {
+    Span line;
+    const LineStatus kStatus = ReadLine(bytes, size, &offs, &state->part_line,
+                                        kPartLineMaxLen, &line);
+    if (kStatus == kLineIncomplete) {
+      break;
     }
-    if (not out_state->post_header.complete) {
-      out_state->header = out_state->post_header;
+    if (state->part_stage == RequestState::kPartDelimiter) {
+      if (kStatus == kLineReady && line.starts_with("--")) {
+        state->part_stage = RequestState::kPartEpilogue;
+      } else {
+        // заголовок новой части заполняется без создания нового Content
+        state->part.type        = ProtocolHTTP::Content::Type();
+        state->part.disposition = ProtocolHTTP::Content::Disposition();
+        state->part_stage       = RequestState::kPartHeader;
+      }
+    } else if (kStatus == kLineReady && line.size() == 0) {
+      state->part_stage = RequestState::kPartData;
+    } else if (kStatus == kLineReady) {
+      ParsePartField(line, &state->part);
     }
-    const USize kBodyOffs = ParseRequestHeader(&req_bytes[off],
-                                               size - off,
-                                               out_state);
-    out_state->post_header = out_state->header;
-    off += kBodyOffs;
-  } // while
-  out_state->body_size += off;
-  out_state->header     = kOutStateHeader;
-  if (out_state->body_size == out_state->header.content.length) {
-    out_state->complete_body = true;
+    state->part_line.clear();
+  }
+  return offs;
+}
+// https://tools.ietf.org/html/rfc7578, https://tools.ietf.org/html/rfc2046#section-5.1
+static void ParseMultipartBody(const ProtocolHTTP::Byte *bytes,
+                               const size_t              size,
+                               RequestState             *state) {
+  size_t offs = 0;
+  while (offs < size) {
+    switch (state->part_stage) {
+      case RequestState::kPartPreamble:
+      case RequestState::kPartData:
+        offs += ParsePartData(&bytes[offs], size - offs, state);
+        break;
+      case RequestState::kPartDelimiter:
+      case RequestState::kPartHeader:
+        offs += ParsePartLines(&bytes[offs], size - offs, state);
+        break;
+      default:
+        offs = size;
+        break;
+    };
   }
-  return true;
 }
 
-static bool ParseRequestBody(ProtocolHTTP::Byte           *req_bytes,
-                             const size_t                  size,
-                             ProtocolHTTP::Request::State *out_state) {
-  if (req_bytes == 0 || out_state == 0) {
-    return false;
+/**
+ * Данные тела длиной Content-Length, либо данные очередной части chunked.
+ * Байты за пределами тела принадлежат следующему запросу.
+ */
+static size_t ParseRequestBody(ProtocolHTTP::Byte                *req_bytes,
+                               const size_t                       size,
+                               RequestState                      *state,
+                               const ProtocolHTTP::RequestLimits &limits) {
+  const size_t kSize = static_cast<size_t>(
+      std::min<uint64_t>(size, state->body_left));
+  switch (state->body_kind) {
+    case RequestState::kBodyMultipart:
+      ParseMultipartBody(req_bytes, kSize, state);
+      break;
+    case RequestState::kBodyForm:
+      ParseFormBody(req_bytes, kSize, state);
+      break;
+    default:
+      AppendBodyData(state, state->body.get(), req_bytes, kSize);
+      break;
+  };
+  if (limits.memory > 0 && state->in_memory > limits.memory) {
+    FailRequest(state, ProtocolHTTP::k413);
+    return kSize;
   }
-  if (out_state->header.content.type.name == ProtocolHTTP::Content::Type::kMultipart) {
-    return ParseMultipartRequestBody(out_state->header.content,
-                                     req_bytes,
-                                     size,
-                                     out_state);
+  state->body_size += kSize;
+  state->body_left -= kSize;
+  if (state->body_left > 0) {
+    return kSize;
   }
-  return true;
+  if (state->stage == RequestState::kChunkData) {
+    state->stage = RequestState::kChunkEnd;
+  } else {
+    CompleteRequest(state);
+  }
+  return kSize;
 }
 
 bool ProtocolHTTP::ParseRequest(Byte         *req_bytes,
                                 const size_t  size,
-                                Request      *out) {
+                                Request      *out,
+                                size_t       *used) {
+  if (used != 0) {
+    *used = 0;
+  }
   if (req_bytes == 0 || out == 0 || size == 0) {
     return false;
   }
-  USize body_off = 0;
-  if (not out->_state->header.complete) {
-    body_off = ParseRequestHeader(req_bytes, size, out->_state);
-    if (not out->_state->header.complete) {
-      return true;
-    }
-  }
-  if (out->_state->header.content.length == 0) {
-    out->_state->complete_body = true;
+  RequestState *state = out->_state;
+  size_t        offs  = 0;
+  while (offs < size && state->stage != RequestState::kComplete &&
+                        state->stage != RequestState::kError) {
+    switch (state->stage) {
+      case RequestState::kStartLine:
+      case RequestState::kHeaderLines:
+        offs += ParseRequestHeader(&req_bytes[offs], size - offs, state,
+                                   _state->limits);
+        break;
+      case RequestState::kBody:
+      case RequestState::kChunkData:
+        offs += ParseRequestBody(&req_bytes[offs], size - offs, state,
+                                 _state->limits);
+        break;
+      default:
+        offs += ParseChunkedLines(&req_bytes[offs], size - offs, state,
+                                  _state->limits);
+        break;
+    };
   }
-  if (not out->_state->complete_body) {
-    return ParseRequestBody(&req_bytes[body_off], size - body_off, out->_state);
+  if (used != 0) {
+    *used = offs;
   }
-  return true;
+  return (state->stage != RequestState::kError);
 }
 
 USize ProtocolHTTP::GetResponse(Byte     *out_resp_bytes,
@@ -1810,40 +3109,187 @@ USize ProtocolHTTP::GetResponse(Byte     *out_resp_bytes,
   return resp->_state->src_body->ReadSome(out_resp_bytes, out_size);
 }
 
+USize ProtocolHTTP::GetResponse(Chunks *out, Response *resp) {
+  static const USize kStageSize = 64 * 1024;
+  if (out == 0 || resp == 0) {
+    return 0;
+  }
+  out->clear();
+  if (not resp->_state->src_header && not SetupHeader(resp->_state)) {
+    return 0;
+  }
+  USize size = 0;
+  Chunk chunk;
+  Response::Source::Ptr &header = resp->_state->src_header;
+  if (header->IsAvailable() && header->ReadChunk(&chunk, kStageSize)) {
+    out->push_back(chunk);
+    size += chunk.size;
+  }
+  Response::Source::Ptr &body = resp->_state->src_body;
+  if (not body || not body->IsAvailable()) {
+    return size;
+  }
+  if (body->ReadChunk(&chunk, kStageSize)) {
+    if (chunk.size > 0) {
+      out->push_back(chunk);
+    }
+    return size + chunk.size;
+  }
+  _state->stage.resize(kStageSize);
+  chunk = Chunk(&_state->stage[0], body->ReadSome(&_state->stage[0], kStageSize));
+  if (chunk.size > 0) {
+    out->push_back(chunk);
+  }
+  return size + chunk.size;
+}
+
+static bool CanKeepConnection(const ProtocolHTTP::Header    &header,
+                              const ProtocolHTTP::KeepAlive &keep_alive,
+                              USize                          requests_amount) {
+  if (keep_alive.max_requests > 0 && requests_amount >= keep_alive.max_requests) {
+    return false;
+  }
+  // https://tools.ietf.org/html/rfc7230#section-6.3
+  if (header.connection.find("close") != std::string::npos) {
+    return false;
+  }
+  return (header.line.version == "HTTP/1.1" ||
+          header.connection.find("keep-alive") != std::string::npos);
+}
+
+static std::string GetConnectionFields(const ProtocolHTTP::KeepAlive &keep_alive,
+                                       USize requests_amount,
+                                       bool  keep_connection) {
+  if (not keep_connection) {
+    return "Connection: close\r\n";
+  }
+  std::stringstream fields;
+  fields << "Connection: keep-alive\r\n"
+         << "Keep-Alive: timeout=" << keep_alive.timeout;
+  if (keep_alive.max_requests > 0) {
+    fields << ", max=" << (keep_alive.max_requests - requests_amount);
+  }
+  fields << "\r\n";
+  return fields.str();
+}
+
 bool ProtocolHTTP::HandleRequest(Byte *data, USize size) {
-  const bool kParseRes = ParseRequest(data, size, &_state->request);
+  size_t     used      = 0;
+  const bool kParseRes = ParseRequest(data, size, &_state->request, &used);
   const bool kComplete = _state->request.Completed();
   if (kComplete) {
+    if (used < size) {
+      _state->pending.assign(&data[used], &data[size]);
+    }
+    _state->requests_amount++;
+    _state->keep_connection = CanKeepConnection(_state->request.GetHeader(),
+                                                _state->keep_alive,
+                                                _state->requests_amount);
+    _state->response._state->connection = GetConnectionFields(
+        _state->keep_alive,
+        _state->requests_amount,
+        _state->keep_connection);
     if (not _state->router->CallHandlerFor(_state->request, &_state->response)) {
       _state->response.SetHeader(k404);
     }
+  } else if (not kParseRes) {
+    // после ошибки разбора, границы следующего запроса неизвестны, по этому
+    // соединение закрывается после ответа с кодом ошибки
+    const Code kError = _state->request.GetError();
+    _state->keep_connection = false;
+    _state->response._state->connection = GetConnectionFields(
+        _state->keep_alive,
+        _state->requests_amount,
+        false);
+    _state->response.SetHeader(kError != k200 ? kError : k400);
   }
   return (kParseRes && not kComplete);
 }
 
+bool ProtocolHTTP::CompleteResponse() {
+  _state->response.ResetState();
+  _state->request.ResetState();
+  _state->need_to_close   = not _state->keep_connection;
+  _state->keep_connection = false;
+  if (_state->need_to_close || _state->pending.size() == 0) {
+    _state->pending.clear();
+    return false;
+  }
+  // очередной запрос уже получен, ответ на него отправляется сразу после
+  // текущего, что сохраняет порядок ответов
+  ArrayOfData next_req;
+  next_req.swap(_state->pending);
+  return not HandleRequest(&next_req[0], next_req.size());
+}
+
 USize ProtocolHTTP::PrepareResponse(Byte *data, USize size) {
   const USize kSize = GetResponse(data, size, &_state->response);
   if (kSize == 0) {
-    _state->response.ResetState();
-    _state->request.ResetState();
-    _state->need_to_close = true;
+    if (not CompleteResponse()) {
+      return 0;
+    }
+    return PrepareResponse(data, size);
   }
   return kSize;
 }
 
+bool ProtocolHTTP::PrepareResponseChunks(Chunks *out) {
+  if (out == 0) {
+    return false;
+  }
+  if (GetResponse(out, &_state->response) == 0 && CompleteResponse()) {
+    return PrepareResponseChunks(out);
+  }
+  return true;
+}
+
 bool ProtocolHTTP::NeedToCloseSession() const {
   return _state->need_to_close;
 }
+
+bool ProtocolHTTP::IsHeaderReceived() const {
+  return _state->request.GetHeader().complete;
+}
+
+bool ProtocolHTTP::Reset() {
+  _state->request.ResetState();
+  _state->response.ResetState();
+  _state->pending.clear();
+  _state->need_to_close   = false;
+  _state->keep_connection = false;
+  _state->requests_amount = 0;
+  return true;
+}
 // ServerHttp ------------------------------------------------------------------
 ServerHttp::ServerHttp(ProtocolHTTP::Router::Ptr router)
     : Server(), _router(router) {
+  SetIdleTimeout(_keep_alive.timeout);
 }
 
 ServerHttp::~ServerHttp() {
 }
 
+void ServerHttp::SetKeepAlive(const ProtocolHTTP::KeepAlive &keep_alive) {
+  _keep_alive = keep_alive;
+  SetIdleTimeout(_keep_alive.timeout);
+}
+
+void ServerHttp::SetRequestLimits(const ProtocolHTTP::RequestLimits &limits) {
+  _request_limits = limits;
+}
+
 Protocol* ServerHttp::InitProtocol() {
-  return new ProtocolHTTP(_router);
+  return new ProtocolHTTP(_router, _keep_alive, _request_limits);
+}
+
+std::string ServerHttp::InitOverloadResponse() {
+  std::stringstream resp;
+  resp << "HTTP/1.1 " << GetResponseStatus(ProtocolHTTP::k503) << "\r\n"
+       << "Content-Length: 0\r\n"
+       << "Retry-After: 1\r\n"
+       << "Connection: close\r\n"
+       << "\r\n";
+  return resp.str();
 }
 
 } // namespace webapp
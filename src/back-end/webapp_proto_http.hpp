@@ -13,10 +13,13 @@
 #include <list>
 #include <vector>
 #include <map>
-#include <fstream>
+#include <sstream>
+#include <boost/utility/string_ref.hpp>
 
 namespace webapp {
 
+class Arena;
+
 // https://tools.ietf.org/html/rfc3986#section-3.1
 class AbsoluteUri {
   public:
@@ -26,6 +29,7 @@ class AbsoluteUri {
 
     const std::string& get_scheme() const;
   protected:
+    bool   ParseScheme(boost::string_ref val);
     void   set_offset(size_t val);
     size_t get_offset() const;
   private:
@@ -36,6 +40,7 @@ class AbsoluteUri {
 class ProtocolHTTP : public Protocol {
   public:
     typedef std::list<std::string> ListOfString;
+    typedef std::vector<Byte>      ArrayOfData;
     // https://www.w3.org/Protocols/rfc2616/rfc2616-sec5.html#sec5.1.1
     enum Method {
       kUnknown,
@@ -59,9 +64,13 @@ class ProtocolHTTP : public Protocol {
       k400 = 400, // Bad Request
       k403 = 403, // Forbidden
       k404 = 404, // Not Found
+      k413 = 413, // Payload Too Large
+      k414 = 414, // URI Too Long
+      k431 = 431, // Request Header Fields Too Large
 
       k500 = 500, // Internal Server Error
       k501 = 501, // Not Implemented
+      k503 = 503, // Service Unavailable
       k505 = 505  // HTTP Version Not Supported
     }; // enum Code
 
@@ -69,9 +78,67 @@ class ProtocolHTTP : public Protocol {
       public:
         // https://tools.ietf.org/html/rfc3986#section-3.3
         typedef std::vector<std::string>            Path;
-        // https://tools.ietf.org/html/rfc3986#section-3.4
-        typedef std::map<std::string, std::string>  Query;
-        typedef std::pair<std::string, std::string> QueryParam;
+        /**
+         * Параметры строки запроса (https://tools.ietf.org/html/rfc3986#section-3.4)
+         * хранятся участками строки запроса и декодируются только при
+         * обращении к ним. Ключи могут повторяться. Строка запроса копируется
+         * в арену запроса (см. Parse), без выделения памяти из кучи, а
+         * участки первых kInlineParams параметров хранятся в самом Query.
+         */
+        class Query {
+          public:
+            static const unsigned kInlineParams = 8;
+
+            Query();
+            // копия владеет строкой запроса, арена могла быть уже сброшена
+            Query(const Query &src);
+            Query& operator= (const Query &src);
+            size_t size() const;
+            // ключ и значение параметра по номеру, в порядке следования
+            void   GetParam(size_t id, std::string *key, std::string *value) const;
+            // первое значение по ключу, false - ключа нет
+            bool   Find(const std::string &key, std::string *value) const;
+            // все значения по ключу, @return  их количество
+            size_t FindAll(const std::string &key, ListOfString *values) const;
+            // первое значение по ключу, либо пустая строка
+            std::string Get(const std::string &key) const;
+            /**
+             * Значение, приведённое к типу. false - ключа нет, либо значение
+             * не является числом (true/false или 1/0 для bool), тогда value
+             * не изменяется.
+             */
+            bool   Get(const std::string &key, int64_t *value) const;
+            bool   Get(const std::string &key, double *value) const;
+            bool   Get(const std::string &key, bool *value) const;
+          private:
+            friend class Uri;
+            // участки строки _data: ключ [from, equal), значение (equal, to)
+            struct Param {
+              uint32_t from;
+              uint32_t equal;
+              uint32_t to;
+              bool     escaped;
+            };
+
+            void Reset(const char *data, size_t size, Arena *arena);
+            void Add(size_t from, size_t equal, size_t to, bool escaped);
+            const Param& At(size_t id) const;
+            // поиск начинается с параметра *id
+            bool FindParam(const std::string &key, size_t *id) const;
+            void Decode(size_t from, size_t to, bool escaped, std::string *out) const;
+            // участок значения без копирования, если оно не требует декодирования
+            bool FindValue(const std::string &key,
+                           const char       **data,
+                           size_t            *size,
+                           std::string       *buff) const;
+
+            const char        *_data;   // строка запроса, в арене, либо в _own
+            size_t             _length;
+            std::string        _own;    // строка запроса, если арены нет
+            size_t             _size;
+            Param              _inline[kInlineParams];
+            std::vector<Param> _more;
+        }; // class Query
 
         // https://tools.ietf.org/html/rfc3986#section-3.2
         struct Authority {
@@ -83,16 +150,22 @@ class ProtocolHTTP : public Protocol {
         Uri();
         virtual ~Uri();
         virtual bool ParseVal(const std::string &val);
+        /**
+         * Разбор участка строки без его копирования. Строка запроса
+         * копируется в арену, которая должна пережить Uri (или его повторный
+         * разбор). Без арены строка хранится в самом Uri.
+         */
+        bool Parse(boost::string_ref val, Arena *arena);
 
         const Authority&   get_authority() const;
         const Path&        get_path() const;
         const Query&       get_query() const;
         const std::string& get_fragment() const;
       private:
-        bool CheckAuthority(const std::string &val);
-        bool CheckPath(const std::string &val);
-        bool CheckQuery(const std::string &val);
-        bool CheckFragment(const std::string &val);
+        bool CheckAuthority(boost::string_ref val);
+        bool CheckPath(boost::string_ref val);
+        bool CheckQuery(boost::string_ref val, Arena *arena);
+        bool CheckFragment(boost::string_ref val);
 
         Authority   _authority;
         Path        _path;
@@ -138,7 +211,6 @@ class ProtocolHTTP : public Protocol {
       Type         type;
       ListOfString encoding; // https://tools.ietf.org/html/rfc7231#section-3.1.2.2
       ListOfString language; // https://tools.ietf.org/html/rfc7231#section-3.1.3.2
-      Uri          location; // https://tools.ietf.org/html/rfc7231#section-3.1.4.2
       USize        length;   // https://tools.ietf.org/html/rfc7230#section-3.3.2
       Disposition  disposition;
     }; // struct Content
@@ -181,13 +253,57 @@ class ProtocolHTTP : public Protocol {
       private:
         std::string _value;
     };
+    // Cookie: https://tools.ietf.org/html/rfc6265#section-5.4
+    typedef std::map<std::string, std::string> Cookies;
+    /**
+     * Диапазон байт из поля Range: https://tools.ietf.org/html/rfc7233#section-2.1
+     * Отсутствующая граница равна -1: "500-" - {500, -1}, а "-500" (последние
+     * 500 байт) - {-1, 500}.
+     */
+    struct ByteRange {
+      ByteRange(int64_t f, int64_t l): first(f), last(l) {}
+      int64_t first;
+      int64_t last;
+    };
+    typedef std::vector<ByteRange> ByteRanges;
+    // Постоянные соединения: https://tools.ietf.org/html/rfc7230#section-6.3
+    struct KeepAlive {
+      KeepAlive(): max_requests(100), timeout(5) {}
+      KeepAlive(USize max_req, USize tmout)
+          : max_requests(max_req), timeout(tmout) {}
+      USize max_requests; // 0 - без ограничений, 1 - соединение не сохраняется
+      USize timeout;      // секунд простоя, до закрытия соединения
+    };
+    /**
+     * Ограничения размеров запроса, 0 - без ограничений. Превышение
+     * завершает разбор запроса ответом 414, 431 или 413 соответственно.
+     * memory учитывает только данные тела, которые хранятся в памяти (поля
+     * в StorageInMem и ключи формы), по этому действует и по умолчанию, а
+     * данные в хранилищах Request::UseStorageGenerator ограничивает body.
+     */
+    struct RequestLimits {
+      static const USize kDefMemory = 8 * 1024 * 1024;
+
+      RequestLimits()
+          : line(8 * 1024), header(64 * 1024), body(0), memory(kDefMemory) {}
+      RequestLimits(USize line_max,
+                    USize header_max,
+                    USize body_max,
+                    USize memory_max = kDefMemory)
+          : line(line_max), header(header_max), body(body_max), memory(memory_max) {}
+      USize line;   // байт в строке запроса или в строке поля заголовка
+      USize header; // байт в заголовке целиком
+      USize body;   // байт в теле запроса (после снятия chunked)
+      USize memory; // байт тела, хранимых в памяти
+    };
 
     struct Header {
       Header(): age(0), complete(false) {}
       Line         line;
       std::string  user_agent;
       std::string  host;
-      Accept       accept;
+      std::string  connection; // https://tools.ietf.org/html/rfc7230#section-6.1
+      ListOfString transfer_encoding; // https://tools.ietf.org/html/rfc7230#section-3.3.1
       USize        age; // https://tools.ietf.org/html/rfc7234#section-5.1
       Content      content;
       Expires      expires;
@@ -251,6 +367,7 @@ class ProtocolHTTP : public Protocol {
             template <typename Type>
             bool                 get_value(Type *out) const;
             const Content::Type& get_type() const;
+            void                 set_type(const Content::Type &type);
 
             bool               IsNull() const;
             USize              Size() const;
@@ -272,15 +389,49 @@ class ProtocolHTTP : public Protocol {
         const Header& GetHeader() const;
         void UseStorageGenerator(Field::Storage::Generator generator);
         bool Completed() const;
-        const std::string& Get(const std::string &name) const;
+        /**
+         * Код ответа на запрос, разбор которого завершился ошибкой (400, 413,
+         * 414, 431, 501, 505), либо k200 если ошибок не было.
+         */
+        Code GetError() const;
+        /**
+         * Поле заголовка в исходном виде, имя без учёта регистра. Значения
+         * повторных полей объединяются через ", ".
+         */
+        bool GetField(const std::string &name, std::string *value) const;
+        /**
+         * Поля, которые разбираются только при первом обращении, результат
+         * сохраняется до завершения запроса. В Header их нет.
+         */
+        const Accept&       GetAccept() const;
+        const Uri&          GetContentLocation() const;
+        const Cookies&      GetCookies() const;
+        // метки в кавычках, как в ETag::get_directive, либо "*"
+        const ListOfString& GetIfNoneMatch() const;
+        // пусто - поля нет, либо оно ошибочно
+        const ByteRanges&   GetRanges() const;
+        // значение параметра строки запроса, либо пустая строка
+        std::string Get(const std::string &name) const;
         template <typename GetType>
         GetType Get(const std::string &name, const GetType &def_val) const;
         const Field* Post(const std::string &name) const;
+        /**
+         * Тело запроса, которое не является формой (multipart/* или
+         * application/x-www-form-urlencoded, их поля доступны через Post).
+         * Хранилище выбирается генератором из UseStorageGenerator.
+         * @return  0, если тела нет
+         */
+        const Field* GetBody() const;
       private:
         friend class ProtocolHTTP;
-
+        /**
+         * Состояние разбора запроса размещается в арене запроса, по этому
+         * сброс состояния освобождает всю его память одной операцией.
+         */
         void ResetState();
+        void InitState();
 
+        Arena *_arena;
         State *_state;
     }; // class Request
 
@@ -297,6 +448,11 @@ class ProtocolHTTP : public Protocol {
             virtual bool  IsAvailable() const = 0;
             virtual USize Size() const = 0;
             virtual USize ReadSome(Byte *out, USize max_size) = 0;
+            /**
+             * Непрерывный участок оставшихся данных без копирования, участок
+             * считается прочитанным. false - источник этого не поддерживает.
+             */
+            virtual bool  ReadChunk(Chunk *out, USize max_size);
         };
 
         class SourceFromFile : public Source {
@@ -306,9 +462,19 @@ class ProtocolHTTP : public Protocol {
             virtual bool  IsAvailable() const;
             virtual USize Size() const;
             virtual USize ReadSome(Byte *out, USize max_size);
+            /**
+             * Фрагмент ссылается на участок файла (Chunk::file), который
+             * сессия отправляет средствами ядра (sendfile), без копирования.
+             */
+            virtual bool  ReadChunk(Chunk *out, USize max_size);
           private:
-            std::fstream _file;
-            USize        _file_size;
+            SourceFromFile(const SourceFromFile&);
+            void operator= (const SourceFromFile&);
+
+            int   _file;
+            USize _file_size;
+            USize _offset;
+            bool  _finished;
         };
 
         class SourceFromStream : public Source {
@@ -319,9 +485,10 @@ class ProtocolHTTP : public Protocol {
             virtual bool  IsAvailable() const;
             virtual USize Size() const;
             virtual USize ReadSome(Byte *out, USize max_size);
+            virtual bool  ReadChunk(Chunk *out, USize max_size);
           private:
-            std::stringstream _buff;
-            USize             _buff_size;
+            std::string _buff;
+            USize       _offset;
         };
 
         class SourceFromArray : public Source {
@@ -331,6 +498,7 @@ class ProtocolHTTP : public Protocol {
             virtual bool  IsAvailable() const;
             virtual USize Size() const;
             virtual USize ReadSome(Byte *out, USize max_size);
+            virtual bool  ReadChunk(Chunk *out, USize max_size);
           private:
             const Byte *_data;
             USize       _size;
@@ -405,19 +573,57 @@ class ProtocolHTTP : public Protocol {
     }; // class Router
 
     static void DecodeString(const std::string &in, char label, std::string *out);
+    /**
+     * Декодирование участка [in, in + size): "<label>XX" заменяется байтом, а
+     * при form ещё и '+' пробелом (application/x-www-form-urlencoded).
+     * Ошибочные последовательности копируются как есть. Результат не длиннее
+     * исходных данных, по этому out может совпадать с in (декодирование на
+     * месте, например в буфере запроса).
+     * @return  размер результата
+     */
+    static size_t DecodeString(const char *in,
+                               size_t      size,
+                               char        label,
+                               bool        form,
+                               char       *out);
 
     ProtocolHTTP(Router::Ptr router);
+    ProtocolHTTP(Router::Ptr          router,
+                 const KeepAlive     &keep_alive,
+                 const RequestLimits &limits = RequestLimits());
     virtual ~ProtocolHTTP();
 
-    bool  ParseRequest(Byte *req_bytes, size_t size, Request *out);
+    /**
+     * Разбор очередной порции запроса. Разбор продолжается с того места, где
+     * остановилась предыдущая порция, граница порций может приходиться на
+     * любой байт: строка запроса, поля заголовка, тело по Content-Length
+     * либо в кодировке chunked.
+     * @param used  количество байт, которые относятся к запросу. Если запрос
+     *              завершён раньше конца массива, то оставшиеся байты
+     *              принадлежат следующему запросу (HTTP pipelining).
+     * @return      false - запрос ошибочен, код ответа в Request::GetError
+     */
+    bool  ParseRequest(Byte *req_bytes, size_t size, Request *out,
+                       size_t *used = 0);
     USize GetResponse(Byte *out_resp_bytes, size_t out_size, Response *resp);
+    /**
+     * Очередная часть ответа в виде фрагментов: заголовок и данные тела
+     * передаются без копирования, если источник это допускает.
+     * @return  общий размер фрагментов
+     */
+    USize GetResponse(Chunks *out, Response *resp);
 
     virtual bool  HandleRequest(Byte *data, USize size);
     virtual USize PrepareResponse(Byte *data, USize size);
     virtual bool  NeedToCloseSession() const;
+    virtual bool  PrepareResponseChunks(Chunks *out);
+    virtual bool  IsHeaderReceived() const;
+    virtual bool  Reset();
   private:
     struct State;
 
+    bool CompleteResponse();
+
     ProtocolHTTP(const ProtocolHTTP&);
     void operator= (const ProtocolHTTP&);
 
@@ -428,10 +634,21 @@ class ServerHttp : public Server {
   public:
     ServerHttp(ProtocolHTTP::Router::Ptr router);
     virtual ~ServerHttp();
+    /**
+     * Настройки постоянных соединений, применяются к новым сессиям.
+     * Время простоя соединения также передаётся в Server::SetIdleTimeout.
+     */
+    void SetKeepAlive(const ProtocolHTTP::KeepAlive &keep_alive);
+    // применяются к новым сессиям
+    void SetRequestLimits(const ProtocolHTTP::RequestLimits &limits);
   protected:
-    virtual Protocol* InitProtocol();
+    virtual Protocol*   InitProtocol();
+    // "503 Service Unavailable" с закрытием соединения
+    virtual std::string InitOverloadResponse();
 
-    ProtocolHTTP::Router::Ptr _router;
+    ProtocolHTTP::Router::Ptr   _router;
+    ProtocolHTTP::KeepAlive     _keep_alive;
+    ProtocolHTTP::RequestLimits _request_limits;
 }; // class ServerHttp
 
 } // namespace webapp
@@ -0,0 +1,1122 @@
+/*
+ * webapp_proto_uring.cpp
+ *
+ *  Created on: 18 окт. 2026 г.
+ */
+
+#include "webapp_proto_uring.hpp"
+#include "webapp_timing_wheel.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#if defined(WEBAPP_WITH_IO_URING)
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace webapp {
+
+#if defined(WEBAPP_WITH_IO_URING)
+
+static int SysUringSetup(unsigned entries, io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int SysUringEnter(int fd, unsigned to_submit, unsigned min_complete) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                 min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+}
+
+static Inspector::Error ErrorOf(int err_no) {
+  return Inspector::Error(err_no, boost::system::system_category());
+}
+/**
+ * Кольца отправки и получения событий io_uring, отображённые в память
+ * процесса. Используется одним потоком.
+ */
+class UringService::Ring {
+  public:
+    Ring()
+        : _fd(-1),
+          _ring(MAP_FAILED),
+          _ring_size(0),
+          _sqes(0),
+          _sqes_size(0),
+          _sq_tail_local(0) {
+    }
+
+    ~Ring() {
+      Close();
+    }
+    /**
+     * Закрытие кольца: ядро отменяет все незавершённые операции, после чего
+     * оно больше не обращается к памяти процесса (буферам, сессиям).
+     */
+    void Close() {
+      if (_sqes != 0) {
+        munmap(_sqes, _sqes_size);
+        _sqes = 0;
+      }
+      if (_ring != MAP_FAILED) {
+        munmap(_ring, _ring_size);
+        _ring = MAP_FAILED;
+      }
+      if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+      }
+    }
+
+    bool Init(unsigned entries) {
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+      _fd = SysUringSetup(entries, &params);
+      if (_fd < 0) {
+        return false;
+      }
+      // IORING_FEAT_FAST_POLL появился в 5.7, вместе с provided buffers и splice
+      if (not (params.features & IORING_FEAT_SINGLE_MMAP) ||
+          not (params.features & IORING_FEAT_FAST_POLL)) {
+        return false;
+      }
+      const size_t kSqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      const size_t kCqSize = params.cq_off.cqes +
+                             params.cq_entries * sizeof(io_uring_cqe);
+      _ring_size = (kSqSize > kCqSize ? kSqSize : kCqSize);
+      _ring = mmap(0, _ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+      if (_ring == MAP_FAILED) {
+        return false;
+      }
+      _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      void *sqes = mmap(0, _sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+      if (sqes == MAP_FAILED) {
+        return false;
+      }
+      _sqes = static_cast<io_uring_sqe*>(sqes);
+      char *base = static_cast<char*>(_ring);
+      _sq_head  = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+      _sq_tail  = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+      _sq_mask  = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+      _sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+      _cq_head  = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+      _cq_tail  = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+      _cq_mask  = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+      _cqes     = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+      _entries  = params.sq_entries;
+      _sq_tail_local = *_sq_tail;
+      return true;
+    }
+
+    // место для amount операций подряд (например, связанных IOSQE_IO_LINK)
+    bool Reserve(unsigned amount) {
+      if (_sq_tail_local - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) + amount > _entries) {
+        Submit(0);
+      }
+      return (_sq_tail_local - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) + amount <= _entries);
+    }
+
+    io_uring_sqe* GetSqe() {
+      if (_sq_tail_local - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _entries) {
+        Submit(0);
+        if (_sq_tail_local - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _entries) {
+          return 0;
+        }
+      }
+      const unsigned kIndex = _sq_tail_local & _sq_mask;
+      io_uring_sqe *sqe = &_sqes[kIndex];
+      memset(sqe, 0, sizeof(*sqe));
+      _sq_array[kIndex] = kIndex;
+      _sq_tail_local++;
+      return sqe;
+    }
+
+    int Submit(unsigned wait_amount) {
+      const unsigned kToSubmit = _sq_tail_local - *_sq_tail;
+      __atomic_store_n(_sq_tail, _sq_tail_local, __ATOMIC_RELEASE);
+      int res = 0;
+      do {
+        res = SysUringEnter(_fd, kToSubmit, wait_amount);
+      } while (res < 0 && errno == EINTR);
+      return res;
+    }
+
+    bool PopCqe(io_uring_cqe *out) {
+      const unsigned kHead = *_cq_head;
+      if (kHead == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+      }
+      *out = _cqes[kHead & _cq_mask];
+      __atomic_store_n(_cq_head, kHead + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+  private:
+    int           _fd;
+    void         *_ring;
+    size_t        _ring_size;
+    io_uring_sqe *_sqes;
+    size_t        _sqes_size;
+    unsigned      _entries;
+    unsigned     *_sq_head;
+    unsigned     *_sq_tail;
+    unsigned      _sq_mask;
+    unsigned     *_sq_array;
+    unsigned      _sq_tail_local;
+    unsigned     *_cq_head;
+    unsigned     *_cq_tail;
+    unsigned      _cq_mask;
+    io_uring_cqe *_cqes;
+};
+/**
+ * Цикл обработки событий одного потока: кольцо, приёмник подключений,
+ * буферы чтения и сессии. Циклы ничего не разделяют между собой.
+ */
+class UringService::Loop {
+  public:
+    // операция, номер сессии (или приёмника) хранится в старших битах user_data
+    enum Op {
+      kAccept = 1,
+      kRecv,
+      kSend,
+      kSpliceIn,
+      kSpliceOut,
+      kProvide,
+      kTick,
+      kReject,
+      kDiscard,
+      kDiscardTimeout
+    };
+    // стадия обслуживания, определяет ограничение времени
+    enum Stage {
+      kIdle,
+      kHeader,
+      kBody,
+      kWrite,
+      kLinger
+    };
+
+    struct Session;
+    typedef TimingWheel<Session*> Wheel;
+    // приёмник подключений по одному из адресов сервера
+    struct Listener {
+      Listener(): fd(-1), tcp(true), multishot(true), paused(false) {}
+      int  fd;
+      bool tcp;       // IPv4 или IPv6, применимы настройки TCP
+      bool multishot;
+      bool paused;
+    };
+
+    struct Session {
+      Session()
+          : id(0),
+            fd(-1),
+            tcp(true),
+            stage(kIdle),
+            in_flight(0),
+            closing(false),
+            starved(false),
+            uses_chunks(false),
+            next_chunk(0),
+            need_to_send(0),
+            was_sended(0),
+            piped(0) {
+        pipe[0] = pipe[1] = -1;
+        memset(&msg, 0, sizeof(msg));
+      }
+
+      ~Session() {
+        if (pipe[0] >= 0) {
+          close(pipe[0]);
+          close(pipe[1]);
+        }
+      }
+
+      USize                  id;
+      int                    fd;
+      bool                   tcp;
+      Stage                  stage;
+      Wheel::Handle          deadline;
+      USize                  in_flight; // операций в кольце
+      bool                   closing;
+      bool                   starved;   // ядру не хватило буферов чтения
+      Protocol::Ptr          protocol;
+      bool                   uses_chunks;
+      Protocol::Chunks       chunks;
+      size_t                 next_chunk;
+      std::vector<iovec>     iov;
+      msghdr                 msg;
+      Protocol::ArrayOfBytes buff;
+      USize                  need_to_send;
+      USize                  was_sended;
+      int                    pipe[2];
+      USize                  piped;
+    };
+
+    static const unsigned kRingEntries   = 1024;
+    static const USize    kBuffersAmount = 256;
+    static const USize    kBufferSize    = 16 * 1024;
+    static const uint16_t kBuffersGroup  = 1;
+    static const USize    kSpliceSize    = 64 * 1024;
+    static const USize    kDiscardSize   = 4 * 1024;
+    static const USize    kLingerTimeout = 1; // секунд чтения данных клиента перед закрытием
+
+    /**
+     * @param first  первый цикл, с которым разделяются сокеты Unix (ядро не
+     *               распределяет их подключения через SO_REUSEPORT),
+     *               0 - сокеты открывает сам цикл
+     */
+    Loop(const Settings &settings, bool reuse_port, const Loop *first)
+        : _settings(settings),
+          _reuse_port(reuse_port),
+          _first(first),
+          _buffers(new Protocol::Byte[kBuffersAmount * kBufferSize]),
+          _discard(new Protocol::Byte[kDiscardSize]),
+          _listeners(settings.endpoints.size()),
+          _opened(0) {
+      _tick.tv_sec    = 0;
+      _tick.tv_nsec   = Wheel::kTickMs * 1000000;
+      _linger.tv_sec  = kLingerTimeout;
+      _linger.tv_nsec = 0;
+    }
+
+    ~Loop() {
+      // сначала кольцо: операции сессий ссылаются на их буферы и каналы
+      _ring.Close();
+      for (size_t id = 0; id < _sessions.size(); id++) {
+        _deadlines.Cancel(&_sessions[id]->deadline);
+        if (_sessions[id]->fd >= 0) {
+          close(_sessions[id]->fd);
+        }
+        delete _sessions[id];
+      }
+      for (size_t id = 0; id < _listeners.size(); id++) {
+        if (_listeners[id].fd >= 0) {
+          close(_listeners[id].fd);
+        }
+      }
+    }
+
+    bool Start() {
+      if (not _ring.Init(kRingEntries)) {
+        return false;
+      }
+      for (USize id = 0; id < _listeners.size(); id++) {
+        if (not Listen(id)) {
+          return false;
+        }
+      }
+      io_uring_sqe *sqe = _ring.GetSqe();
+      sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd        = kBuffersAmount;
+      sqe->addr      = reinterpret_cast<uint64_t>(_buffers.get());
+      sqe->len       = kBufferSize;
+      sqe->off       = 0;
+      sqe->buf_group = kBuffersGroup;
+      sqe->user_data = kProvide;
+      for (USize id = 0; id < _listeners.size(); id++) {
+        PostAccept(id);
+      }
+      PostTick();
+      return (_ring.Submit(0) >= 0);
+    }
+    /**
+     * Отправка подготовленных операций и обработка готовых событий.
+     * @param wait  ждать хотя бы одного события (не дольше шага таймеров)
+     */
+    void RunOnce(bool wait) {
+      _ring.Submit(wait ? 1 : 0);
+      io_uring_cqe cqe;
+      while (_ring.PopCqe(&cqe)) {
+        HandleCqe(cqe);
+      }
+    }
+  private:
+    // адрес в виде sockaddr, адреса проверены при вызове Server::BindTo
+    static socklen_t ToSockAddr(const Server::Endpoint &endpoint,
+                                sockaddr_storage       *dst) {
+      memset(dst, 0, sizeof(*dst));
+      if (endpoint.family == Server::Endpoint::kLocal) {
+        sockaddr_un *addr = reinterpret_cast<sockaddr_un*>(dst);
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, endpoint.address.c_str(),
+                sizeof(addr->sun_path) - 1);
+        return sizeof(*addr);
+      }
+      if (endpoint.family == Server::Endpoint::kIPv6) {
+        sockaddr_in6 *addr = reinterpret_cast<sockaddr_in6*>(dst);
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port   = htons(endpoint.port);
+        inet_pton(AF_INET6, endpoint.address.c_str(), &addr->sin6_addr);
+        return sizeof(*addr);
+      }
+      sockaddr_in *addr = reinterpret_cast<sockaddr_in*>(dst);
+      addr->sin_family = AF_INET;
+      addr->sin_port   = htons(endpoint.port);
+      inet_pton(AF_INET, endpoint.address.c_str(), &addr->sin_addr);
+      return sizeof(*addr);
+    }
+
+    bool Listen(USize id) {
+      const Server::Endpoint &kEndpoint = _settings.endpoints[id];
+      Listener               &listener  = _listeners[id];
+      listener.tcp = (kEndpoint.family != Server::Endpoint::kLocal);
+      if (_first != 0 && not listener.tcp) {
+        listener.fd = fcntl(_first->_listeners[id].fd, F_DUPFD_CLOEXEC, 0);
+        return (listener.fd >= 0);
+      }
+      sockaddr_storage addr;
+      const socklen_t  kAddrSize = ToSockAddr(kEndpoint, &addr);
+      listener.fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (listener.fd < 0) {
+        return false;
+      }
+      const int kOn = 1;
+      setsockopt(listener.fd, SOL_SOCKET, SO_REUSEADDR, &kOn, sizeof(kOn));
+      if (_reuse_port && listener.tcp) {
+        setsockopt(listener.fd, SOL_SOCKET, SO_REUSEPORT, &kOn, sizeof(kOn));
+      }
+      if (addr.ss_family == AF_INET6) {
+        setsockopt(listener.fd, IPPROTO_IPV6, IPV6_V6ONLY, &kOn, sizeof(kOn));
+      }
+      const Server::SocketOptions &kOpts = _settings.socket_options;
+      SetBuffersSize(listener.fd);
+      if (bind(listener.fd, reinterpret_cast<sockaddr*>(&addr), kAddrSize) != 0) {
+        _settings.inspector->RegisterError("Ошибка открытия порта", ErrorOf(errno));
+        return false;
+      }
+      if (kOpts.defer_accept > 0 && listener.tcp) {
+        SetOption(listener.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, kOpts.defer_accept,
+                  "TCP_DEFER_ACCEPT");
+      }
+      if (kOpts.fast_open > 0 && listener.tcp) {
+        SetOption(listener.fd, IPPROTO_TCP, TCP_FASTOPEN, kOpts.fast_open,
+                  "TCP_FASTOPEN");
+      }
+      if (listen(listener.fd, kOpts.backlog > 0 ? kOpts.backlog : SOMAXCONN) != 0) {
+        _settings.inspector->RegisterError("Ошибка открытия порта", ErrorOf(errno));
+        return false;
+      }
+      return true;
+    }
+
+    void SetOption(int fd, int level, int name, int value, const char *title) {
+      if (setsockopt(fd, level, name, &value, sizeof(value)) != 0) {
+        _settings.inspector->RegisterError(
+          std::string("Ошибка настройки сокета ") + title, ErrorOf(errno));
+      }
+    }
+
+    void SetBuffersSize(int fd) {
+      const Server::SocketOptions &kOpts = _settings.socket_options;
+      if (kOpts.send_buffer > 0) {
+        SetOption(fd, SOL_SOCKET, SO_SNDBUF, kOpts.send_buffer, "SO_SNDBUF");
+      }
+      if (kOpts.receive_buffer > 0) {
+        SetOption(fd, SOL_SOCKET, SO_RCVBUF, kOpts.receive_buffer, "SO_RCVBUF");
+      }
+    }
+    // снятие TCP_CORK отправляет накопленный неполный сегмент
+    void SetCork(Session *sess, bool enable) {
+      if (_settings.socket_options.cork && sess->tcp) {
+        SetOption(sess->fd, IPPROTO_TCP, TCP_CORK, enable, "TCP_CORK");
+      }
+    }
+
+    static uint64_t UserData(USize id, Op op) {
+      return (static_cast<uint64_t>(id) << 8) | op;
+    }
+
+    io_uring_sqe* GetSqe(Session *sess, Op op) {
+      io_uring_sqe *sqe = _ring.GetSqe();
+      if (sqe == 0) {
+        return 0;
+      }
+      sqe->user_data = UserData(sess == 0 ? 0 : sess->id, op);
+      if (sess != 0) {
+        sess->in_flight++;
+      }
+      return sqe;
+    }
+
+    void PostAccept(USize listener_id) {
+      io_uring_sqe *sqe = _ring.GetSqe();
+      if (sqe == 0) {
+        return;
+      }
+      sqe->user_data    = UserData(listener_id, kAccept);
+      sqe->opcode       = IORING_OP_ACCEPT;
+      sqe->fd           = _listeners[listener_id].fd;
+      sqe->accept_flags = SOCK_CLOEXEC;
+#if defined(IORING_ACCEPT_MULTISHOT)
+      if (_listeners[listener_id].multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      }
+#endif
+    }
+
+    void PostTick() {
+      io_uring_sqe *sqe = GetSqe(0, kTick);
+      if (sqe == 0) {
+        return;
+      }
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->addr   = reinterpret_cast<uint64_t>(&_tick);
+      sqe->len    = 1;
+    }
+
+    void ProvideBuffer(uint16_t buffer_id) {
+      io_uring_sqe *sqe = GetSqe(0, kProvide);
+      if (sqe == 0) {
+        return;
+      }
+      sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd        = 1;
+      sqe->addr      = reinterpret_cast<uint64_t>(&_buffers[buffer_id * kBufferSize]);
+      sqe->len       = kBufferSize;
+      sqe->off       = buffer_id;
+      sqe->buf_group = kBuffersGroup;
+    }
+
+    void PostRecv(Session *sess) {
+      io_uring_sqe *sqe = GetSqe(sess, kRecv);
+      if (sqe == 0) {
+        Close(sess);
+        return;
+      }
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd     = sess->fd;
+      sqe->len    = kBufferSize;
+      // буфер выбирает ядро в момент получения данных, по этому ожидающие
+      // запроса сессии буферов не занимают
+      if (not sess->starved) {
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBuffersGroup;
+        return;
+      }
+      if (not sess->buff) {
+        sess->buff.reset(new Protocol::Byte[kBufferSize]);
+      }
+      sqe->addr = reinterpret_cast<uint64_t>(sess->buff.get());
+    }
+
+    void HandleCqe(const io_uring_cqe &cqe) {
+      const Op    kOp = static_cast<Op>(cqe.user_data & 0xFF);
+      const USize kId = static_cast<USize>(cqe.user_data >> 8);
+      switch (kOp) {
+        case kAccept:
+          HandleAccept(kId, cqe.res, cqe.flags);
+          return;
+        case kTick:
+          HandleTick();
+          return;
+        case kProvide:
+          if (cqe.res < 0) {
+            _settings.inspector->RegisterError("Ошибка передачи буфера ядру",
+                                               ErrorOf(-cqe.res));
+          }
+          return;
+        case kReject:
+          if (cqe.res < 0) {
+            close(kId);
+            return;
+          }
+          Discard(kId);
+          return;
+        case kDiscard:
+          close(kId);
+          return;
+        case kDiscardTimeout:
+          return;
+        default:
+          break;
+      };
+      if (kId >= _sessions.size()) {
+        return;
+      }
+      Session *sess = _sessions[kId];
+      sess->in_flight--;
+      if (sess->closing) {
+        // данные закрываемой сессии не нужны, но буфер возвращается ядру
+        if (kOp == kRecv && (cqe.flags & IORING_CQE_F_BUFFER)) {
+          ProvideBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        // учёт данных в канале, чтобы Close знал, пуст ли он
+        if (kOp == kSpliceIn && cqe.res > 0) {
+          sess->piped += cqe.res;
+        } else if (kOp == kSpliceOut && cqe.res > 0) {
+          sess->piped -= cqe.res;
+        }
+        Close(sess);
+        return;
+      }
+      switch (kOp) {
+        case kRecv:
+          HandleRecv(sess, cqe.res, cqe.flags);
+          break;
+        case kSend:
+          HandleSend(sess, cqe.res);
+          break;
+        case kSpliceIn:
+          HandleSpliceIn(sess, cqe.res);
+          break;
+        case kSpliceOut:
+          HandleSpliceOut(sess, cqe.res);
+          break;
+        default:
+          break;
+      };
+    }
+
+    void HandleAccept(USize listener_id, int res, unsigned flags) {
+      Listener &listener = _listeners[listener_id];
+#if defined(IORING_CQE_F_MORE)
+      const bool kRearm = not (flags & IORING_CQE_F_MORE);
+#else
+      const bool kRearm = true;
+      (void)flags;
+#endif
+      if (res == -EINVAL && listener.multishot) {
+        // ядро старше 5.19, подключения принимаются по одному
+        listener.multishot = false;
+        PostAccept(listener_id);
+        return;
+      }
+      if (res < 0) {
+        _settings.inspector->RegisterError("Ошибка подключения", ErrorOf(-res));
+        // например, исчерпаны файловые дескрипторы, повтор на следующем шаге
+        listener.paused = kRearm;
+        return;
+      }
+      if (kRearm) {
+        PostAccept(listener_id);
+      }
+      _settings.inspector->RegisterMessage("Обнаружено подключение! Создание сессии...");
+      if (_settings.limits.sessions > 0 && _opened >= _settings.limits.sessions) {
+        Reject(res);
+        return;
+      }
+      if (_settings.socket_options.no_delay && listener.tcp) {
+        SetOption(res, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+      }
+      SetBuffersSize(res);
+      Session *sess = AcquireSession();
+      sess->fd  = res;
+      sess->tcp = listener.tcp;
+      if (not sess->protocol || not sess->protocol->Reset()) {
+        sess->protocol.reset(_settings.factory());
+      }
+      if (not sess->protocol) {
+        Close(sess);
+        return;
+      }
+      SetDeadline(sess, kIdle);
+      PostRecv(sess);
+    }
+    /**
+     * Отправка заранее подготовленного ответа о перегрузке, сокет
+     * закрывается после отправки.
+     */
+    void Reject(int fd) {
+      _settings.inspector->RegisterMessage("Сервер перегружен, подключение отклонено");
+      io_uring_sqe *sqe = (_settings.overload_response.size() == 0 ? 0 :
+                           _ring.GetSqe());
+      if (sqe == 0) {
+        close(fd);
+        return;
+      }
+      sqe->opcode    = IORING_OP_SEND;
+      sqe->fd        = fd;
+      sqe->addr      = reinterpret_cast<uint64_t>(_settings.overload_response.data());
+      sqe->len       = _settings.overload_response.size();
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = UserData(fd, kReject);
+    }
+
+    /**
+     * Чтение данных отклонённого подключения перед закрытием (см. Linger),
+     * одной операцией, ограниченной по времени связанным таймером.
+     */
+    void Discard(int fd) {
+      // чтение без таймера ждало бы клиента неограниченно долго
+      if (shutdown(fd, SHUT_WR) != 0 || not _ring.Reserve(2)) {
+        close(fd);
+        return;
+      }
+      io_uring_sqe *recv_sqe = _ring.GetSqe();
+      recv_sqe->opcode    = IORING_OP_RECV;
+      recv_sqe->fd        = fd;
+      recv_sqe->addr      = reinterpret_cast<uint64_t>(_discard.get());
+      recv_sqe->len       = kDiscardSize;
+      recv_sqe->flags     = IOSQE_IO_LINK;
+      recv_sqe->user_data = UserData(fd, kDiscard);
+      io_uring_sqe *timeout_sqe = _ring.GetSqe();
+      timeout_sqe->opcode    = IORING_OP_LINK_TIMEOUT;
+      timeout_sqe->addr      = reinterpret_cast<uint64_t>(&_linger);
+      timeout_sqe->len       = 1;
+      timeout_sqe->user_data = UserData(0, kDiscardTimeout);
+    }
+
+    Session* AcquireSession() {
+      Session *sess = 0;
+      if (_free.size() > 0) {
+        sess = _free.back();
+        _free.pop_back();
+      } else {
+        sess = new Session();
+        sess->id = _sessions.size();
+        _sessions.push_back(sess);
+      }
+      sess->closing      = false;
+      sess->starved      = false;
+      sess->in_flight    = 0;
+      sess->need_to_send = 0;
+      sess->was_sended   = 0;
+      sess->piped        = 0;
+      _opened++;
+      return sess;
+    }
+    /**
+     * Закрытие сессии. Операции, оставшиеся в кольце, завершаются после
+     * shutdown, и сессия освобождается после последней из них.
+     */
+    void Close(Session *sess) {
+      if (not sess->closing) {
+        sess->closing = true;
+        _deadlines.Cancel(&sess->deadline);
+        shutdown(sess->fd, SHUT_RDWR);
+        _settings.inspector->RegisterMessage("Удаление сессии...");
+      }
+      if (sess->in_flight > 0) {
+        return;
+      }
+      close(sess->fd);
+      sess->fd = -1;
+      // не отправленная часть файла досталась бы следующему клиенту сессии
+      if (sess->piped > 0) {
+        close(sess->pipe[0]);
+        close(sess->pipe[1]);
+        sess->pipe[0] = sess->pipe[1] = -1;
+        sess->piped   = 0;
+      }
+      sess->chunks.clear();
+      sess->buff.reset();
+      _free.push_back(sess);
+      _opened--;
+    }
+
+    void SetDeadline(Session *sess, Stage stage) {
+      static const USize Server::Timeouts::*kTimeoutOf[] = {
+        &Server::Timeouts::idle,
+        &Server::Timeouts::header,
+        &Server::Timeouts::body,
+        &Server::Timeouts::write
+      };
+      sess->stage = stage;
+      _deadlines.Arm(&sess->deadline, sess,
+                     stage == kLinger ? kLingerTimeout : _settings.timeouts.*kTimeoutOf[stage]);
+    }
+    /**
+     * Закрытие после отправленного ответа. Если закрыть сокет, когда клиент
+     * ещё передаёт данные (например, тело отклонённого запроса), то ядро
+     * ответит на них RST, и клиент может потерять не прочитанный им ответ.
+     * По этому сначала передаётся FIN, а данные клиента читаются и
+     * отбрасываются, пока он не закроет соединение, но не дольше
+     * kLingerTimeout.
+     */
+    void Linger(Session *sess) {
+      if (shutdown(sess->fd, SHUT_WR) != 0) {
+        Close(sess);
+        return;
+      }
+      sess->buff.reset();
+      SetDeadline(sess, kLinger);
+      PostRecv(sess);
+    }
+
+    void HandleTick() {
+      static const char *kMessages[] = {
+        "Превышено время ожидания запроса",
+        "Превышено время получения заголовка запроса",
+        "Превышено время получения тела запроса",
+        "Превышено время отправки ответа",
+        "Превышено время закрытия соединения"
+      };
+      _expired.clear();
+      _deadlines.Tick(&_expired);
+      Wheel::ListOfExpired::iterator it = _expired.begin();
+      for (; it != _expired.end(); it++) {
+        _settings.inspector->RegisterMessage(kMessages[it->session->stage]);
+        Close(it->session);
+      }
+      for (USize id = 0; id < _listeners.size(); id++) {
+        if (_listeners[id].paused) {
+          _listeners[id].paused = false;
+          PostAccept(id);
+        }
+      }
+      PostTick();
+    }
+
+    void HandleRecv(Session *sess, int res, unsigned flags) {
+      if (not (flags & IORING_CQE_F_BUFFER)) {
+        HandleData(sess, res, sess->buff.get());
+        return;
+      }
+      // буфер возвращается ядру только после обработки данных
+      const uint16_t kBufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+      HandleData(sess, res, &_buffers[kBufferId * kBufferSize]);
+      ProvideBuffer(kBufferId);
+    }
+
+    void HandleData(Session *sess, int res, Protocol::Byte *data) {
+      if (res == -ENOBUFS) {
+        _settings.inspector->RegisterMessage("Буферы кольца исчерпаны, чтение в буфер сессии");
+        sess->starved = true;
+        PostRecv(sess);
+        return;
+      }
+      if (res < 0) {
+        _settings.inspector->RegisterError("Ошибка чтения данных", ErrorOf(-res));
+        Close(sess);
+        return;
+      }
+      if (res == 0) {
+        Close(sess);
+        return;
+      }
+      sess->starved = false;
+      if (sess->stage == kLinger) {
+        // данные клиента после ответа отбрасываются
+        PostRecv(sess);
+        return;
+      }
+      if (sess->protocol->HandleRequest(data, res)) {
+        if (sess->protocol->IsHeaderReceived()) {
+          SetDeadline(sess, kBody);
+        } else if (sess->stage != kHeader) {
+          SetDeadline(sess, kHeader);
+        }
+        PostRecv(sess);
+        return;
+      }
+      sess->need_to_send = 0;
+      sess->was_sended   = 0;
+      SetDeadline(sess, kWrite);
+      SetCork(sess, true);
+      SendResponse(sess);
+    }
+
+    void SendResponse(Session *sess) {
+      if (sess->need_to_send == 0 &&
+          sess->protocol->PrepareResponseChunks(&sess->chunks)) {
+        sess->uses_chunks = true;
+        sess->next_chunk  = 0;
+        SendChunks(sess);
+        return;
+      }
+      sess->uses_chunks = false;
+      if (sess->need_to_send == sess->was_sended) {
+        if (not sess->buff) {
+          sess->buff.reset(new Protocol::Byte[kBufferSize]);
+        }
+        sess->need_to_send = sess->protocol->PrepareResponse(sess->buff.get(),
+                                                             kBufferSize);
+        sess->was_sended   = 0;
+      }
+      if (sess->need_to_send == 0) {
+        CompleteResponse(sess);
+        return;
+      }
+      io_uring_sqe *sqe = GetSqe(sess, kSend);
+      if (sqe == 0) {
+        Close(sess);
+        return;
+      }
+      sqe->opcode    = IORING_OP_SEND;
+      sqe->fd        = sess->fd;
+      sqe->addr      = reinterpret_cast<uint64_t>(sess->buff.get() + sess->was_sended);
+      sqe->len       = sess->need_to_send - sess->was_sended;
+      sqe->msg_flags = MSG_NOSIGNAL;
+    }
+
+    void SendChunks(Session *sess) {
+      if (sess->chunks.size() == 0) {
+        CompleteResponse(sess);
+        return;
+      }
+      if (sess->next_chunk >= sess->chunks.size()) {
+        SendResponse(sess);
+        return;
+      }
+      if (sess->chunks[sess->next_chunk].data == 0) {
+        SpliceIn(sess);
+        return;
+      }
+      sess->iov.clear();
+      size_t last = sess->next_chunk;
+      for (; last < sess->chunks.size() && sess->chunks[last].data != 0; last++) {
+        iovec vec;
+        vec.iov_base = const_cast<Protocol::Byte*>(sess->chunks[last].data);
+        vec.iov_len  = sess->chunks[last].size;
+        sess->iov.push_back(vec);
+      }
+      io_uring_sqe *sqe = GetSqe(sess, kSend);
+      if (sqe == 0) {
+        Close(sess);
+        return;
+      }
+      sess->msg.msg_iov    = &sess->iov[0];
+      sess->msg.msg_iovlen = sess->iov.size();
+      sqe->opcode    = IORING_OP_SENDMSG;
+      sqe->fd        = sess->fd;
+      sqe->addr      = reinterpret_cast<uint64_t>(&sess->msg);
+      sqe->len       = 1;
+      sqe->msg_flags = MSG_NOSIGNAL;
+    }
+
+    void HandleSend(Session *sess, int res) {
+      if (res <= 0) {
+        _settings.inspector->RegisterError("Ошибка отправки данных",
+                                           ErrorOf(res < 0 ? -res : EIO));
+        Close(sess);
+        return;
+      }
+      SetDeadline(sess, kWrite);
+      if (not sess->uses_chunks) {
+        sess->was_sended += res;
+        SendResponse(sess);
+        return;
+      }
+      // отправленные фрагменты пропускаются, частично отправленный
+      // укорачивается
+      USize left = res;
+      while (left > 0 && sess->next_chunk < sess->chunks.size()) {
+        Protocol::Chunk &chunk = sess->chunks[sess->next_chunk];
+        if (left < chunk.size) {
+          chunk.data += left;
+          chunk.size -= left;
+          break;
+        }
+        left -= chunk.size;
+        sess->next_chunk++;
+      }
+      SendChunks(sess);
+    }
+    // участок файла: файл -> канал -> сокет, без копирования в процесс
+    void SpliceIn(Session *sess) {
+      Protocol::Chunk &chunk = sess->chunks[sess->next_chunk];
+      if (chunk.size == 0) {
+        sess->next_chunk++;
+        SendChunks(sess);
+        return;
+      }
+      if (sess->pipe[0] < 0 && pipe2(sess->pipe, O_CLOEXEC) != 0) {
+        _settings.inspector->RegisterError("Ошибка создания канала", ErrorOf(errno));
+        Close(sess);
+        return;
+      }
+      io_uring_sqe *sqe = GetSqe(sess, kSpliceIn);
+      if (sqe == 0) {
+        Close(sess);
+        return;
+      }
+      sqe->opcode        = IORING_OP_SPLICE;
+      sqe->splice_fd_in  = chunk.file;
+      sqe->splice_off_in = chunk.offset;
+      sqe->fd            = sess->pipe[1];
+      sqe->off           = static_cast<uint64_t>(-1);
+      sqe->len           = (chunk.size < kSpliceSize ? chunk.size : kSpliceSize);
+      sqe->splice_flags  = SPLICE_F_MOVE;
+    }
+
+    void SpliceOut(Session *sess) {
+      io_uring_sqe *sqe = GetSqe(sess, kSpliceOut);
+      if (sqe == 0) {
+        Close(sess);
+        return;
+      }
+      sqe->opcode        = IORING_OP_SPLICE;
+      sqe->splice_fd_in  = sess->pipe[0];
+      sqe->splice_off_in = static_cast<uint64_t>(-1);
+      sqe->fd            = sess->fd;
+      sqe->off           = static_cast<uint64_t>(-1);
+      sqe->len           = sess->piped;
+      sqe->splice_flags  = SPLICE_F_MOVE;
+    }
+
+    void HandleSpliceIn(Session *sess, int res) {
+      if (res <= 0) {
+        _settings.inspector->RegisterError("Ошибка чтения файла",
+                                           ErrorOf(res < 0 ? -res : EIO));
+        Close(sess);
+        return;
+      }
+      Protocol::Chunk &chunk = sess->chunks[sess->next_chunk];
+      chunk.offset += res;
+      chunk.size   -= res;
+      sess->piped   = res;
+      SpliceOut(sess);
+    }
+
+    void HandleSpliceOut(Session *sess, int res) {
+      if (res <= 0) {
+        _settings.inspector->RegisterError("Ошибка отправки файла",
+                                           ErrorOf(res < 0 ? -res : EIO));
+        Close(sess);
+        return;
+      }
+      SetDeadline(sess, kWrite);
+      sess->piped -= res;
+      if (sess->piped > 0) {
+        SpliceOut(sess);
+        return;
+      }
+      SpliceIn(sess);
+    }
+
+    void CompleteResponse(Session *sess) {
+      if (sess->protocol->NeedToCloseSession()) {
+        Linger(sess);
+        return;
+      }
+      sess->buff.reset();
+      SetCork(sess, false);
+      SetDeadline(sess, kIdle);
+      PostRecv(sess);
+    }
+
+    Settings               _settings;
+    const bool             _reuse_port;
+    const Loop            *_first;
+    Protocol::ArrayOfBytes _buffers; // до кольца, чтобы пережить его
+    Protocol::ArrayOfBytes _discard;
+    Ring                   _ring;
+    std::vector<Listener>  _listeners;
+    USize                  _opened;
+    __kernel_timespec      _tick;
+    __kernel_timespec      _linger;
+    Wheel                  _deadlines;
+    Wheel::ListOfExpired   _expired;
+    std::vector<Session*>  _sessions;
+    std::vector<Session*>  _free;
+};
+
+const USize UringService::Loop::kLingerTimeout;
+
+bool UringService::IsSupported() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  const int kFd = SysUringSetup(1, &params);
+  if (kFd < 0) {
+    return false;
+  }
+  close(kFd);
+  return (params.features & IORING_FEAT_FAST_POLL);
+}
+
+UringService::UringService(const Settings &settings)
+    : _settings(settings),
+      _stopped(false) {
+  if (not _settings.inspector) {
+    _settings.inspector.reset(new Inspector());
+  }
+  if (_settings.loops == 0) {
+    _settings.loops = 1;
+  }
+  // ограничение количества сессий делится между циклами
+  _settings.limits.sessions = (_settings.limits.sessions + _settings.loops - 1) /
+                              _settings.loops;
+}
+
+UringService::~UringService() {
+  Stop();
+  // дожидаемся выхода потоков RunWorkers (не дольше шага таймеров)
+  boost::mutex::scoped_lock lock(_run_mutex);
+  for (size_t id = 0; id < _loops.size(); id++) {
+    delete _loops[id];
+  }
+}
+
+bool UringService::Start() {
+  for (USize id = 0; id < _settings.loops; id++) {
+    const Loop *kFirst = (id == 0 ? 0 : _loops.front());
+    _loops.push_back(new Loop(_settings, _settings.loops > 1, kFirst));
+    if (not _loops.back()->Start()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void UringService::RunOne() {
+  boost::mutex::scoped_lock lock(_run_mutex);
+  if (_loops.size() > 0 && not __atomic_load_n(&_stopped, __ATOMIC_ACQUIRE)) {
+    _loops.front()->RunOnce(true);
+  }
+}
+
+void UringService::RunWorkers() {
+  boost::mutex::scoped_lock lock(_run_mutex);
+  boost::thread_group pool;
+  for (size_t id = 0; id < _loops.size(); id++) {
+    pool.create_thread(boost::bind(&UringService::RunLoop, this, _loops[id]));
+  }
+  pool.join_all();
+}
+
+void UringService::Stop() {
+  __atomic_store_n(&_stopped, true, __ATOMIC_RELEASE);
+}
+
+void UringService::RunLoop(Loop *loop) {
+  // кольцо просыпается не реже одного раза за шаг таймеров
+  while (not __atomic_load_n(&_stopped, __ATOMIC_ACQUIRE)) {
+    loop->RunOnce(true);
+  }
+}
+
+#else // WEBAPP_WITH_IO_URING
+
+bool UringService::IsSupported() {
+  return false;
+}
+
+UringService::UringService(const Settings &settings)
+    : _settings(settings),
+      _stopped(false) {
+}
+
+UringService::~UringService() {
+}
+
+bool UringService::Start() {
+  return false;
+}
+
+void UringService::RunOne() {
+}
+
+void UringService::RunWorkers() {
+}
+
+void UringService::Stop() {
+}
+
+void UringService::RunLoop(Loop*) {
+}
+
+#endif // WEBAPP_WITH_IO_URING
+
+} // namespace webapp
@@ -0,0 +1,67 @@
+/*
+ * webapp_proto_uring.hpp
+ *
+ *  Created on: 18 окт. 2026 г.
+ */
+
+#ifndef BACK_END_WEBAPP_PROTO_URING_HPP_
+#define BACK_END_WEBAPP_PROTO_URING_HPP_
+
+#include "webapp_proto.hpp"
+
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace webapp {
+/**
+ * Обслуживание сетевых сессий через io_uring (Linux), без boost::asio.
+ * Подключения принимаются одной многократной операцией (multishot accept),
+ * данные читаются в буферы, предоставленные ядру заранее (provided buffers),
+ * фрагменты ответа отправляются одной операцией (sendmsg), а участки файлов
+ * передаются через канал (splice). Реализации протокола используются те же,
+ * что и при asio. Используется внутри Server, напрямую не создаётся.
+ */
+class UringService {
+  public:
+    typedef boost::function<Protocol*()> ProtocolFactory;
+
+    struct Settings {
+      Settings(): loops(1) {}
+      Server::Endpoints     endpoints;
+      USize                 loops; // потоков, каждый со своим кольцом
+      Server::Timeouts      timeouts;
+      Server::Limits        limits;
+      Server::SocketOptions socket_options;
+      std::string           overload_response;
+      ProtocolFactory       factory;
+      Inspector::Ptr        inspector;
+    };
+
+    static bool IsSupported();
+
+    UringService(const Settings &settings);
+    ~UringService();
+
+    bool Start();
+    void RunOne();
+    void RunWorkers();
+    // потоки RunWorkers завершаются не позднее шага таймеров
+    void Stop();
+  private:
+    class Ring;
+    class Loop;
+
+    UringService(const UringService&);
+    void operator= (const UringService&);
+    void RunLoop(Loop *loop);
+
+    Settings           _settings;
+    std::vector<Loop*> _loops;
+    boost::mutex       _run_mutex;
+    bool               _stopped;
+}; // class UringService
+
+} // namespace webapp
+
+#endif /* BACK_END_WEBAPP_PROTO_URING_HPP_ */
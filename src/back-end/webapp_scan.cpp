@@ -0,0 +1,151 @@
+/*
+ * webapp_scan.cpp
+ *
+ *  Created on: 18 окт. 2026 г.
+ */
+
+#include "webapp_scan.hpp"
+
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define WEBAPP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+namespace webapp {
+
+static size_t FindScalar(const uint8_t *data, size_t size, uint8_t value) {
+  const void *kFound = memchr(data, value, size);
+  return (kFound == 0 ? size : static_cast<const uint8_t*>(kFound) - data);
+}
+
+static size_t FindEitherScalar(const uint8_t *data,
+                               size_t         size,
+                               uint8_t        first,
+                               uint8_t        second) {
+  size_t off = 0;
+  for (; off < size; off++) {
+    if (data[off] == first || data[off] == second) {
+      break;
+    }
+  }
+  return off;
+}
+
+#if defined(WEBAPP_SCAN_X86) && defined(__SSE2__)
+#define WEBAPP_SCAN_SSE2
+// маска байтов блока, равных искомому, младший бит - первый байт
+static inline unsigned MatchSse2(const uint8_t *data, __m128i value) {
+  const __m128i kBlock = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(kBlock, value));
+}
+
+static size_t FindSse2(const uint8_t *data, size_t size, uint8_t value) {
+  const __m128i kValue = _mm_set1_epi8(value);
+  size_t off = 0;
+  for (; off + 16 <= size; off += 16) {
+    const unsigned kMask = MatchSse2(data + off, kValue);
+    if (kMask != 0) {
+      return off + __builtin_ctz(kMask);
+    }
+  }
+  return off + FindEitherScalar(data + off, size - off, value, value);
+}
+
+static size_t FindEitherSse2(const uint8_t *data,
+                             size_t         size,
+                             uint8_t        first,
+                             uint8_t        second) {
+  const __m128i kFirst  = _mm_set1_epi8(first);
+  const __m128i kSecond = _mm_set1_epi8(second);
+  size_t off = 0;
+  for (; off + 16 <= size; off += 16) {
+    const unsigned kMask = MatchSse2(data + off, kFirst) |
+                           MatchSse2(data + off, kSecond);
+    if (kMask != 0) {
+      return off + __builtin_ctz(kMask);
+    }
+  }
+  return off + FindEitherScalar(data + off, size - off, first, second);
+}
+#endif // WEBAPP_SCAN_SSE2
+
+#if defined(WEBAPP_SCAN_SSE2)
+// AVX2 включается только для этих функций, остальной код собирается без него
+__attribute__((target("avx2")))
+static inline unsigned MatchAvx2(const uint8_t *data, __m256i value) {
+  const __m256i kBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(kBlock, value));
+}
+
+__attribute__((target("avx2")))
+static size_t FindAvx2(const uint8_t *data, size_t size, uint8_t value) {
+  const __m256i kValue = _mm256_set1_epi8(value);
+  size_t off = 0;
+  for (; off + 32 <= size; off += 32) {
+    const unsigned kMask = MatchAvx2(data + off, kValue);
+    if (kMask != 0) {
+      return off + __builtin_ctz(kMask);
+    }
+  }
+  return off + FindSse2(data + off, size - off, value);
+}
+
+__attribute__((target("avx2")))
+static size_t FindEitherAvx2(const uint8_t *data,
+                             size_t         size,
+                             uint8_t        first,
+                             uint8_t        second) {
+  const __m256i kFirst  = _mm256_set1_epi8(first);
+  const __m256i kSecond = _mm256_set1_epi8(second);
+  size_t off = 0;
+  for (; off + 32 <= size; off += 32) {
+    const unsigned kMask = MatchAvx2(data + off, kFirst) |
+                           MatchAvx2(data + off, kSecond);
+    if (kMask != 0) {
+      return off + __builtin_ctz(kMask);
+    }
+  }
+  return off + FindEitherSse2(data + off, size - off, first, second);
+}
+#endif // WEBAPP_SCAN_SSE2
+
+ByteScan::FindFunc       ByteScan::_find        = FindScalar;
+ByteScan::FindEitherFunc ByteScan::_find_either = FindEitherScalar;
+ByteScan::Level          ByteScan::_level       = ByteScan::kScalar;
+
+ByteScan::Level ByteScan::GetLevel() {
+  return _level;
+}
+
+bool ByteScan::UseLevel(Level level) {
+  switch (level) {
+    case kScalar:
+      _find        = FindScalar;
+      _find_either = FindEitherScalar;
+      break;
+#if defined(WEBAPP_SCAN_SSE2)
+    case kSse2:
+      _find        = FindSse2;
+      _find_either = FindEitherSse2;
+      break;
+    case kAvx2:
+      __builtin_cpu_init();
+      if (not __builtin_cpu_supports("avx2")) {
+        return false;
+      }
+      _find        = FindAvx2;
+      _find_either = FindEitherAvx2;
+      break;
+#endif
+    default:
+      return false;
+  };
+  _level = level;
+  return true;
+}
+// выбор лучшей реализации при загрузке библиотеки
+static const bool kLevelSelected = (ByteScan::UseLevel(ByteScan::kAvx2) ||
+                                    ByteScan::UseLevel(ByteScan::kSse2));
+
+} // namespace webapp
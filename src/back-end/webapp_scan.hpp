@@ -0,0 +1,59 @@
+/*
+ * webapp_scan.hpp
+ *
+ *  Created on: 18 окт. 2026 г.
+ */
+
+#ifndef BACK_END_WEBAPP_SCAN_HPP_
+#define BACK_END_WEBAPP_SCAN_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace webapp {
+/**
+ * Поиск разделителей в принятых данных по 16 (SSE2) или 32 (AVX2) байта за
+ * шаг. Реализация выбирается при запуске по CPUID, а на процессорах без
+ * этих инструкций (и не x86) используется побайтовый поиск.
+ */
+class ByteScan {
+  public:
+    enum Level {
+      kScalar,
+      kSse2,
+      kAvx2
+    };
+    /**
+     * @return  смещение первого байта равного value, либо size
+     */
+    static size_t Find(const uint8_t *data, size_t size, uint8_t value) {
+      return _find(data, size, value);
+    }
+    /**
+     * @return  смещение первого байта равного first или second, либо size
+     */
+    static size_t FindEither(const uint8_t *data,
+                             size_t         size,
+                             uint8_t        first,
+                             uint8_t        second) {
+      return _find_either(data, size, first, second);
+    }
+
+    static Level GetLevel();
+    /**
+     * Принудительный выбор реализации (для тестов и замеров), не
+     * потокобезопасен. false - процессор не поддерживает инструкции.
+     */
+    static bool UseLevel(Level level);
+  private:
+    typedef size_t (*FindFunc)(const uint8_t*, size_t, uint8_t);
+    typedef size_t (*FindEitherFunc)(const uint8_t*, size_t, uint8_t, uint8_t);
+
+    static FindFunc       _find;
+    static FindEitherFunc _find_either;
+    static Level          _level;
+};
+
+} // namespace webapp
+
+#endif /* BACK_END_WEBAPP_SCAN_HPP_ */
@@ -0,0 +1,138 @@
+/*
+ * webapp_timing_wheel.hpp
+ *
+ *  Created on: 18 окт. 2026 г.
+ */
+
+#ifndef BACK_END_WEBAPP_TIMING_WHEEL_HPP_
+#define BACK_END_WEBAPP_TIMING_WHEEL_HPP_
+
+#include "webapp_proto.hpp"
+
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
+namespace webapp {
+
+/**
+ * "Колесо таймеров": сроки сессий раскладываются по ячейкам кольца, которое
+ * проворачивается на одну ячейку за шаг. Установка и отмена срока стоят O(1),
+ * а все сессии цикла обработки событий обслуживает один таймер. Срок длиннее
+ * оборота колеса учитывается счётчиком оборотов. SessionRef - ссылка, по
+ * которой сессия находится после срабатывания срока.
+ */
+template <typename SessionRef>
+class TimingWheel {
+  public:
+    /**
+     * Положение срока сессии в колесе, принадлежит сессии. Ячейка колеса -
+     * двусвязный список, звенья которого хранятся в самих Handle, по этому
+     * установка и отмена срока обходятся без выделения памяти.
+     */
+    struct Handle {
+      Handle()
+          : prev(0),
+            next(0),
+            slot(0),
+            rounds(0),
+            armed(false),
+            generation(0) {}
+      Handle     *prev;
+      Handle     *next;
+      SessionRef  session;
+      USize       slot;
+      USize       rounds;     // оставшихся оборотов колеса
+      bool        armed;
+      USize       generation; // меняется при каждой установке/отмене
+    };
+    struct Expired {
+      Expired(const SessionRef &sess, USize gen)
+          : session(sess), generation(gen) {}
+      SessionRef session;
+      USize      generation;
+    };
+    typedef std::vector<Expired> ListOfExpired;
+
+    static const USize kTickMs      = 250;
+    static const USize kSlotsAmount = 256;
+
+    TimingWheel(): _cursor(0), _slots(kSlotsAmount, static_cast<Handle*>(0)) {
+    }
+
+    void Arm(Handle *hdl, const SessionRef &sess, USize seconds) {
+      boost::mutex::scoped_lock lock(_mutex);
+      Unlink(hdl);
+      if (seconds == 0) {
+        return;
+      }
+      const USize kTicks = (seconds * 1000 + kTickMs - 1) / kTickMs;
+      hdl->session = sess;
+      hdl->slot    = (_cursor + kTicks) % kSlotsAmount;
+      hdl->rounds  = (kTicks - 1) / kSlotsAmount;
+      hdl->prev    = 0;
+      hdl->next    = _slots[hdl->slot];
+      if (hdl->next != 0) {
+        hdl->next->prev = hdl;
+      }
+      _slots[hdl->slot] = hdl;
+      hdl->armed = true;
+    }
+
+    void Cancel(Handle *hdl) {
+      boost::mutex::scoped_lock lock(_mutex);
+      Unlink(hdl);
+    }
+    /**
+     * Поворот колеса на один шаг. Сессии с истёкшим сроком возвращаются
+     * вызывающему, который сверяет поколение срока и закрывает их.
+     */
+    void Tick(ListOfExpired *out) {
+      boost::mutex::scoped_lock lock(_mutex);
+      _cursor = (_cursor + 1) % kSlotsAmount;
+      Handle *hdl = _slots[_cursor];
+      while (hdl != 0) {
+        Handle *next = hdl->next;
+        if (hdl->rounds > 0) {
+          hdl->rounds--;
+        } else {
+          out->push_back(Expired(hdl->session, hdl->generation));
+          Remove(hdl);
+        }
+        hdl = next;
+      }
+    }
+  private:
+    void Unlink(Handle *hdl) {
+      hdl->generation++;
+      if (hdl->armed) {
+        Remove(hdl);
+      }
+    }
+
+    void Remove(Handle *hdl) {
+      if (hdl->prev != 0) {
+        hdl->prev->next = hdl->next;
+      } else {
+        _slots[hdl->slot] = hdl->next;
+      }
+      if (hdl->next != 0) {
+        hdl->next->prev = hdl->prev;
+      }
+      hdl->prev  = 0;
+      hdl->next  = 0;
+      hdl->armed = false;
+    }
+
+    boost::mutex         _mutex;
+    USize                _cursor;
+    std::vector<Handle*> _slots; // первые звенья ячеек
+};
+
+template <typename SessionRef>
+const USize TimingWheel<SessionRef>::kTickMs;
+template <typename SessionRef>
+const USize TimingWheel<SessionRef>::kSlotsAmount;
+
+} // namespace webapp
+
+#endif /* BACK_END_WEBAPP_TIMING_WHEEL_HPP_ */
@@ -175,7 +175,7 @@ void InitDialogs(const std::string &root_dir, webapp::http::Manager &manager) {
   ));
 }
 
-int main(int /*argc*/, char *argv[]) {
+int main(int argc, char *argv[]) {
   namespace fs = boost::filesystem;
   static const std::string kExecPath(fs::system_complete(argv[0]).string());
   static const std::string kRootDir = fs::system_complete(argv[0]).parent_path().string();
@@ -184,6 +184,10 @@ int main(int /*argc*/, char *argv[]) {
                        "/static/demo_webapp.html");
   webapp::ServerHttp srv(router);
   router->AddDirectoryFor("/static", kRootDir + "/static");
+  // сравнение механизмов ввода/вывода: webapp_server --io-uring
+  if (argc > 1 && std::string(argv[1]) == "--io-uring") {
+    srv.SetBackend(webapp::Server::kBackendIoUring);
+  }
   srv.BindTo(webapp::Server::kLoopbackAddress, 8080, webapp::Inspector::Create());
   InitDialogs(kRootDir, *com_manager);
   do {
@@ -0,0 +1,247 @@
+/*
+ * http_bench.cpp
+ *
+ * Замер скорости разбора запросов набора http_corpus.hpp в одном потоке.
+ * Для каждого запроса выводится лучший из нескольких замеров, запросов в
+ * секунду и МБ в секунду. Имеет смысл только в сборке Release.
+ *
+ * С ключом --backends замеряется сервер целиком: одна и та же нагрузка
+ * (клиенты с постоянными соединениями на 127.0.0.1) подаётся на сервер с
+ * asio и с io_uring, для каждого выводится запросов в секунду.
+ *
+ * webapp_http_bench [количество разборов в замере]
+ * webapp_http_bench --backends [секунд] [клиентов] [потоков сервера]
+ */
+
+#include "webapp_lib.hpp"
+#include "http_corpus.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const size_t   kRepeats   = 5;
+static const uint16_t kBenchPort = 8090;
+
+// время разбора amount копий запроса, в секундах; < 0 - запрос не разобран
+static double MeasureParse(webapp::ProtocolHTTP *proto,
+                           const std::string    &raw,
+                           size_t                amount) {
+  std::vector<webapp::Protocol::Byte> buff(raw.size());
+  const boost::posix_time::ptime kStart =
+    boost::posix_time::microsec_clock::universal_time();
+  for (size_t id = 0; id < amount; id++) {
+    // разбор может изменять данные на месте, по этому каждый раз копия
+    memcpy(&buff[0], raw.data(), raw.size());
+    webapp::ProtocolHTTP::Request req;
+    proto->ParseRequest(&buff[0], buff.size(), &req);
+    if (not req.Completed()) {
+      return -1;
+    }
+  }
+  const boost::posix_time::time_duration kTime =
+    boost::posix_time::microsec_clock::universal_time() - kStart;
+  return kTime.total_microseconds() / 1000000.0;
+}
+
+static bool BenchHandler(const webapp::ProtocolHTTP::Uri::Path&,
+                         const webapp::ProtocolHTTP::Request&,
+                         webapp::ProtocolHTTP::Response *resp) {
+  resp->SetBody("ok");
+  return true;
+}
+// запоминает, что сервер не смог использовать io_uring
+class BackendInspector : public webapp::Inspector {
+  public:
+    BackendInspector(): fallback(false) {}
+    virtual void RegisterError(const std::string&, const Error&) {}
+    virtual void RegisterMessage(const std::string &msg) {
+      if (msg == "io_uring недоступен, используется asio") {
+        fallback = true;
+      }
+    }
+    bool fallback;
+};
+// подключение к серверу замера, -1 - ошибка
+static int ConnectClient(uint16_t port) {
+  const int kFd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (kFd < 0 || connect(kFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    if (kFd >= 0) {
+      close(kFd);
+    }
+    return -1;
+  }
+  // без задержки отправки (Nagle) запрос ожидал бы подтверждения предыдущего
+  const int kNoDelay = 1;
+  setsockopt(kFd, IPPROTO_TCP, TCP_NODELAY, &kNoDelay, sizeof(kNoDelay));
+  return kFd;
+}
+/**
+ * Клиент: запросы по одному через постоянное соединение, пока не
+ * установлен *stop. Соединение, закрытое сервером (KeepAlive::max_requests),
+ * открывается заново. *amount - получено полных ответов.
+ */
+static void RunClient(uint16_t port, const bool *stop, size_t *amount) {
+  static const char kReq[] = "GET /bench HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+  static const char kEnd[] = "\r\n\r\nok";
+  char        buff[4096];
+  std::string resp;
+  int         fd = -1;
+  while (not __atomic_load_n(stop, __ATOMIC_ACQUIRE)) {
+    if (fd < 0 && (fd = ConnectClient(port)) < 0) {
+      return;
+    }
+    bool done = (send(fd, kReq, sizeof(kReq) - 1, MSG_NOSIGNAL) ==
+                 sizeof(kReq) - 1);
+    resp.clear();
+    while (done && resp.find(kEnd) == std::string::npos) {
+      const ssize_t kSize = recv(fd, buff, sizeof(buff), 0);
+      done = (kSize > 0);
+      if (done) {
+        resp.append(buff, kSize);
+      }
+    }
+    if (not done) {
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    (*amount)++;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+/**
+ * Запросов в секунду сервера с механизмом backend; < 0 - сервер не запущен.
+ * *fallback - вместо io_uring использовался asio.
+ */
+static double MeasureServer(webapp::Server::Backend backend,
+                            uint16_t                port,
+                            size_t                  seconds,
+                            size_t                  clients,
+                            size_t                  workers,
+                            bool                   *fallback) {
+  webapp::ProtocolHTTP::Router::Ptr router = webapp::ProtocolHTTP::Router::Create();
+  router->AddHandlerFor("/bench", webapp::ProtocolHTTP::Router::Functor(BenchHandler));
+  webapp::ServerHttp srv(router);
+  srv.SetBackend(backend);
+  srv.SetWorkersAmount(workers);
+  webapp::Server::SocketOptions options;
+  options.no_delay = true;
+  srv.SetSocketOptions(options);
+  boost::shared_ptr<BackendInspector> inspector(new BackendInspector());
+  try {
+    if (not srv.BindTo(webapp::Server::kLoopbackAddress, port, inspector)) {
+      return -1;
+    }
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return -1;
+  }
+  *fallback = inspector->fallback;
+  bool server_stop = false;
+  boost::thread server([&srv, &server_stop]() {
+    while (not __atomic_load_n(&server_stop, __ATOMIC_ACQUIRE)) {
+      srv.Run();
+    }
+  });
+  bool                client_stop = false;
+  std::vector<size_t> amounts(clients, 0);
+  boost::thread_group pool;
+  for (size_t id = 0; id < clients; id++) {
+    pool.create_thread(boost::bind(RunClient, port, &client_stop, &amounts[id]));
+  }
+  boost::this_thread::sleep(boost::posix_time::seconds(seconds));
+  __atomic_store_n(&client_stop, true, __ATOMIC_RELEASE);
+  pool.join_all();
+  // клиенты закрыли соединения, сервер останавливается после них
+  __atomic_store_n(&server_stop, true, __ATOMIC_RELEASE);
+  srv.Stop();
+  server.join();
+  srv.Unbind();
+  size_t total = 0;
+  for (size_t id = 0; id < clients; id++) {
+    total += amounts[id];
+  }
+  return static_cast<double>(total) / seconds;
+}
+
+static int CompareBackends(int argc, char **argv) {
+  const size_t kSeconds = (argc > 2 ? strtoul(argv[2], 0, 10) : 5);
+  const size_t kClients = (argc > 3 ? strtoul(argv[3], 0, 10) : 32);
+  const size_t kWorkers = (argc > 4 ? strtoul(argv[4], 0, 10) : 1);
+  if (kSeconds == 0 || kClients == 0 || kWorkers == 0) {
+    fprintf(stderr, "usage: %s --backends [seconds] [clients] [workers]\n", argv[0]);
+    return 1;
+  }
+  printf("%zu s, %zu clients, %zu server threads\n", kSeconds, kClients, kWorkers);
+  const webapp::Server::Backend kBackends[] = {
+    webapp::Server::kBackendAsio,
+    webapp::Server::kBackendIoUring
+  };
+  const char *kNames[] = {"asio", "io_uring"};
+  for (size_t id = 0; id < sizeof(kBackends) / sizeof(kBackends[0]); id++) {
+    bool fallback = false;
+    // у каждого механизма свой порт: закрытие кольца io_uring освобождает
+    // приёмник не сразу
+    const double kRate = MeasureServer(kBackends[id], kBenchPort + id, kSeconds,
+                                       kClients, kWorkers, &fallback);
+    if (kRate < 0) {
+      printf("%-20s bind failed\n", kNames[id]);
+      continue;
+    }
+    printf("%-20s %10.0f req/s%s\n", kNames[id], kRate,
+           fallback ? " (unavailable, measured asio)" : "");
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "--backends") == 0) {
+    return CompareBackends(argc, argv);
+  }
+  const size_t kAmount = (argc > 1 ? strtoul(argv[1], 0, 10) : 200000);
+  webapp::ProtocolHTTP proto(webapp::ProtocolHTTP::Router::Create());
+  for (size_t id = 0; id < kHttpCorpusSize; id++) {
+    const HttpCorpusCase &kCase = kHttpCorpus[id];
+    // только одиночные запросы без ошибок
+    if (kCase.requests != 1 || kCase.error != webapp::ProtocolHTTP::k200) {
+      continue;
+    }
+    const std::string kRaw(kCase.raw);
+    double best = -1;
+    MeasureParse(&proto, kRaw, kAmount / 10);
+    for (size_t rep = 0; rep < kRepeats; rep++) {
+      const double kTime = MeasureParse(&proto, kRaw, kAmount);
+      if (kTime < 0) {
+        best = -1;
+        break;
+      }
+      if (best < 0 || kTime < best) {
+        best = kTime;
+      }
+    }
+    if (best <= 0) {
+      printf("%-20s not parsed\n", kCase.name);
+      continue;
+    }
+    printf("%-20s %10.0f req/s %8.1f MB/s\n", kCase.name, kAmount / best,
+           kAmount * kRaw.size() / best / (1024 * 1024));
+  }
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * http_corpus.hpp
+ *
+ * Набор запросов для проверки и замеров разбора ProtocolHTTP::ParseRequest:
+ * обычные запросы, несколько запросов подряд (HTTP pipelining), тело в
+ * кодировке chunked и ошибочные запросы.
+ */
+
+#ifndef TEST_HTTP_CORPUS_HPP_
+#define TEST_HTTP_CORPUS_HPP_
+
+#include "webapp_proto_http.hpp"
+
+struct HttpCorpusCase {
+  const char                *name;
+  const char                *raw;
+  size_t                     requests; // полностью разобранных запросов
+  webapp::ProtocolHTTP::Code error;    // ошибка запроса после них, k200 - нет
+};
+
+static const HttpCorpusCase kHttpCorpus[] = {
+  {"get-simple",
+   "GET / HTTP/1.1\r\n"
+   "Host: example.com\r\n\r\n",
+   1, webapp::ProtocolHTTP::k200},
+  {"get-browser",
+   "GET /index.html?x=1 HTTP/1.1\r\n"
+   "Host: example.com\r\n"
+   "User-Agent: Mozilla/5.0 (X11; Linux x86_64) Gecko/20100101 Firefox/60.0\r\n"
+   "Accept: text/html,application/xhtml+xml\r\n"
+   "Accept-Language: en-US,en;q=0.5\r\n"
+   "Accept-Encoding: gzip, deflate\r\n"
+   "Connection: keep-alive\r\n\r\n",
+   1, webapp::ProtocolHTTP::k200},
+  {"get-query-cookies",
+   "GET /search/%D0%BF%D0%BE%D0%B8%D1%81%D0%BA?q=a+b&page=2&flag#top HTTP/1.1\r\n"
+   "Host: example.com:8080\r\n"
+   "Cookie: session=0123456789abcdef; theme=dark\r\n"
+   "If-None-Match: \"a\", \"b\"\r\n"
+   "Range: bytes=0-99\r\n\r\n",
+   1, webapp::ProtocolHTTP::k200},
+  {"get-long-uri",
+   "GET /api/v1/%D1%82%D0%BE%D0%B2%D0%B0%D1%80%D1%8B/12345/reviews?lang=ru&page=3"
+   "&per_page=50&filter=a%20b&q=x+y+z&utm_source=news&utm_medium=email HTTP/1.1\r\n"
+   "Host: shop.example.com\r\n\r\n",
+   1, webapp::ProtocolHTTP::k200},
+  {"leading-crlf",
+   "\r\nGET / HTTP/1.1\r\n\r\n",
+   1, webapp::ProtocolHTTP::k200},
+  {"lf-only",
+   "GET / HTTP/1.1\n"
+   "Host: example.com\n\n",
+   1, webapp::ProtocolHTTP::k200},
+  {"pipelined-get",
+   "GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n"
+   "GET /b HTTP/1.1\r\nHost: example.com\r\n\r\n"
+   "GET /c HTTP/1.0\r\n\r\n",
+   3, webapp::ProtocolHTTP::k200},
+  {"post-length",
+   "POST /echo HTTP/1.1\r\n"
+   "Content-Type: application/octet-stream\r\n"
+   "Content-Length: 11\r\n\r\n"
+   "hello world",
+   1, webapp::ProtocolHTTP::k200},
+  {"post-form",
+   "POST /form HTTP/1.1\r\n"
+   "Content-Type: application/x-www-form-urlencoded\r\n"
+   "Content-Length: 33\r\n\r\n"
+   "name=%D0%B8%D0%BC%D1%8F&x=1+2&y&z",
+   1, webapp::ProtocolHTTP::k200},
+  {"post-multipart",
+   "POST /upload HTTP/1.1\r\n"
+   "Content-Type: multipart/form-data; boundary=xYzZY\r\n"
+   "Content-Length: 182\r\n\r\n"
+   "--xYzZY\r\n"
+   "Content-Disposition: form-data; name=\"text\"\r\n\r\n"
+   "value\r\n"
+   "--xYzZY\r\n"
+   "Content-Disposition: form-data; name=\"file\"; filename=\"a.csv\"\r\n"
+   "Content-Type: text/csv\r\n\r\n"
+   "1,2\r\n3,4\r\n"
+   "--xYzZY--\r\n",
+   1, webapp::ProtocolHTTP::k200},
+  {"chunked",
+   "POST /chunked HTTP/1.1\r\n"
+   "Transfer-Encoding: chunked\r\n\r\n"
+   "5;ext=1\r\nhello\r\n"
+   "6\r\n world\r\n"
+   "0\r\n"
+   "X-Trailer: 1\r\n\r\n",
+   1, webapp::ProtocolHTTP::k200},
+  {"pipelined-chunked",
+   "POST /chunked HTTP/1.1\r\n"
+   "Transfer-Encoding: chunked\r\n\r\n"
+   "A\r\n0123456789\r\n"
+   "0\r\n\r\n"
+   "POST /echo HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"
+   "GET /last HTTP/1.1\r\n\r\n",
+   3, webapp::ProtocolHTTP::k200},
+  {"bad-method",
+   "BREW /pot HTTP/1.1\r\n\r\n",
+   0, webapp::ProtocolHTTP::k501},
+  {"bad-version",
+   "GET / HTTP/2.0\r\n\r\n",
+   0, webapp::ProtocolHTTP::k505},
+  {"no-version",
+   "GET /\r\n\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"bad-uri",
+   "GET /a\x01z HTTP/1.1\r\n\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"field-without-colon",
+   "GET / HTTP/1.1\r\nHost\r\n\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"space-before-colon",
+   "GET / HTTP/1.1\r\nHost : example.com\r\n\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"bad-length",
+   "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"length-overflow",
+   "POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"conflicting-length",
+   "POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"length-and-chunked",
+   "POST / HTTP/1.1\r\nContent-Length: 1\r\nTransfer-Encoding: chunked\r\n\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"bad-chunk-size",
+   "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nz\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"chunk-without-crlf",
+   "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabcX\r\n0\r\n\r\n",
+   0, webapp::ProtocolHTTP::k400},
+  {"pipelined-then-bad",
+   "GET / HTTP/1.1\r\n\r\n"
+   "BREW / HTTP/1.1\r\n\r\n",
+   1, webapp::ProtocolHTTP::k501}
+};
+
+static const size_t kHttpCorpusSize = sizeof(kHttpCorpus) / sizeof(kHttpCorpus[0]);
+
+#endif /* TEST_HTTP_CORPUS_HPP_ */
@@ -3,6 +3,19 @@
 #include <sstream>
 #include <iostream>
 #include "webapp_lib.hpp"
+#include "webapp_arena.hpp"
+#include "webapp_scan.hpp"
+#include "webapp_timing_wheel.hpp"
+#include "http_corpus.hpp"
+#include <chrono>
+#include <random>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 static const unsigned char kSp     = 0x20;
 static const unsigned char kCrLf[] = "\r\n";//{0x0D, 0x0A};
@@ -225,7 +238,8 @@ static size_t GeneratePacket(webapp::ProtocolHTTP::Byte *out, size_t max_size) {
   return pkt.ConvertToArray(out, max_size);
 }
 
-static void CheckRequestHeader(const webapp::ProtocolHTTP::Header &head) {
+static void CheckRequestHeader(const webapp::ProtocolHTTP::Request &req) {
+  const webapp::ProtocolHTTP::Header &head = req.GetHeader();
   // общие поля
   BOOST_CHECK(head.line.method  == webapp::ProtocolHTTP::kGet);
   BOOST_CHECK(head.line.target.get_path().at(0) == "hello.txt");
@@ -233,15 +247,15 @@ static void CheckRequestHeader(const webapp::ProtocolHTTP::Header &head) {
   BOOST_CHECK(head.user_agent == kUserAgent);
   BOOST_CHECK(head.host       == kHost);
   // группа Accept
-  CheckListOfStrings(head.accept.language, ',', kAcceptLanguage);
-  CheckListOfStrings(head.accept.charset,  ',', kAcceptCharset);
-  CheckListOfStrings(head.accept.encoding, ',', kAcceptEncoding);
+  CheckListOfStrings(req.GetAccept().language, ',', kAcceptLanguage);
+  CheckListOfStrings(req.GetAccept().charset,  ',', kAcceptCharset);
+  CheckListOfStrings(req.GetAccept().encoding, ',', kAcceptEncoding);
   // группа Content
   BOOST_CHECK(head.content.type.name == webapp::ProtocolHTTP::Content::Type::kMultipart);
   BOOST_CHECK(head.content.type.sub_type == "mixed");
   BOOST_CHECK(head.content.type.boundary == kBoundary);
   BOOST_CHECK(head.content.type.charset == "ISO-8859-4");
-  BOOST_CHECK(head.content.location.get_path().at(0) == "hello.txt");
+  BOOST_CHECK(req.GetContentLocation().get_path().at(0) == "hello.txt");
   BOOST_CHECK(head.content.length == 556);
   CheckListOfStrings(head.content.language, ',', kContentLanguage);
   CheckListOfStrings(head.content.encoding, ',', kContentEncoding);
@@ -259,6 +273,125 @@ static void CheckPostRequest(webapp::ProtocolHTTP::Request &req) {
   req.Post("AttachedFile1")->get_value(&field_str);
   BOOST_CHECK(kAttachedFile1 == field_str);
 }
+// счётчик сообщений сервера с заданным текстом
+class MessageCounter : public webapp::Inspector {
+  public:
+    MessageCounter(const std::string &msg): amount(0), _msg(msg) {}
+    virtual void RegisterError(const std::string&, const Error&) {}
+    virtual void RegisterMessage(const std::string &msg) {
+      if (msg == _msg) {
+        amount++;
+      }
+    }
+    size_t amount;
+  private:
+    const std::string _msg;
+};
+// неблокирующее подключение к серверу на 127.0.0.1
+static int ConnectClient(uint16_t port) {
+  const int kFd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (kFd < 0 || connect(kFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    if (kFd >= 0) {
+      close(kFd);
+    }
+    return -1;
+  }
+  fcntl(kFd, F_SETFL, fcntl(kFd, F_GETFL) | O_NONBLOCK);
+  return kFd;
+}
+
+static void CloseClients(std::vector<int> *clients) {
+  for (size_t id = 0; id < clients->size(); id++) {
+    close(clients->at(id));
+  }
+  clients->clear();
+}
+/**
+ * Разбор данных запрос за запросом: первая порция first байт, остальные не
+ * больше step байт.
+ * @return  описание завершённых запросов и ошибки следующего за ними, либо
+ *          "incomplete", если данные закончились раньше запроса
+ */
+static std::string ParseByParts(const std::string &raw, size_t first, size_t step) {
+  webapp::ProtocolHTTP proto(webapp::ProtocolHTTP::Router::Create());
+  std::string          data(raw);
+  std::ostringstream   out;
+  size_t               off = 0;
+  while (off < data.size()) {
+    webapp::ProtocolHTTP::Request req;
+    while (off < data.size() && not req.Completed()) {
+      size_t used = 0;
+      const size_t kSize = std::min(off > 0 ? step : first, data.size() - off);
+      if (not proto.ParseRequest((webapp::Protocol::Byte*)&data[off], kSize, &req, &used)) {
+        BOOST_CHECK(req.GetError() >= webapp::ProtocolHTTP::k400);
+        out << "error " << req.GetError();
+        return out.str();
+      }
+      // незавершённый запрос забирает всю порцию, завершённый - хотя бы байт
+      BOOST_REQUIRE(used <= kSize);
+      BOOST_REQUIRE(req.Completed() ? used > 0 : used == kSize);
+      off += used;
+    }
+    if (not req.Completed()) {
+      out << "incomplete";
+      return out.str();
+    }
+    const webapp::ProtocolHTTP::Header &kHeader = req.GetHeader();
+    std::string body;
+    if (req.GetBody() != 0) {
+      req.GetBody()->get_value(&body);
+    }
+    out << kHeader.line.method << ' ' << kHeader.line.target.get_path().size() << ' '
+        << kHeader.line.target.get_query().size() << ' ' << kHeader.host << ' '
+        << body << '\n';
+  }
+  return out.str();
+}
+/**
+ * Клиент передаёт запрос со слишком большим телом и продолжает передавать
+ * тело, пока читает ответ сервера.
+ * @return  полученный ответ; *error - ошибка чтения (0 - соединение закрыто
+ *          сервером штатно)
+ */
+static std::string SendTooLargeBody(webapp::Server::Backend backend,
+                                    uint16_t                port,
+                                    int                    *error) {
+  typedef std::chrono::steady_clock Clock;
+  webapp::ServerHttp srv(webapp::ProtocolHTTP::Router::Create());
+  srv.SetBackend(backend);
+  BOOST_REQUIRE(srv.BindTo(webapp::Server::kLoopbackAddress, port,
+                           webapp::Inspector::Ptr()));
+  const int kFd = ConnectClient(port);
+  BOOST_REQUIRE(kFd >= 0);
+  const std::string kHeader("POST /upload HTTP/1.1\r\nContent-Length: 1000000000\r\n\r\n");
+  const std::string kBody(64 * 1024, 'a');
+  BOOST_REQUIRE(send(kFd, kHeader.data(), kHeader.size(), MSG_NOSIGNAL) ==
+                static_cast<ssize_t>(kHeader.size()));
+  std::string resp;
+  *error = -1;
+  const Clock::time_point kStart = Clock::now();
+  while (*error < 0 && Clock::now() - kStart < std::chrono::milliseconds(3000)) {
+    send(kFd, kBody.data(), kBody.size(), MSG_NOSIGNAL);
+    srv.Run();
+    char buff[1024];
+    const ssize_t kSize = recv(kFd, buff, sizeof(buff), 0);
+    if (kSize > 0) {
+      resp.append(buff, kSize);
+    } else if (kSize == 0) {
+      *error = 0;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      *error = errno;
+    }
+  }
+  close(kFd);
+  srv.Unbind();
+  return resp;
+}
 // -----------------------------------------------------------------------------
 // Инициализация набора тестов
 BOOST_FIXTURE_TEST_SUITE(ProtocolTestSuite, ProtocolTestFixture)
@@ -323,33 +456,45 @@ BOOST_AUTO_TEST_CASE(HttpUriPathTest) {
   BOOST_CHECK(uri.ParseVal("http://google.com/%D0%BF%D1%80%D0%BE%D0%B2%2F%D0%B5%D1%80%D0%BA%D0%B0/node"));
   BOOST_CHECK(uri.get_path().size() == 2);
   BOOST_CHECK(uri.get_path().at(0) == "пров/ерка");
+  // пустые сегменты пропускаются, вектор пути ровно по количеству сегментов
+  webapp::ProtocolHTTP::Uri fresh;
+  BOOST_CHECK(fresh.ParseVal("/a//bb///c/?q#f"));
+  BOOST_CHECK(fresh.get_path().size() == 3);
+  BOOST_CHECK(fresh.get_path().capacity() == 3);
+  BOOST_CHECK(fresh.get_path().at(1) == "bb" && fresh.get_path().at(2) == "c");
+  // участок строки разбирается без копирования, за его пределы разбор не выходит
+  const std::string kLine("GET /x/y?k=v HTTP/1.1");
+  BOOST_CHECK(uri.Parse(boost::string_ref(kLine).substr(4, 8), 0));
+  BOOST_CHECK(uri.get_path().size() == 2 && uri.get_path().at(1) == "y");
+  BOOST_CHECK(uri.get_query().Get("k") == "v");
 }
 
 BOOST_AUTO_TEST_CASE(HttpUriQueryTest) {
   webapp::ProtocolHTTP::Uri uri;
   BOOST_CHECK(uri.ParseVal("http://google.com/node0?var_0=val_0&var_1=val_1"));
   BOOST_CHECK(uri.get_query().size() == 2);
-  BOOST_CHECK(uri.get_query().find("var_0")->second == "val_0");
-  BOOST_CHECK(uri.get_query().find("var_1")->second == "val_1");
+  BOOST_CHECK(uri.get_query().Get("var_0") == "val_0");
+  BOOST_CHECK(uri.get_query().Get("var_1") == "val_1");
 
   BOOST_CHECK(not uri.ParseVal("http://google.com/node0?var_0=val_0&var_1= val_1"));
   BOOST_CHECK(uri.get_query().size() == 1);
-  BOOST_CHECK(uri.get_query().find("var_0")->second == "val_0");
+  BOOST_CHECK(uri.get_query().Get("var_0") == "val_0");
 
   BOOST_CHECK(uri.ParseVal("http://google.com/node0?%D1%82%D0%B5%D1%81%D1%82%3D%D1%80%D0%B0%D0%B1%D0%BE%D1%82%D1%8B=%D0%BF%D1%80%D0%BE%D0%B9%D0%B4%D0%B5%D0%BD"));
   BOOST_CHECK(uri.get_query().size() == 1);
-  BOOST_CHECK(uri.get_query().find("тест=работы")->second == "пройден");
+  BOOST_CHECK(uri.get_query().Get("тест=работы") == "пройден");
 
   BOOST_CHECK(uri.ParseVal("http://google.com/node0?var_0=&=val_1"));
   BOOST_CHECK(uri.get_query().size() == 2);
-  BOOST_CHECK(uri.get_query().find("var_0")->second == "");
-  BOOST_CHECK(uri.get_query().find("")->second == "val_1");
+  std::string empty_val("-");
+  BOOST_CHECK(uri.get_query().Find("var_0", &empty_val) && empty_val == "");
+  BOOST_CHECK(uri.get_query().Get("") == "val_1");
 
   const std::string kUrl("http://192.168.7.223/action/update/firmware?from=");
   const std::string kFromVal("ftp://jenny/firmwares/F1772/cortex_a8.regigraf.1772.53.UNIVERSAL-last.rbf");
   BOOST_CHECK(uri.ParseVal(kUrl + kFromVal));
   BOOST_CHECK(uri.get_query().size() == 1);
-  BOOST_CHECK(uri.get_query().find("from")->second == kFromVal);
+  BOOST_CHECK(uri.get_query().Get("from") == kFromVal);
 }
 
 BOOST_AUTO_TEST_CASE(HttpUriFragmentTest) {
@@ -479,7 +624,7 @@ BOOST_AUTO_TEST_CASE(ProtocolHTTPRequestFieldsTest) {
 
   BOOST_CHECK(proto.ParseRequest(buff.get(), kBuffActSize, &req));
   BOOST_CHECK(req.Completed());
-  CheckRequestHeader(req.GetHeader());
+  CheckRequestHeader(req);
   CheckPostRequest(req);
 }
 
@@ -533,7 +678,7 @@ BOOST_AUTO_TEST_CASE(ProtocolHTTPPartialRequestTest) {
       BOOST_CHECK(req.Completed());
     }
   }
-  CheckRequestHeader(req.GetHeader());
+  CheckRequestHeader(req);
   CheckPostRequest(req);
 }
 
@@ -563,7 +708,7 @@ BOOST_AUTO_TEST_CASE(ProtocolHTTPGetRequestTypeCastTest) {
   webapp::ProtocolHTTP::ArrayOfBytes buff(new webapp::ProtocolHTTP::Byte[kBuffMaxSize]);
   ProtocolTestFixture::Packet pkt;
   pkt.AddStartLine("GET",
-      "/hello.txt?var_0=777&var_1=666",
+      "/hello.txt?var_0=777&var_1=666&big=4294967297&small=-2147483649",
       "HTTP/1.1");
   pkt.AddField("User-Agent", kUserAgent);
   pkt.AddField("Host", kHost);
@@ -576,6 +721,10 @@ BOOST_AUTO_TEST_CASE(ProtocolHTTPGetRequestTypeCastTest) {
 
   BOOST_CHECK(req.Get("var_0", (int)0) == 777);
   BOOST_CHECK(req.Get("var_1", (int)0) == 666);
+  // значение за пределами int не усекается
+  BOOST_CHECK(req.Get("big", (int)5) == 5);
+  BOOST_CHECK(req.Get("small", (int)5) == 5);
+  BOOST_CHECK(req.Get("big", (int64_t)5) == 4294967297LL);
 }
 
 BOOST_AUTO_TEST_CASE(ProtocolHTTPCopyingOfRequestTest) {
@@ -585,17 +734,17 @@ BOOST_AUTO_TEST_CASE(ProtocolHTTPCopyingOfRequestTest) {
   webapp::ProtocolHTTP::Request req;
   webapp::ProtocolHTTP          proto(webapp::ProtocolHTTP::Router::Create());
   BOOST_CHECK(proto.ParseRequest(buff.get(), kBuffActSize, &req));
-  CheckRequestHeader(req.GetHeader());
+  CheckRequestHeader(req);
   // copy constructor
   {
     webapp::ProtocolHTTP::Request tmp_req(req);
-    CheckRequestHeader(tmp_req.GetHeader());
+    CheckRequestHeader(tmp_req);
   }
   // copy operator
   {
     webapp::ProtocolHTTP::Request tmp_req;
     tmp_req = req;
-    CheckRequestHeader(tmp_req.GetHeader());
+    CheckRequestHeader(tmp_req);
   }
 }
 
@@ -908,4 +1057,956 @@ BOOST_AUTO_TEST_CASE(ProtocolHTTPRouterCallHandlerForUrlTest) {
   BOOST_CHECK(router_handler_0_active);
 }
 
+static
+bool TextRouterHandler(const webapp::ProtocolHTTP::Uri::Path &,
+                       const webapp::ProtocolHTTP::Request   &,
+                             webapp::ProtocolHTTP::Response  *response) {
+  response->SetBody("ok");
+  return true;
+}
+
+static std::string HandleRawRequest(webapp::ProtocolHTTP *proto,
+                                    const std::string    &raw_req) {
+  static const size_t kBuffSz = 1024;
+  boost::scoped_array<webapp::Protocol::Byte> buff(new webapp::Protocol::Byte[kBuffSz]);
+  memcpy(buff.get(), raw_req.c_str(), raw_req.size());
+  std::string resp_text;
+  if (proto->HandleRequest(buff.get(), raw_req.size())) {
+    return resp_text;
+  }
+  do {
+    const webapp::USize kRespSz = proto->PrepareResponse(buff.get(), kBuffSz);
+    if (kRespSz == 0) {
+      break;
+    }
+    resp_text.append(reinterpret_cast<char*>(buff.get()), kRespSz);
+  } while (1);
+  return resp_text;
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPKeepAliveTest) {
+  webapp::ProtocolHTTP::Router::Ptr rt(webapp::ProtocolHTTP::Router::Create());
+  BOOST_CHECK(rt->AddHandlerFor("/node0", TextRouterHandler));
+  webapp::ProtocolHTTP proto(rt, webapp::ProtocolHTTP::KeepAlive(3, 7));
+  const std::string kReq("GET /node0 HTTP/1.1\r\nHost: " + kHost + "\r\n");
+  // HTTP/1.1 по умолчанию сохраняет соединение
+  std::string resp = HandleRawRequest(&proto, kReq + "\r\n");
+  BOOST_CHECK(resp.find("HTTP/1.1 200 OK\r\n") == 0);
+  BOOST_CHECK(resp.find("Connection: keep-alive\r\n") != std::string::npos);
+  BOOST_CHECK(resp.find("Keep-Alive: timeout=7, max=2\r\n") != std::string::npos);
+  BOOST_CHECK(not proto.NeedToCloseSession());
+  // клиент просит закрыть соединение
+  resp = HandleRawRequest(&proto, kReq + "Connection: Close\r\n\r\n");
+  BOOST_CHECK(resp.find("Connection: close\r\n") != std::string::npos);
+  BOOST_CHECK(proto.NeedToCloseSession());
+  // HTTP/1.0 сохраняет соединение только по запросу клиента
+  webapp::ProtocolHTTP proto_1_0(rt);
+  HandleRawRequest(&proto_1_0, "GET /node0 HTTP/1.0\r\n\r\n");
+  BOOST_CHECK(proto_1_0.NeedToCloseSession());
+  webapp::ProtocolHTTP proto_ka(rt);
+  HandleRawRequest(&proto_ka, "GET /node0 HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+  BOOST_CHECK(not proto_ka.NeedToCloseSession());
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPKeepAliveLimitTest) {
+  webapp::ProtocolHTTP::Router::Ptr rt(webapp::ProtocolHTTP::Router::Create());
+  webapp::ProtocolHTTP proto(rt, webapp::ProtocolHTTP::KeepAlive(2, 5));
+  const std::string kReq("GET /node0 HTTP/1.1\r\nHost: " + kHost + "\r\n\r\n");
+  std::string resp = HandleRawRequest(&proto, kReq);
+  BOOST_CHECK(resp.find("HTTP/1.1 404 Not Found\r\n") == 0);
+  BOOST_CHECK(not proto.NeedToCloseSession());
+  resp = HandleRawRequest(&proto, kReq);
+  BOOST_CHECK(resp.find("HTTP/1.1 404 Not Found\r\n") == 0);
+  BOOST_CHECK(resp.find("Connection: close\r\n") != std::string::npos);
+  BOOST_CHECK(proto.NeedToCloseSession());
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPConsumedBytesTest) {
+  webapp::ProtocolHTTP          proto(webapp::ProtocolHTTP::Router::Create());
+  webapp::ProtocolHTTP::Request req;
+  const std::string kReq("GET /node0 HTTP/1.1\r\nHost: " + kHost + "\r\n\r\n");
+  const std::string kNext("GET /node1 HTTP/1.1\r\n");
+  std::string raw(kReq + kNext);
+  size_t used = 0;
+  BOOST_CHECK(proto.ParseRequest((webapp::Protocol::Byte*)&raw[0], raw.size(), &req, &used));
+  BOOST_CHECK(req.Completed());
+  BOOST_CHECK(used == kReq.size());
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPPipeliningTest) {
+  webapp::ProtocolHTTP::Router::Ptr rt(webapp::ProtocolHTTP::Router::Create());
+  BOOST_CHECK(rt->AddHandlerFor("/node0", TextRouterHandler));
+  webapp::ProtocolHTTP proto(rt);
+  const std::string kReq0("GET /node0 HTTP/1.1\r\nHost: " + kHost + "\r\n\r\n");
+  const std::string kReq1("GET /node1 HTTP/1.1\r\nHost: " + kHost + "\r\n\r\n");
+  const std::string kReq2("GET /node0 HTTP/1.1\r\nHost: " + kHost + "\r\n");
+  // ответы на запросы, полученные одним пакетом, отправляются по порядку
+  const std::string kResp = HandleRawRequest(&proto, kReq0 + kReq1 + kReq2);
+  const size_t kOk0   = kResp.find("HTTP/1.1 200 OK\r\n");
+  const size_t kNotFd = kResp.find("HTTP/1.1 404 Not Found\r\n");
+  BOOST_CHECK(kOk0 == 0);
+  BOOST_CHECK(kNotFd != std::string::npos && kNotFd > kOk0);
+  BOOST_CHECK(kResp.find("HTTP/1.1 200 OK\r\n", kNotFd) == std::string::npos);
+  BOOST_CHECK(not proto.NeedToCloseSession());
+  // незавершённый третий запрос дополняется следующей порцией данных
+  const std::string kResp2 = HandleRawRequest(&proto, "\r\n");
+  BOOST_CHECK(kResp2.find("HTTP/1.1 200 OK\r\n") == 0);
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPResetTest) {
+  webapp::ProtocolHTTP::Router::Ptr rt(webapp::ProtocolHTTP::Router::Create());
+  BOOST_CHECK(rt->AddHandlerFor("/node0", TextRouterHandler));
+  webapp::ProtocolHTTP proto(rt, webapp::ProtocolHTTP::KeepAlive(1, 5));
+  const std::string kReq("GET /node0 HTTP/1.1\r\nHost: " + kHost + "\r\n\r\n");
+  BOOST_CHECK(HandleRawRequest(&proto, kReq).find("HTTP/1.1 200 OK\r\n") == 0);
+  BOOST_CHECK(proto.NeedToCloseSession());
+  // после сброса объект готов обслуживать новое подключение
+  BOOST_CHECK(proto.Reset());
+  BOOST_CHECK(not proto.NeedToCloseSession());
+  BOOST_CHECK(HandleRawRequest(&proto, "GET /node0 HTTP/1.1\r\n").size() == 0);
+  BOOST_CHECK(proto.Reset());
+  BOOST_CHECK(HandleRawRequest(&proto, kReq).find("HTTP/1.1 200 OK\r\n") == 0);
+}
+
+static std::string HandleRawRequestChunks(webapp::ProtocolHTTP *proto,
+                                          const std::string    &raw_req,
+                                          size_t               *writes) {
+  std::vector<webapp::Protocol::Byte> buff(raw_req.begin(), raw_req.end());
+  std::string resp_text;
+  *writes = 0;
+  if (proto->HandleRequest(&buff[0], buff.size())) {
+    return resp_text;
+  }
+  webapp::Protocol::Chunks chunks;
+  while (proto->PrepareResponseChunks(&chunks) && chunks.size() > 0) {
+    webapp::Protocol::Chunks::const_iterator it = chunks.begin();
+    for (; it != chunks.end(); it++) {
+      resp_text.append(reinterpret_cast<const char*>(it->data), it->size);
+    }
+    (*writes)++;
+  }
+  return resp_text;
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPResponseChunksTest) {
+  webapp::ProtocolHTTP::Router::Ptr rt(webapp::ProtocolHTTP::Router::Create());
+  BOOST_CHECK(rt->AddHandlerFor("/node0", TextRouterHandler));
+  webapp::ProtocolHTTP proto(rt);
+  webapp::ProtocolHTTP proto_chunks(rt);
+  const std::string kReq0("GET /node0 HTTP/1.1\r\nHost: " + kHost + "\r\n\r\n");
+  const std::string kReq1("GET /node1 HTTP/1.1\r\nHost: " + kHost + "\r\n\r\n");
+  // заголовок и тело ответа передаются одной операцией записи
+  size_t writes = 0;
+  const std::string kResp = HandleRawRequestChunks(&proto_chunks, kReq0, &writes);
+  BOOST_CHECK(kResp == HandleRawRequest(&proto, kReq0));
+  BOOST_CHECK(kResp.find("\r\n\r\nok") != std::string::npos);
+  BOOST_CHECK(writes == 1);
+  // ответы на конвейерные запросы не смешиваются
+  const std::string kResp2 = HandleRawRequestChunks(&proto_chunks, kReq0 + kReq1, &writes);
+  BOOST_CHECK(kResp2 == HandleRawRequest(&proto, kReq0 + kReq1));
+  BOOST_CHECK(writes == 2);
+  BOOST_CHECK(not proto_chunks.NeedToCloseSession());
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPResponseFileChunkTest) {
+  webapp::ProtocolHTTP::Response::SourceFromFile f_src_0("/etc/hosts");
+  webapp::ProtocolHTTP::Response::SourceFromFile f_src_1("fail.txt");
+  webapp::Protocol::Chunk chunk;
+  // тело из файла передаётся участком файла, а не копией данных
+  BOOST_CHECK(f_src_0.ReadChunk(&chunk, 1024));
+  BOOST_CHECK(chunk.data == 0);
+  BOOST_CHECK(chunk.file >= 0);
+  BOOST_CHECK(chunk.offset == 0);
+  BOOST_CHECK(chunk.size == f_src_0.Size());
+  BOOST_CHECK(not f_src_0.IsAvailable());
+  BOOST_CHECK(not f_src_1.ReadChunk(&chunk, 1024));
+}
+
+BOOST_AUTO_TEST_CASE(ServerEndpointsTest) {
+  typedef webapp::Server::Endpoint Endpoint;
+  const std::string kSocketPath("webapp_test.sock");
+  webapp::ServerHttp        srv(webapp::ProtocolHTTP::Router::Create());
+  webapp::Server::Endpoints endpoints;
+  // нераспознанный адрес, либо адрес другого семейства
+  endpoints.push_back(Endpoint::IPv6("127.0.0.1", 8080));
+  BOOST_CHECK(not srv.BindTo(endpoints, webapp::Inspector::Ptr()));
+  endpoints.clear();
+  BOOST_CHECK(not srv.BindTo(endpoints, webapp::Inspector::Ptr()));
+  // файл сокета Unix создаётся при открытии и удаляется при закрытии
+  endpoints.push_back(Endpoint::Local(kSocketPath));
+  BOOST_CHECK(srv.BindTo(endpoints, webapp::Inspector::Ptr()));
+  BOOST_CHECK(boost::filesystem::exists(kSocketPath));
+  BOOST_CHECK(srv.BindTo(endpoints, webapp::Inspector::Ptr()));
+  // файл работающего сервера не удаляется другим
+  webapp::ServerHttp other(webapp::ProtocolHTTP::Router::Create());
+  BOOST_CHECK_THROW(other.BindTo(endpoints, webapp::Inspector::Ptr()),
+                    boost::system::system_error);
+  other.Unbind();
+  BOOST_CHECK(boost::filesystem::exists(kSocketPath));
+  srv.Unbind();
+  BOOST_CHECK(not boost::filesystem::exists(kSocketPath));
+  // файл, оставшийся от закрытого сокета, удаляется при открытии
+  const int kFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, kSocketPath.c_str(), sizeof(addr.sun_path) - 1);
+  BOOST_CHECK(bind(kFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+  close(kFd);
+  BOOST_CHECK(boost::filesystem::exists(kSocketPath));
+  BOOST_CHECK(srv.BindTo(endpoints, webapp::Inspector::Ptr()));
+  srv.Unbind();
+  BOOST_CHECK(not boost::filesystem::exists(kSocketPath));
+  BOOST_CHECK(Endpoint::IPv4(webapp::Server::kLoopbackAddress, 80).address ==
+              "127.0.0.1");
+}
+
+BOOST_AUTO_TEST_CASE(ArenaTest) {
+  webapp::Arena arena(256);
+  void *first = arena.Allocate(10, 1);
+  void *aligned = arena.Allocate(sizeof(double), alignof(double));
+  BOOST_CHECK(reinterpret_cast<uintptr_t>(aligned) % alignof(double) == 0);
+  BOOST_CHECK(arena.Used() >= 10 + sizeof(double));
+  // крупный запрос и переполнение блока
+  BOOST_CHECK(arena.Allocate(1024, 1) != 0);
+  BOOST_CHECK(arena.Allocate(200, 1) != 0);
+  // после сброса память первого блока используется повторно
+  arena.Reset();
+  BOOST_CHECK(arena.Used() == 0);
+  BOOST_CHECK(arena.Allocate(10, 1) == first);
+  const webapp::ArenaAllocator<char> kAlloc(&arena);
+  webapp::ArenaString str(100, 'a', kAlloc);
+  BOOST_CHECK(str.get_allocator().get_arena() == &arena);
+  // копия не ссылается на память арены
+  const webapp::ArenaString kCopy(str);
+  BOOST_CHECK(kCopy.get_allocator().get_arena() == 0);
+  BOOST_CHECK(kCopy == str);
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPSplitHeaderTest) {
+  const std::string kReq("\r\nGET /hello.txt HTTP/1.1\r\n"
+                         "Host: " + kHost + "\r\n"
+                         "User-Agent: " + kUserAgent + "\r\n"
+                         "Accept-Language: " + kAcceptLanguage + "\r\n"
+                         "Content-Type: text/plain; charset=\"utf-8\"\r\n\r\n");
+  webapp::ProtocolHTTP                proto(webapp::ProtocolHTTP::Router::Create());
+  webapp::ProtocolHTTP::Request       req;
+  std::vector<webapp::Protocol::Byte> data(kReq.begin(), kReq.end());
+  // строки разорваны между пакетами в любом месте, в том числе между CR и LF
+  for (size_t off = 0; off < data.size(); off++) {
+    BOOST_CHECK(proto.ParseRequest(&data[off], 1, &req));
+    BOOST_CHECK(req.Completed() == (off + 1 == data.size()));
+  }
+  const webapp::ProtocolHTTP::Header &kHead = req.GetHeader();
+  BOOST_CHECK(kHead.line.method == webapp::ProtocolHTTP::kGet);
+  BOOST_CHECK(kHead.line.target.get_path().at(0) == "hello.txt");
+  BOOST_CHECK(kHead.line.version == "HTTP/1.1");
+  BOOST_CHECK(kHead.host == kHost);
+  BOOST_CHECK(kHead.user_agent == kUserAgent);
+  CheckListOfStrings(req.GetAccept().language, ',', kAcceptLanguage);
+  BOOST_CHECK(kHead.content.type.name == webapp::ProtocolHTTP::Content::Type::kText);
+  BOOST_CHECK(kHead.content.type.sub_type == "plain");
+  BOOST_CHECK(kHead.content.type.charset == "utf-8");
+}
+
+BOOST_AUTO_TEST_CASE(TimingWheelTest) {
+  typedef webapp::TimingWheel<int> Wheel;
+  static const webapp::USize kTicksPerSecond = 1000 / Wheel::kTickMs;
+  Wheel                wheel;
+  Wheel::Handle        handles[3];
+  Wheel::ListOfExpired expired;
+  // три срока в одной ячейке, средний отменён, первый переустановлен
+  for (int id = 0; id < 3; id++) {
+    wheel.Arm(&handles[id], id, 1);
+  }
+  wheel.Cancel(&handles[1]);
+  wheel.Arm(&handles[0], 0, 2);
+  for (webapp::USize tick = 0; tick < kTicksPerSecond; tick++) {
+    wheel.Tick(&expired);
+  }
+  BOOST_REQUIRE(expired.size() == 1);
+  BOOST_CHECK(expired[0].session == 2 && expired[0].generation == handles[2].generation);
+  BOOST_CHECK(not handles[1].armed && not handles[2].armed && handles[0].armed);
+  expired.clear();
+  for (webapp::USize tick = 0; tick < kTicksPerSecond; tick++) {
+    wheel.Tick(&expired);
+  }
+  BOOST_REQUIRE(expired.size() == 1);
+  BOOST_CHECK(expired[0].session == 0);
+  // срок длиннее оборота колеса
+  expired.clear();
+  const webapp::USize kLong = Wheel::kSlotsAmount / kTicksPerSecond + 1;
+  wheel.Arm(&handles[1], 1, kLong);
+  for (webapp::USize tick = 0; tick + 1 < kLong * kTicksPerSecond; tick++) {
+    wheel.Tick(&expired);
+  }
+  BOOST_CHECK(expired.size() == 0 && handles[1].armed);
+  wheel.Tick(&expired);
+  BOOST_CHECK(expired.size() == 1 && not handles[1].armed);
+}
+
+BOOST_AUTO_TEST_CASE(ByteScanTest) {
+  typedef webapp::ByteScan Scan;
+  const Scan::Level kSelected = Scan::GetLevel();
+  std::vector<uint8_t> data(100, 'a');
+  data[37] = ':';
+  data[70] = '\n';
+  data[99] = ' ';
+  const Scan::Level kLevels[] = {Scan::kScalar, Scan::kSse2, Scan::kAvx2};
+  for (size_t id = 0; id < sizeof(kLevels) / sizeof(kLevels[0]); id++) {
+    if (not Scan::UseLevel(kLevels[id])) {
+      continue;
+    }
+    // все смещения и длины, включая хвосты короче блока
+    for (size_t off = 0; off < data.size(); off++) {
+      const size_t kSize = data.size() - off;
+      const size_t kLF   = (off <= 70 ? 70 - off : kSize);
+      const size_t kAny  = (off <= 37 ? 37 - off : (off <= 99 ? 99 - off : kSize));
+      BOOST_CHECK(Scan::Find(&data[off], kSize, '\n') == kLF);
+      BOOST_CHECK(Scan::FindEither(&data[off], kSize, ':', ' ') == kAny);
+      BOOST_CHECK(Scan::Find(&data[off], kSize, 'z') == kSize);
+    }
+  }
+  BOOST_CHECK(Scan::UseLevel(kSelected));
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPChunkedBodyTest) {
+  const std::string kReq("POST /node0 HTTP/1.1\r\n"
+                         "Host: " + kHost + "\r\n"
+                         "Transfer-Encoding: chunked\r\n\r\n"
+                         "5\r\nhello\r\n"
+                         "6;name=value\r\n world\r\n"
+                         "0\r\nX-Trailer: 1\r\n\r\n");
+  const std::string kNext("GET /node1 HTTP/1.1\r\n");
+  webapp::ProtocolHTTP                proto(webapp::ProtocolHTTP::Router::Create());
+  webapp::ProtocolHTTP::Request       req;
+  std::vector<webapp::Protocol::Byte> data(kReq.begin(), kReq.end());
+  // разбор продолжается с любого байта
+  for (size_t off = 0; off < data.size(); off++) {
+    BOOST_CHECK(proto.ParseRequest(&data[off], 1, &req));
+    BOOST_CHECK(req.Completed() == (off + 1 == data.size()));
+  }
+  BOOST_CHECK(req.GetError() == webapp::ProtocolHTTP::k200);
+  BOOST_CHECK(req.GetHeader().content.length == 11);
+  // тело по Content-Length завершает запрос, остаток - следующий запрос
+  webapp::ProtocolHTTP::Request req_len;
+  std::string raw("POST /node0 HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello" + kNext);
+  size_t used = 0;
+  BOOST_CHECK(proto.ParseRequest((webapp::Protocol::Byte*)&raw[0], raw.size(), &req_len, &used));
+  BOOST_CHECK(req_len.Completed());
+  BOOST_CHECK(used == raw.size() - kNext.size());
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPRequestErrorsTest) {
+  webapp::ProtocolHTTP::Router::Ptr rt(webapp::ProtocolHTTP::Router::Create());
+  BOOST_CHECK(rt->AddHandlerFor("/node0", TextRouterHandler));
+  const webapp::ProtocolHTTP::RequestLimits kLimits(64, 256, 16);
+  const std::string kField("X-Field: " + std::string(50, 'a') + "\r\n");
+  const std::string kLongVal(100, 'a');
+  const std::pair<std::string, std::string> kCases[] = {
+    std::make_pair("GET /node0 HTTP/1.1\r\nX-Long: " + kLongVal + "\r\n\r\n",
+                   "431 Request Header Fields Too Large"),
+    std::make_pair("GET /node0 HTTP/1.1\r\n" + kField + kField + kField + kField +
+                   kField + "\r\n",
+                   "431 Request Header Fields Too Large"),
+    std::make_pair("GET /" + kLongVal + " HTTP/1.1\r\n\r\n", "414 URI Too Long"),
+    std::make_pair("POST /node0 HTTP/1.1\r\nContent-Length: 17\r\n\r\n",
+                   "413 Payload Too Large"),
+    std::make_pair("POST /node0 HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                   "a\r\n0123456789\r\n7\r\n",
+                   "413 Payload Too Large"),
+    std::make_pair("POST /node0 HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+                   "400 Bad Request"),
+    std::make_pair("POST /node0 HTTP/1.1\r\nContent-Length: 1\r\n"
+                   "Content-Length: 2\r\n\r\n", "400 Bad Request"),
+    std::make_pair("POST /node0 HTTP/1.1\r\nContent-Length: 1\r\n"
+                   "Transfer-Encoding: chunked\r\n\r\n", "400 Bad Request"),
+    std::make_pair("POST /node0 HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                   "z\r\n", "400 Bad Request"),
+    std::make_pair("GET /node0 HTTP/1.1\r\nHost : x\r\n\r\n", "400 Bad Request"),
+    std::make_pair("GET /node0\r\n\r\n", "400 Bad Request"),
+    std::make_pair("BREW /node0 HTTP/1.1\r\n\r\n", "501 Not Implemented"),
+    std::make_pair("GET /node0 HTTP/2.0\r\n\r\n", "505 HTTP Version Not Supported")
+  };
+  for (size_t id = 0; id < sizeof(kCases) / sizeof(kCases[0]); id++) {
+    webapp::ProtocolHTTP proto(rt, webapp::ProtocolHTTP::KeepAlive(), kLimits);
+    const std::string kResp = HandleRawRequest(&proto, kCases[id].first);
+    BOOST_CHECK_MESSAGE(kResp.find("HTTP/1.1 " + kCases[id].second + "\r\n") == 0,
+                        "case " << id << ": " << kResp.substr(0, kResp.find('\r')));
+    BOOST_CHECK(kResp.find("Connection: close\r\n") != std::string::npos);
+    BOOST_CHECK(proto.NeedToCloseSession());
+  }
+  // тело хранится в памяти, поэтому ограничено и без явных настроек
+  webapp::ProtocolHTTP proto(rt);
+  const std::string kResp = HandleRawRequest(&proto, "POST /node0 HTTP/1.1\r\n"
+                                                     "Content-Length: 1073741824\r\n\r\n");
+  BOOST_CHECK(kResp.find("HTTP/1.1 413 Payload Too Large\r\n") == 0);
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPMemoryLimitTest) {
+  // ограничение по умолчанию действует только на данные в памяти: файл из
+  // части multipart в хранилище генератора может быть больше
+  static const size_t kStep = 64 * 1024;
+  const std::string kBody(
+    "--xYzZY\r\n"
+    "Content-Disposition: form-data; name=\"file\"; filename=\"a.bin\"\r\n"
+    "Content-Type: application/octet-stream\r\n\r\n" +
+    std::string(webapp::ProtocolHTTP::RequestLimits::kDefMemory + 1024, 'a') +
+    "\r\n--xYzZY--\r\n");
+  const std::string kRaw(
+    "POST /upload HTTP/1.1\r\n"
+    "Content-Type: multipart/form-data; boundary=xYzZY\r\n"
+    "Content-Length: " + std::to_string(kBody.size()) + "\r\n\r\n" + kBody);
+  webapp::ProtocolHTTP proto(webapp::ProtocolHTTP::Router::Create());
+  for (size_t id = 0; id < 2; id++) {
+    std::string raw(kRaw);
+    webapp::ProtocolHTTP::Request req;
+    if (id == 0) {
+      req.UseStorageGenerator(StorageGenerator);
+    }
+    bool parsed = true;
+    for (size_t off = 0; parsed && off < raw.size(); off += kStep) {
+      parsed = proto.ParseRequest((webapp::Protocol::Byte*)&raw[off],
+                                  std::min(kStep, raw.size() - off), &req);
+    }
+    if (id == 0) {
+      BOOST_CHECK(parsed && req.Completed());
+      BOOST_CHECK(req.Post("file") != 0 &&
+                  req.Post("file")->GetNameOfStorage() == StorageTest::GetStaticName());
+    } else {
+      BOOST_CHECK(not parsed && req.GetError() == webapp::ProtocolHTTP::k413);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPFieldNamesCaseTest) {
+  const std::string kReq("POST /node0 HTTP/1.1\r\n"
+                         "HOST: " + kHost + "\r\n"
+                         "user-agent: " + kUserAgent + "\r\n"
+                         "accept-ENCODING: " + kAcceptEncoding + "\r\n"
+                         "content-length: 5\r\n"
+                         "Cookie: a=1\r\n"
+                         "X-Forwarded-For: 10.0.0.1\r\n"
+                         "x-forwarded-for: 10.0.0.2\r\n\r\n"
+                         "hello");
+  webapp::ProtocolHTTP          proto(webapp::ProtocolHTTP::Router::Create());
+  webapp::ProtocolHTTP::Request req;
+  std::string raw(kReq + "GET /node1 HTTP/1.1\r\n");
+  size_t used = 0;
+  BOOST_CHECK(proto.ParseRequest((webapp::Protocol::Byte*)&raw[0], raw.size(), &req, &used));
+  BOOST_CHECK(req.Completed());
+  BOOST_CHECK(used == kReq.size());
+  const webapp::ProtocolHTTP::Header &kHead = req.GetHeader();
+  BOOST_CHECK(kHead.host == kHost);
+  BOOST_CHECK(kHead.user_agent == kUserAgent);
+  BOOST_CHECK(kHead.content.length == 5);
+  CheckListOfStrings(req.GetAccept().encoding, ',', kAcceptEncoding);
+  // поля в исходном виде
+  std::string value;
+  BOOST_CHECK(req.GetField("cookie", &value) && value == "a=1");
+  BOOST_CHECK(req.GetField("X-Forwarded-For", &value) &&
+              value == "10.0.0.1, 10.0.0.2");
+  BOOST_CHECK(req.GetField("Host", &value) && value == kHost);
+  BOOST_CHECK(not req.GetField("Range", &value));
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPLazyFieldsTest) {
+  const std::string kReq("GET /node0 HTTP/1.1\r\n"
+                         "Host: " + kHost + "\r\n"
+                         "Cookie: sid=\"abc\"; theme=dark\r\n"
+                         "Cookie: sid=other; lang=ru\r\n"
+                         "If-None-Match: \"v1\", W/\"v2\"\r\n"
+                         "Range: bytes=0-499, 500-, -100\r\n\r\n");
+  webapp::ProtocolHTTP          proto(webapp::ProtocolHTTP::Router::Create());
+  webapp::ProtocolHTTP::Request req;
+  std::string raw(kReq);
+  BOOST_CHECK(proto.ParseRequest((webapp::Protocol::Byte*)&raw[0], raw.size(), &req));
+  BOOST_CHECK(req.Completed());
+  // поля без значений в запросе
+  BOOST_CHECK(req.GetAccept().language.size() == 0);
+  BOOST_CHECK(req.GetContentLocation().get_path().size() == 0);
+  const webapp::ProtocolHTTP::Cookies &kCookies = req.GetCookies();
+  BOOST_CHECK(kCookies.size() == 3);
+  BOOST_CHECK(kCookies.at("sid") == "abc");
+  BOOST_CHECK(kCookies.at("theme") == "dark");
+  BOOST_CHECK(kCookies.at("lang") == "ru");
+  // повторное обращение возвращает сохранённый результат
+  BOOST_CHECK(&req.GetCookies() == &kCookies);
+  const webapp::ProtocolHTTP::ListOfString &kTags = req.GetIfNoneMatch();
+  BOOST_CHECK(kTags.size() == 2);
+  BOOST_CHECK(kTags.front() == "\"v1\"");
+  BOOST_CHECK(kTags.back() == "W/\"v2\"");
+  const webapp::ProtocolHTTP::ByteRanges &kRanges = req.GetRanges();
+  BOOST_CHECK(kRanges.size() == 3);
+  BOOST_CHECK(kRanges.at(0).first == 0   && kRanges.at(0).last == 499);
+  BOOST_CHECK(kRanges.at(1).first == 500 && kRanges.at(1).last == -1);
+  BOOST_CHECK(kRanges.at(2).first == -1  && kRanges.at(2).last == 100);
+  // ошибочное поле Range игнорируется
+  const char *kBadRanges[] = {"bytes=5-1", "items=0-1", "bytes=-", "bytes=1-x"};
+  for (size_t id = 0; id < sizeof(kBadRanges) / sizeof(kBadRanges[0]); id++) {
+    webapp::ProtocolHTTP::Request bad_req;
+    std::string bad_raw("GET /node0 HTTP/1.1\r\nRange: " +
+                        std::string(kBadRanges[id]) + "\r\n\r\n");
+    BOOST_CHECK(proto.ParseRequest((webapp::Protocol::Byte*)&bad_raw[0],
+                                   bad_raw.size(), &bad_req));
+    BOOST_CHECK(bad_req.GetRanges().size() == 0);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(HttpUriClassesTest) {
+  webapp::ProtocolHTTP::Uri uri;
+  BOOST_CHECK(uri.ParseVal("http://user@example.com:8080/a/b%20c?k1=v%261&flag&&=v3#top"));
+  BOOST_CHECK(uri.get_authority().userinfo == "user");
+  BOOST_CHECK(uri.get_authority().host     == "example.com");
+  BOOST_CHECK(uri.get_authority().port     == "8080");
+  BOOST_CHECK(uri.get_path().size() == 2);
+  BOOST_CHECK(uri.get_path().at(1) == "b c");
+  BOOST_CHECK(uri.get_query().size() == 3);
+  BOOST_CHECK(uri.get_query().Get("k1") == "v&1");
+  std::string flag("-");
+  BOOST_CHECK(uri.get_query().Find("flag", &flag) && flag == "");
+  BOOST_CHECK(uri.get_query().Get("") == "v3");
+  BOOST_CHECK(uri.get_fragment() == "top");
+  // порт по умолчанию и недопустимые символы
+  BOOST_CHECK(uri.ParseVal("http://example.com/a"));
+  BOOST_CHECK(uri.get_authority().port == "80");
+  BOOST_CHECK(not uri.ParseVal("http://example.com:80x/a"));
+  BOOST_CHECK(not uri.ParseVal("http://example.com/a\"b"));
+  BOOST_CHECK(not uri.ParseVal("http://example.com/a?k=<v>"));
+  // строка запроса, как она приходит от клиента
+  BOOST_CHECK(uri.ParseVal("/webui/index.html?action=save&id=15"));
+  BOOST_CHECK(uri.get_path().size() == 2);
+  BOOST_CHECK(uri.get_path().at(0) == "webui");
+  BOOST_CHECK(uri.get_query().Get("action") == "save");
+  BOOST_CHECK(uri.get_query().Get("id") == "15");
+  // '+' в строке запроса - пробел, в пути - обычный символ
+  BOOST_CHECK(uri.ParseVal("/a+b?where=x+%3D+1"));
+  BOOST_CHECK(uri.get_path().at(0) == "a+b");
+  BOOST_CHECK(uri.get_query().Get("where") == "x = 1");
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPDecodeSpanTest) {
+  typedef webapp::ProtocolHTTP Proto;
+  std::string out(64, 0);
+  const std::string kForm("where=name%3D%27a+b%27&x=%E2%82%AC");
+  out.resize(Proto::DecodeString(kForm.data(), kForm.size(), '%', true, &out[0]));
+  BOOST_CHECK(out == "where=name='a b'&x=€");
+  out.resize(64);
+  out.resize(Proto::DecodeString(kForm.data(), kForm.size(), '%', false, &out[0]));
+  BOOST_CHECK(out == "where=name='a+b'&x=€");
+  // ошибочные последовательности и обрыв в конце строки
+  const std::string kBad("%zz%4%a%4a%");
+  out.resize(64);
+  out.resize(Proto::DecodeString(kBad.data(), kBad.size(), '%', false, &out[0]));
+  BOOST_CHECK(out == "%zz%4%aJ%");
+  // декодирование на месте длинной строки с редкими заменами
+  std::string plain(100, 'a');
+  std::string in_place(plain + "%2F" + plain + "+" + plain + "%2f");
+  in_place.resize(Proto::DecodeString(in_place.data(), in_place.size(), '%', true,
+                                      &in_place[0]));
+  BOOST_CHECK(in_place == plain + "/" + plain + " " + plain + "/");
+}
+
+BOOST_AUTO_TEST_CASE(HttpUriQueryStoreTest) {
+  typedef webapp::ProtocolHTTP::Uri Uri;
+  Uri uri;
+  BOOST_CHECK(uri.ParseVal("/a?id=15&id=-7&pi=3.25&on=true&off=0&bad=12x&"
+                           "%D0%BA%D0%BB%D1%8E%D1%87=%D0%B7%D0%BD%D0%B0%D1%87"));
+  const Uri::Query &kQuery = uri.get_query();
+  BOOST_CHECK(kQuery.size() == 7);
+  // повторяющиеся ключи
+  webapp::ProtocolHTTP::ListOfString ids;
+  BOOST_CHECK(kQuery.FindAll("id", &ids) == 2);
+  BOOST_CHECK(ids.front() == "15" && ids.back() == "-7");
+  std::string key;
+  std::string value;
+  kQuery.GetParam(6, &key, &value);
+  BOOST_CHECK(key == "ключ" && value == "знач");
+  BOOST_CHECK(not kQuery.Find("missing", &value));
+  // приведение к типам
+  int64_t num = 0;
+  BOOST_CHECK(kQuery.Get("id", &num) && num == 15);
+  BOOST_CHECK(not kQuery.Get("bad", &num) && num == 15);
+  // границы int64_t, переполнение - ошибка
+  Uri limits;
+  BOOST_CHECK(limits.ParseVal("/l?max=9223372036854775807&min=-9223372036854775808&"
+                              "over=9223372036854775808&under=-9223372036854775809&"
+                              "long=00000000000000000000042"));
+  BOOST_CHECK(limits.get_query().Get("max", &num) &&
+              num == std::numeric_limits<int64_t>::max());
+  BOOST_CHECK(limits.get_query().Get("min", &num) &&
+              num == std::numeric_limits<int64_t>::min());
+  BOOST_CHECK(not limits.get_query().Get("over", &num));
+  BOOST_CHECK(not limits.get_query().Get("under", &num));
+  BOOST_CHECK(limits.get_query().Get("long", &num) && num == 42);
+  num = 15;
+  double real = 0;
+  BOOST_CHECK(kQuery.Get("pi", &real) && real == 3.25);
+  BOOST_CHECK(not kQuery.Get("bad", &real));
+  bool flag = false;
+  BOOST_CHECK(kQuery.Get("on", &flag) && flag);
+  BOOST_CHECK(kQuery.Get("off", &flag) && not flag);
+  BOOST_CHECK(not kQuery.Get("pi", &flag));
+  // параметры сверх встроенного массива
+  std::string url("/b?");
+  for (unsigned id = 0; id < Uri::Query::kInlineParams * 2; id++) {
+    url += "k" + std::to_string(id) + "=" + std::to_string(id) + "&";
+  }
+  BOOST_CHECK(uri.ParseVal(url));
+  BOOST_CHECK(uri.get_query().size() == Uri::Query::kInlineParams * 2);
+  BOOST_CHECK(uri.get_query().Get("k15") == "15");
+  // копия не зависит от исходного Uri
+  Uri copy(uri);
+  BOOST_CHECK(uri.ParseVal("/c"));
+  BOOST_CHECK(uri.get_query().size() == 0);
+  BOOST_CHECK(copy.get_query().Get("k9") == "9");
+  // строка запроса в арене, копия переживает её сброс
+  webapp::Arena arena;
+  BOOST_CHECK(uri.Parse(url, &arena));
+  BOOST_CHECK(arena.Used() >= url.size() - 3);
+  Uri arena_copy(uri);
+  arena.Reset();
+  BOOST_CHECK(arena_copy.get_query().Get("k12") == "12");
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPMultipartStreamTest) {
+  const std::string kPartBoundary("xYz-xYz-1");
+  // данные с началами разделителя, в том числе перекрывающимися
+  const std::string kTricky("a\r\n--xYz-xYz-\r\n\r\n--xY\r\r\n--xYz-xYz-2\r\n-");
+  std::string binary;
+  for (unsigned id = 0; id < 3000; id++) {
+    binary.push_back(static_cast<char>(id * 7 % 251));
+  }
+  const std::string kBody("preamble\r\n"
+    "--" + kPartBoundary + "\r\n"
+    "Content-Disposition: form-data; name=\"tricky\"\r\n\r\n" + kTricky + "\r\n"
+    "--" + kPartBoundary + "  \r\n"
+    "Content-Disposition: form-data; name=\"file\"; filename=\"data.csv\"\r\n"
+    "Content-Type: text/csv\r\n\r\n" + binary + "\r\n"
+    "--" + kPartBoundary + "\r\n"
+    "Content-Disposition: form-data; name=\"empty\"\r\n\r\n\r\n"
+    "--" + kPartBoundary + "--\r\nepilogue");
+  const std::string kReq("POST /upload HTTP/1.1\r\n"
+                         "Content-Type: multipart/form-data; boundary=" + kPartBoundary + "\r\n"
+                         "Content-Length: " + std::to_string(kBody.size()) + "\r\n\r\n" +
+                         kBody);
+  webapp::ProtocolHTTP proto(webapp::ProtocolHTTP::Router::Create());
+  // разбиение на порции разного размера, вплоть до побайтового
+  const size_t kSteps[] = {kReq.size(), 1, 2, 3, 5, 7, 11, 64, 1000};
+  for (size_t id = 0; id < sizeof(kSteps) / sizeof(kSteps[0]); id++) {
+    webapp::ProtocolHTTP::Request req;
+    std::string raw(kReq);
+    for (size_t off = 0; off < raw.size(); off += kSteps[id]) {
+      const size_t kSize = std::min(kSteps[id], raw.size() - off);
+      BOOST_CHECK(proto.ParseRequest((webapp::Protocol::Byte*)&raw[off], kSize, &req));
+    }
+    BOOST_CHECK(req.Completed());
+    std::string value;
+    BOOST_CHECK(req.Post("tricky") != 0);
+    req.Post("tricky")->get_value(&value);
+    BOOST_CHECK(value == kTricky);
+    BOOST_CHECK(req.Post("file") != 0);
+    req.Post("file")->get_value(&value);
+    BOOST_CHECK(value == binary);
+    BOOST_CHECK(req.Post("file")->get_type().sub_type == "csv");
+    req.Post("empty")->get_value(&value);
+    BOOST_CHECK(value == "");
+  }
+  // граница длиннее допустимой
+  webapp::ProtocolHTTP::Request req;
+  std::string bad("POST /upload HTTP/1.1\r\n"
+                  "Content-Type: multipart/form-data; boundary=" + std::string(71, 'b') + "\r\n"
+                  "Content-Length: 4\r\n\r\nbody");
+  BOOST_CHECK(not proto.ParseRequest((webapp::Protocol::Byte*)&bad[0], bad.size(), &req));
+  BOOST_CHECK(req.GetError() == webapp::ProtocolHTTP::k400);
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPFormAndRawBodyTest) {
+  const std::string kForm("name=%D0%B8%D0%BC%D1%8F+%D1%84%D0%B0%D0%BC%D0%B8%D0%BB%D0%B8%D1%8F&"
+                          "flag&&where=a%3D1+AND+b%3C2&bad=%zz&list=1&list=2");
+  const std::string kFormReq("POST /form HTTP/1.1\r\n"
+                             "Content-Type: application/x-www-form-urlencoded\r\n"
+                             "Content-Length: " + std::to_string(kForm.size()) + "\r\n\r\n" +
+                             kForm + "GET / HTTP/1.1\r\n\r\n");
+  webapp::ProtocolHTTP proto(webapp::ProtocolHTTP::Router::Create());
+  // разбиение на порции разного размера, вплоть до побайтового
+  const size_t kSteps[] = {kFormReq.size(), 1, 2, 3, 7};
+  for (size_t id = 0; id < sizeof(kSteps) / sizeof(kSteps[0]); id++) {
+    webapp::ProtocolHTTP::Request req;
+    std::string raw(kFormReq);
+    size_t off = 0;
+    while (off < raw.size() && not req.Completed()) {
+      size_t used = 0;
+      const size_t kSize = std::min(kSteps[id], raw.size() - off);
+      BOOST_CHECK(proto.ParseRequest((webapp::Protocol::Byte*)&raw[off], kSize, &req, &used));
+      off += used;
+    }
+    BOOST_CHECK(req.Completed());
+    // данные за Content-Length принадлежат следующему запросу
+    BOOST_CHECK(raw.substr(off) == "GET / HTTP/1.1\r\n\r\n");
+    BOOST_CHECK(req.GetBody() == 0);
+    std::string value;
+    req.Post("name")->get_value(&value);
+    BOOST_CHECK(value == "имя фамилия");
+    BOOST_CHECK(req.Post("flag") != 0 && req.Post("flag")->Size() == 0);
+    req.Post("where")->get_value(&value);
+    BOOST_CHECK(value == "a=1 AND b<2");
+    req.Post("bad")->get_value(&value);
+    BOOST_CHECK(value == "%zz");
+    // повторный ключ не изменяет значение поля, как и в строке запроса
+    req.Post("list")->get_value(&value);
+    BOOST_CHECK(value == "1");
+  }
+  // данные произвольного типа передаются в хранилище целиком
+  std::string blob;
+  for (unsigned id = 0; id < 2000; id++) {
+    blob.push_back(static_cast<char>(id % 256));
+  }
+  std::string raw("PUT /blob HTTP/1.1\r\n"
+                  "Content-Type: application/octet-stream\r\n"
+                  "Content-Length: " + std::to_string(blob.size()) + "\r\n\r\n" + blob);
+  webapp::ProtocolHTTP::Request req;
+  for (size_t off = 0; off < raw.size(); off += 100) {
+    BOOST_CHECK(proto.ParseRequest((webapp::Protocol::Byte*)&raw[off],
+                                   std::min<size_t>(100, raw.size() - off), &req));
+  }
+  BOOST_CHECK(req.Completed());
+  BOOST_CHECK(req.GetHeader().line.method == webapp::ProtocolHTTP::kPut);
+  BOOST_CHECK(req.GetBody() != 0);
+  std::string body;
+  req.GetBody()->get_value(&body);
+  BOOST_CHECK(body == blob);
+  BOOST_CHECK(req.GetBody()->get_type().sub_type == "octet-stream");
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPCorpusTest) {
+  for (size_t id = 0; id < kHttpCorpusSize; id++) {
+    const HttpCorpusCase &kCase = kHttpCorpus[id];
+    const std::string     kRaw(kCase.raw);
+    const std::string     kWhole = ParseByParts(kRaw, kRaw.size(), kRaw.size());
+    std::ostringstream    error;
+    if (kCase.error != webapp::ProtocolHTTP::k200) {
+      error << "error " << kCase.error;
+    }
+    BOOST_CHECK_MESSAGE(
+      static_cast<size_t>(std::count(kWhole.begin(), kWhole.end(), '\n')) == kCase.requests &&
+      kWhole.substr(kWhole.rfind('\n') + 1) == error.str(),
+      kCase.name << ": " << kWhole);
+    // граница порций на каждом байте не меняет результат
+    for (size_t split = 1; split < kRaw.size(); split++) {
+      const std::string kParts = ParseByParts(kRaw, split, kRaw.size());
+      BOOST_CHECK_MESSAGE(kParts == kWhole, kCase.name << ", " << split << ": " << kParts);
+    }
+    for (size_t step = 1; step < 8; step++) {
+      const std::string kParts = ParseByParts(kRaw, step, step);
+      BOOST_CHECK_MESSAGE(kParts == kWhole, kCase.name << ", " << step << ": " << kParts);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ProtocolHTTPRandomInputTest) {
+  // искажённые запросы набора: разбор завершается запросом или ошибкой, не
+  // выходя за переданные данные (с -fsanitize=address проверяется и это)
+  static const char   kSpecial[] = "\r\n :;,=&%-+\"\t0123456789aAfFzZ\x00\x7f\xff";
+  static const size_t kRounds    = 20000;
+  std::mt19937 random(20160819);
+  for (size_t round = 0; round < kRounds; round++) {
+    std::string data(kHttpCorpus[random() % kHttpCorpusSize].raw);
+    const size_t kMutations = 1 + random() % 4;
+    for (size_t id = 0; id < kMutations && data.size() > 0; id++) {
+      const size_t kPos  = random() % data.size();
+      const size_t kLen  = std::min<size_t>(1 + random() % 16, data.size() - kPos);
+      const char   kByte = (random() % 2 ? kSpecial[random() % (sizeof(kSpecial) - 1)] :
+                                           static_cast<char>(random()));
+      switch (random() % 5) {
+        case 0: data[kPos] = kByte; break;
+        case 1: data.insert(kPos, 1, kByte); break;
+        case 2: data.erase(kPos, kLen); break;
+        case 3: data.insert(kPos, data.substr(kPos, kLen)); break;
+        default: data.resize(kPos); break;
+      }
+    }
+    webapp::ProtocolHTTP proto(webapp::ProtocolHTTP::Router::Create());
+    size_t off = 0;
+    while (off < data.size()) {
+      webapp::ProtocolHTTP::Request req;
+      bool parsed = true;
+      while (parsed && off < data.size() && not req.Completed()) {
+        // копия порции: чтение за её пределами заметно под sanitizer
+        const size_t kSize = 1 + random() % (data.size() - off);
+        boost::scoped_array<webapp::Protocol::Byte> part(new webapp::Protocol::Byte[kSize]);
+        memcpy(part.get(), &data[off], kSize);
+        size_t used = 0;
+        parsed = proto.ParseRequest(part.get(), kSize, &req, &used);
+        BOOST_REQUIRE(used <= kSize);
+        BOOST_REQUIRE(not parsed || (req.Completed() ? used > 0 : used == kSize));
+        off += used;
+      }
+      if (not parsed) {
+        BOOST_REQUIRE(req.GetError() >= webapp::ProtocolHTTP::k400);
+        break;
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ServerLingerAfterErrorTest) {
+  // ответ об ошибке доходит до клиента, даже если тело запроса не прочитано:
+  // соединение закрывается после FIN и чтения оставшихся данных, а не RST
+  const webapp::Server::Backend kBackends[] = {
+    webapp::Server::kBackendAsio,
+    webapp::Server::kBackendIoUring
+  };
+  for (size_t id = 0; id < sizeof(kBackends) / sizeof(kBackends[0]); id++) {
+    int error = 0;
+    const std::string kResp = SendTooLargeBody(kBackends[id], 8094 + id, &error);
+    BOOST_CHECK_MESSAGE(kResp.find("HTTP/1.1 413 Payload Too Large\r\n") == 0,
+                        "backend " << id << ": " << kResp.substr(0, kResp.find('\r')));
+    BOOST_CHECK_MESSAGE(error == 0, "backend " << id << ": " << strerror(error));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(ServerUringCloseWithRecvTest) {
+  typedef std::chrono::steady_clock Clock;
+  static const uint16_t kPort    = 8093;
+  static const size_t   kClients = 200;
+  boost::shared_ptr<MessageCounter> counter(
+    new MessageCounter("Буферы кольца исчерпаны, чтение в буфер сессии"));
+  webapp::ServerHttp       srv(webapp::ProtocolHTTP::Router::Create());
+  webapp::Server::Timeouts timeouts;
+  timeouts.header = 1;
+  srv.SetTimeouts(timeouts);
+  srv.SetBackend(webapp::Server::kBackendIoUring);
+  BOOST_REQUIRE(srv.BindTo(webapp::Server::kLoopbackAddress, kPort, counter));
+  // клиенты передают заголовок, пока сессии не закроются по времени, по
+  // этому в момент закрытия у сессий есть ожидающее чтение; порядок событий
+  // в кольце не определён, поэтому попыток несколько
+  std::vector<int> clients;
+  for (size_t round = 0; round < 3; round++) {
+    const Clock::time_point kStart = Clock::now();
+    while (Clock::now() - kStart < std::chrono::milliseconds(1500)) {
+      for (size_t id = 0; id < 20 && clients.size() < kClients; id++) {
+        clients.push_back(ConnectClient(kPort));
+      }
+      for (size_t id = 0; id < clients.size(); id++) {
+        send(clients[id], "a", 1, MSG_NOSIGNAL);
+      }
+      // шаг таймеров вероятнее всего завершится до обработки принятых данных
+      usleep(5000);
+      srv.Run();
+    }
+    CloseClients(&clients);
+  }
+  // буферы, не возвращённые ядру закрытыми сессиями, закончились бы здесь
+  for (size_t id = 0; id < kClients; id += 20) {
+    for (size_t sub_id = 0; sub_id < 20; sub_id++) {
+      clients.push_back(ConnectClient(kPort));
+    }
+    srv.Run();
+  }
+  for (size_t id = 0; id < clients.size(); id++) {
+    send(clients[id], "G", 1, MSG_NOSIGNAL);
+  }
+  const Clock::time_point kCheck = Clock::now();
+  while (Clock::now() - kCheck < std::chrono::milliseconds(300)) {
+    srv.Run();
+  }
+  BOOST_CHECK(counter->amount == 0);
+  CloseClients(&clients);
+  srv.Unbind();
+}
+
+BOOST_AUTO_TEST_CASE(ServerUringSpliceAbortTest) {
+  // ответ с файлом прерван клиентом, когда часть файла уже в канале сессии;
+  // следующий клиент той же сессии получает свой файл, а не остаток чужого
+  typedef std::chrono::steady_clock Clock;
+  static const uint16_t kPort = 8096;
+  const std::string kDir("webapp_splice_test");
+  const std::string kSmall("small file content");
+  BOOST_REQUIRE(mkdir(kDir.c_str(), 0700) == 0 || errno == EEXIST);
+  FILE *big = fopen((kDir + "/big.txt").c_str(), "wb");
+  BOOST_REQUIRE(big != 0);
+  const std::string kBlock(64 * 1024, 'a');
+  for (size_t id = 0; id < 64; id++) {
+    fwrite(kBlock.data(), 1, kBlock.size(), big);
+  }
+  fclose(big);
+  FILE *small = fopen((kDir + "/small.txt").c_str(), "wb");
+  BOOST_REQUIRE(small != 0);
+  fwrite(kSmall.data(), 1, kSmall.size(), small);
+  fclose(small);
+  webapp::ProtocolHTTP::Router::Ptr router = webapp::ProtocolHTTP::Router::Create();
+  BOOST_REQUIRE(router->AddDirectoryFor("/files", kDir));
+  webapp::ServerHttp srv(router);
+  srv.SetBackend(webapp::Server::kBackendIoUring);
+  BOOST_REQUIRE(srv.BindTo(webapp::Server::kLoopbackAddress, kPort,
+                           webapp::Inspector::Ptr()));
+  const int kFirst = ConnectClient(kPort);
+  BOOST_REQUIRE(kFirst >= 0);
+  const std::string kBigReq("GET /files/big.txt HTTP/1.1\r\n\r\n");
+  send(kFirst, kBigReq.data(), kBigReq.size(), MSG_NOSIGNAL);
+  // клиент не читает ответ, пока сервер не упрётся в буфер сокета
+  Clock::time_point start = Clock::now();
+  while (Clock::now() - start < std::chrono::milliseconds(300)) {
+    srv.Run();
+  }
+  char buff[4096];
+  recv(kFirst, buff, sizeof(buff), 0);
+  linger lin;
+  lin.l_onoff  = 1;
+  lin.l_linger = 0;
+  setsockopt(kFirst, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+  close(kFirst);
+  start = Clock::now();
+  while (Clock::now() - start < std::chrono::milliseconds(300)) {
+    srv.Run();
+  }
+  const int kSecond = ConnectClient(kPort);
+  BOOST_REQUIRE(kSecond >= 0);
+  const std::string kSmallReq("GET /files/small.txt HTTP/1.1\r\nConnection: close\r\n\r\n");
+  send(kSecond, kSmallReq.data(), kSmallReq.size(), MSG_NOSIGNAL);
+  std::string resp;
+  start = Clock::now();
+  while (Clock::now() - start < std::chrono::milliseconds(1000)) {
+    srv.Run();
+    const ssize_t kSize = recv(kSecond, buff, sizeof(buff), 0);
+    if (kSize > 0) {
+      resp.append(buff, kSize);
+    } else if (kSize == 0) {
+      break;
+    }
+  }
+  close(kSecond);
+  srv.Unbind();
+  unlink((kDir + "/big.txt").c_str());
+  unlink((kDir + "/small.txt").c_str());
+  rmdir(kDir.c_str());
+  const size_t kBody = resp.find("\r\n\r\n");
+  BOOST_REQUIRE(kBody != std::string::npos);
+  BOOST_CHECK(resp.substr(kBody + 4) == kSmall);
+}
+
+BOOST_AUTO_TEST_CASE(ServerStopTest) {
+  // Run с несколькими потоками возвращает управление после Stop
+  const webapp::Server::Backend kBackends[] = {
+    webapp::Server::kBackendAsio,
+    webapp::Server::kBackendIoUring
+  };
+  for (size_t id = 0; id < sizeof(kBackends) / sizeof(kBackends[0]); id++) {
+    webapp::ServerHttp srv(webapp::ProtocolHTTP::Router::Create());
+    srv.SetBackend(kBackends[id]);
+    srv.SetWorkersAmount(2);
+    srv.SetShardsAmount(2);
+    BOOST_REQUIRE(srv.BindTo(webapp::Server::kLoopbackAddress, 8097 + id,
+                             webapp::Inspector::Ptr()));
+    boost::thread runner(boost::bind(&webapp::Server::Run, &srv));
+    BOOST_CHECK(not runner.timed_join(boost::posix_time::milliseconds(100)));
+    srv.Stop();
+    BOOST_CHECK_MESSAGE(runner.timed_join(boost::posix_time::milliseconds(2000)),
+                        "backend " << id);
+    srv.Run();
+    srv.Unbind();
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END()